@@ -0,0 +1,111 @@
+// LosslessCodecの圧縮率と速さを測る
+// codecbench [in.wav]  指定がなければ合成した信号を使う
+
+#include "losslesscodec.hpp"
+#include "wavefile.hpp"
+#include "stopwatch.hpp"
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+const double PI = 3.14159265358979323846;
+
+// 16bitの音源と同じく、量子化した値だけを使う
+double quantized(double v)
+{
+    v = std::max(-1.0, std::min(1.0, v));
+    return std::floor(v * 0x7FFF + 0.5) / 0x7FFF;
+}
+
+std::vector<PCMWave> makeBlocks(const std::string& kind, int count)
+{
+    std::mt19937 rand(1);
+    std::normal_distribution<double> noise(0, 1);
+    std::vector<PCMWave> ret;
+    double phase = 0;
+    for(int i = 0;i < count;i++){
+        PCMWave wave;
+        for(int n = 0;n < static_cast<int>(wave.size());n++){
+            double l = 0, r = 0;
+            if(kind == "silence"){
+            }
+            else if(kind == "sine"){
+                l = r = 0.5 * std::sin(phase);
+            }
+            else if(kind == "voice"){
+                // 倍音の多い声に少しの雑音と左右差
+                const double v = 0.3 * std::sin(phase) + 0.15 * std::sin(2 * phase) + 0.07 * std::sin(3 * phase);
+                l = v + 0.003 * noise(rand);
+                r = 0.8 * v + 0.003 * noise(rand);
+            }
+            else{
+                l = 0.2 * noise(rand);
+                r = 0.2 * noise(rand);
+            }
+            phase += 2 * PI * 220 / PCMWave::sampleRate();
+            wave.at(n, 0) = quantized(l);
+            wave.at(n, 1) = quantized(r);
+        }
+        ret.push_back(wave);
+    }
+    return ret;
+}
+
+std::vector<PCMWave> readBlocks(const std::string& filename)
+{
+    WaveInFile infile(filename);
+    std::vector<PCMWave> ret;
+    while(!infile.isEOF())  ret.push_back(infile.read());
+    return ret;
+}
+
+void bench(const std::string& name, const std::vector<PCMWave>& blocks)
+{
+    std::vector<std::vector<char>> encoded(blocks.size());
+    size_t samples = 0, encodedBytes = 0;
+    for(auto& wave : blocks)    samples += wave.size() * wave.channels();
+
+    StopWatch<std::chrono::nanoseconds> encodeWatch;
+    for(size_t i = 0;i < blocks.size();i++)
+        LosslessCodec::encode(blocks[i], encoded[i]);
+    const double encodeNS = encodeWatch.elapsed();
+
+    std::vector<PCMWave> decoded(blocks);
+    StopWatch<std::chrono::nanoseconds> decodeWatch;
+    bool isValid = true;
+    for(size_t i = 0;i < blocks.size();i++)
+        isValid &= LosslessCodec::decode(encoded[i].data(), encoded[i].size(), decoded[i]);
+    const double decodeNS = decodeWatch.elapsed();
+
+    for(size_t i = 0;i < blocks.size();i++){
+        encodedBytes += encoded[i].size();
+        for(size_t n = 0;n < blocks[i].size() * blocks[i].channels();n++)
+            isValid &= blocks[i].raw()[n] == decoded[i].raw()[n];
+    }
+
+    std::cout << std::fixed << std::setprecision(3) <<
+        std::setw(8) << name <<
+        "  vs f64:" << static_cast<double>(samples * sizeof(double)) / encodedBytes <<
+        "  vs i16:" << static_cast<double>(samples * 2) / encodedBytes <<
+        "  enc:" << encodeNS / samples << "ns/sample" <<
+        "  dec:" << decodeNS / samples << "ns/sample" <<
+        (isValid ? "" : "  MISMATCH") << std::endl;
+}
+
+}   // namespace
+
+int main(int argc, char **argv)
+{
+    const int count = 2000;
+    if(argc > 1){
+        bench(argv[1], readBlocks(argv[1]));
+        return 0;
+    }
+    for(auto& kind : {"silence", "sine", "voice", "noise"})
+        bench(kind, makeBlocks(kind, count));
+}
@@ -26,9 +26,9 @@ public:
         dai_ = make_unique<Daisharin>(config_);
     }
 
-    PCMWave proc(const PCMWave& src) override
+    PCMWavePtr proc(PCMWavePtr src) override
     {
-        return std::move(dai_->update(src));
+        return dai_->update(*src);
     }
 };
 
@@ -41,7 +41,7 @@ private:
 
 public:
     SinFakeOutFilter(int f, double v)
-        : sinTable_(PCMWave::SAMPLE_RATE / f, 0), p_(0), v_(v)
+        : sinTable_(PCMWave::sampleRate() / f, 0), p_(0), v_(v)
     {
         int t = sinTable_.size();
         for(int i = 0;i < t;i++){
@@ -52,16 +52,16 @@ public:
 
     void reset() override {}
 
-    PCMWave proc(const PCMWave&) override
+    PCMWavePtr proc(PCMWavePtr) override
     {
         auto& tbl = sinTable_;
-        PCMWave ret;
-        for(auto& s : ret){
+        PCMWavePtr ret = PCMWavePool::getInstance().allocate();
+        for(auto& s : ret.mutate()){
             s.left = tbl.at(p_);
             s.right = tbl.at(p_);
             p_ = (p_ + 1) % tbl.size();
         }
-        return std::move(ret);
+        return ret;
     }
 };
 
@@ -79,23 +79,40 @@ class MicSideGroup : public GroupBase
 private:
     std::string name_;
 
-    std::shared_ptr<MicOutUnit> mic_;
+    // 多チャンネルのデバイスでは一つのMicOutUnitを複数のグループで共有し、
+    // グループごとにChannelSelectFilterで自分のチャンネルを取り出す
+    // その場合sourceの開始と停止はグループの外で行う
+    std::shared_ptr<MicOutUnit> source_;
+    bool ownsSource_;
+    UnitPtr mic_;   // ミュートはここで行う
     std::shared_ptr<VolumeFilter> micVolume_;
 
     std::shared_ptr<FakeFilterSwitchUnit> filters_;    // sin, reverb
 
     std::shared_ptr<PrintInUnit> print_;
-    std::shared_ptr<AsioNetworkSendInUnit> send_;
+    UnitPtr send_;
 
 public:
-    MicSideGroup(const std::string& name, std::unique_ptr<AudioStream> micStream, unsigned short port, const std::string& ipAddr)
-        : name_(name)
+    MicSideGroup(const std::string& name, std::unique_ptr<AudioStream> micStream, const UnitPtr& send)
+        : MicSideGroup(name, std::make_shared<MicOutUnit>(std::move(micStream)), -1, send)
+    {}
+
+    // channelが負ならsourceをこのグループだけで使う
+    // sendはcreateNetworkSendUnit()か、共有のAsioStreamSenderに載せるAsioNetworkSendInUnit
+    MicSideGroup(const std::string& name, const std::shared_ptr<MicOutUnit>& source, int channel, const UnitPtr& send)
+        : name_(name), source_(source), ownsSource_(channel < 0), send_(send)
     {
-        mic_ = std::make_shared<MicOutUnit>(std::move(micStream));
+        if(ownsSource_){
+            mic_ = source_;
+        }
+        else{
+            mic_ = std::make_shared<ChannelSelectFilter>(channel);
+            connect({source_}, {mic_});
+        }
         micVolume_ = std::make_shared<VolumeFilter>();
 
         Daisharin::Config config;
-        config.delayBufferSize = 600 * PCMWave::SAMPLE_RATE / 1000;
+        config.delayBufferSize = 600 * PCMWave::sampleRate() / 1000;
         config.delayPointsSize = 50;
         config.reverbTime = 2000;
         config.tremoloSpeed = 6;
@@ -106,7 +123,12 @@ public:
         }));
 
         print_ = std::make_shared<PrintInUnit>(*this);
-        send_ = std::make_shared<AsioNetworkSendInUnit>(port, ipAddr);
+
+        mic_->setName(name_ + (ownsSource_ ? "/mic" : "/select"));
+        micVolume_->setName(name_ + "/volume");
+        filters_->setName(name_ + "/filters");
+        print_->setName(name_ + "/print");
+        send_->setName(name_ + "/send");
 
         connect({mic_}, {micVolume_});
         connect({micVolume_}, {filters_});
@@ -132,7 +154,8 @@ public:
 
     void start() override
     {
-        mic_->start();
+        if(ownsSource_) source_->start();
+        else    mic_->start();
         micVolume_->start();
         filters_->start();
         print_->start();
@@ -141,7 +164,8 @@ public:
 
     void stop() override
     {
-        mic_->stop();
+        if(ownsSource_) source_->stop();
+        else    mic_->stop();
         micVolume_->stop();
         filters_->stop();
         print_->stop();
@@ -237,6 +261,9 @@ public:
 int main(int argc, char **argv)
 {
     try{
+        setWaveFormatFromArgs(argc, argv);
+        // 3つ目の引数はネットワークを回すスレッドの数。なければコア数
+        if(argc >= 4)   AsioServicePool::setThreadCount(boost::lexical_cast<int>(argv[3]));
         auto audioSystem = std::make_shared<PAAudioSystem>();
         auto& viewSystem = GlutViewSystem::getInstance();
         auto view = std::make_shared<MicView>();
@@ -246,8 +273,18 @@ int main(int argc, char **argv)
         });
 
         std::vector<std::shared_ptr<MicSideGroup>> groups;
+        std::vector<std::shared_ptr<MicOutUnit>> sharedSources;
         std::string input, ip = "127.0.0.1";
         int prevPort = 10000;
+        NetworkTransport transport = NetworkTransport::TCP;
+        std::uint8_t format = wire::SAMPLE_FLOAT64;
+        SendQueueLimit queueLimit;
+        // muxの間は、bgなどのポートの引数を共有の接続の中でのstreamの番号として使う
+        std::shared_ptr<AsioStreamSender> muxSender;
+        auto createSend = [&ip, &transport, &format, &queueLimit, &muxSender](unsigned short port) -> UnitPtr {
+            if(muxSender)   return std::make_shared<AsioNetworkSendInUnit>(muxSender, port);
+            return createNetworkSendUnit(transport, port, ip, format, queueLimit);
+        };
         while(std::getline(std::cin, input)){
             try{
                 const static std::unordered_map<std::string, boost::function<void(const std::vector<std::string>&)>> procs = {
@@ -257,20 +294,70 @@ int main(int argc, char **argv)
                     {"ip", [&ip](const std::vector<std::string>& args) {
                         ip = args.at(1);
                     }},
-                    {"bg",   [&groups, &view, &audioSystem, &ip, &prevPort](const std::vector<std::string>& args) {
+                    // proto tcp|udp|shm  shmは同じホストどうしで、ポートの番号を共有メモリの名前に使う
+                    {"proto", [&transport](const std::vector<std::string>& args) {
+                        transport = parseNetworkTransport(args.at(1));
+                    }},
+                    // codec raw|f32|i24|i16|lossless  以降に作るグループの送り方
+                    {"codec", [&format](const std::vector<std::string>& args) {
+                        format = parseSampleFormat(args.at(1));
+                    }},
+                    // queue <blocks>|<n>ms [oldest|newest|coalesce]  以降に作るTCPの送り待ちの上限
+                    // 今のmuxの接続にも効く
+                    {"queue", [&queueLimit, &muxSender](const std::vector<std::string>& args) {
+                        queueLimit = args.size() >= 3 ?
+                            parseSendQueueLimit(args.at(1), args.at(2)) : parseSendQueueLimit(args.at(1));
+                        if(muxSender)   muxSender->setQueueLimit(queueLimit);
+                    }},
+                    // mux <port>|off  以降に作るグループを一本のTCPの接続にまとめる
+                    {"mux", [&muxSender, &ip, &format, &queueLimit](const std::vector<std::string>& args) {
+                        if(args.at(1) == "off"){
+                            muxSender.reset();
+                            return;
+                        }
+                        muxSender = std::make_shared<AsioStreamSender>(
+                            boost::lexical_cast<unsigned short>(args.at(1)), ip, format, queueLimit);
+                    }},
+                    {"bg",   [&groups, &view, &audioSystem, &prevPort, &createSend](const std::vector<std::string>& args) {
                         int index = boost::lexical_cast<int>(args.at(1));
                         unsigned short port = prevPort = boost::lexical_cast<unsigned short>(args.at(2));
                         auto device = audioSystem->getValidDevices().at(index);
                         auto group = std::make_shared<MicSideGroup>(
                             device->name() + " : " + boost::lexical_cast<std::string>(port),
                             std::move(audioSystem->createInputStream(device)),
-                            port,
-                            ip
+                            createSend(port)
                         );
                         group->start();
                         view->addGroup(group);
                         groups.push_back(group);
                     }},
+                    // 多チャンネルのデバイスを一つのストリームで開き、
+                    // チャンネルごとのグループを連番のポートで作る
+                    {"bgm",  [&groups, &sharedSources, &view, &audioSystem, &prevPort, &createSend](const std::vector<std::string>& args) {
+                        int index = boost::lexical_cast<int>(args.at(1));
+                        int channels = boost::lexical_cast<int>(args.at(2));
+                        unsigned short port = boost::lexical_cast<unsigned short>(args.at(3));
+                        auto device = audioSystem->getValidDevices().at(index);
+                        auto source = std::make_shared<MicOutUnit>(
+                            audioSystem->createInputStream(device, channels));
+                        source->setName(device->name() + "/mic");
+                        std::vector<std::shared_ptr<MicSideGroup>> newGroups;
+                        for(int ch = 0;ch < channels;ch++){
+                            prevPort = port + ch;
+                            newGroups.push_back(std::make_shared<MicSideGroup>(
+                                device->name() + " [" + boost::lexical_cast<std::string>(ch) + "] : "
+                                    + boost::lexical_cast<std::string>(prevPort),
+                                source, ch, createSend(prevPort)
+                            ));
+                        }
+                        for(auto& g : newGroups)    g->start();
+                        source->start();
+                        sharedSources.push_back(source);
+                        for(auto& g : newGroups){
+                            view->addGroup(g);
+                            groups.push_back(g);
+                        }
+                    }},
                     {"bgp", [&prevPort](const std::vector<std::string>& args) {
                         std::vector<std::string> newArgs(args);
                         newArgs.push_back(boost::lexical_cast<std::string>(++prevPort));
@@ -279,6 +366,14 @@ int main(int argc, char **argv)
                     {"sync", [&groups](const std::vector<std::string>& args) {
                             for(auto& g : groups)   g->stop();
                             for(auto& g : groups)   g->start();
+                    }},
+                    // stat [reset]
+                    {"stat", [](const std::vector<std::string>& args) {
+                        if(args.size() >= 2 && args.at(1) == "reset"){
+                            Unit::resetAllStats();
+                            return;
+                        }
+                        Unit::writeAllStats(std::cout);
                     }}
                 };
                 std::vector<std::string> args;
@@ -300,6 +395,7 @@ int main(int argc, char **argv)
         viewSystem.stop();
         viewThread.join();
 
+        for(auto& s : sharedSources)    s->stop();
         for(auto& g : groups)   g->stop();
 
         std::cout << "SUCCESS" << std::endl;
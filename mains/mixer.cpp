@@ -4,8 +4,11 @@
 #include "glutview.hpp"
 #include "error.hpp"
 #include "asio_network.hpp"
+#include "asio_broadcast.hpp"
+#include "scheduler.hpp"
 #include <boost/algorithm/string.hpp>
 #include <iostream>
+#include <mutex>
 
 class MixerView;
 
@@ -15,18 +18,23 @@ class MixerSideGroup : public GroupBase
 private:
     std::string name_;
 
-    std::shared_ptr<AsioNetworkRecvOutUnit> recv_;
+    UnitPtr recv_;
     std::shared_ptr<VolumeFilter> volume_;
     std::shared_ptr<PrintInUnit> print_;
 
 public:
-    MixerSideGroup(unsigned short port, const std::shared_ptr<VolumeFilter>& masterVolume)
-        : name_("conn_" + toString(port))
+    // recvはcreateNetworkRecvUnit()か、共有のAsioStreamReceiverから受けるAsioNetworkRecvOutUnit
+    // listenで他のミキサーの出力を聞くときはcreateBroadcastRecvUnit()
+    MixerSideGroup(const std::string& name, const UnitPtr& recv, const std::shared_ptr<VolumeFilter>& masterVolume)
+        : name_(name), recv_(recv)
     {
-        recv_ = std::make_shared<AsioNetworkRecvOutUnit>(port);
         volume_ = std::make_shared<VolumeFilter>();
         print_ = std::make_shared<PrintInUnit>(*this);
 
+        recv_->setName(name_ + "/recv");
+        volume_->setName(name_ + "/volume");
+        print_->setName(name_ + "/print");
+
         connect({recv_}, {volume_});
         connect({volume_}, {print_, masterVolume});
     }
@@ -138,6 +146,9 @@ public:
 int main(int argc, char **argv)
 {
     try{
+        setWaveFormatFromArgs(argc, argv);
+        // 3つ目の引数はネットワークを回すスレッドの数。なければコア数
+        if(argc >= 4)   AsioServicePool::setThreadCount(boost::lexical_cast<int>(argv[3]));
         auto audioSystem = std::make_shared<PAAudioSystem>();
         auto& viewSystem = GlutViewSystem::getInstance();
         
@@ -149,37 +160,147 @@ int main(int argc, char **argv)
             audioSystem->createOutputStream(devices.at(index)));
 
         auto masterVolume = std::make_shared<VolumeFilter>();
+        speaker->setName("speaker");
+        masterVolume->setName("master/volume");
         auto view = std::make_shared<MixerView>(masterVolume);
 
         connect({masterVolume}, {speaker});
         speaker->start();
         masterVolume->start();
 
+        // スピーカーへの書き込みを時計にしてグラフ全体を回す
+        // 入力ごとの枝はコア数分のスレッドで並列に処理される
+        auto scheduler = std::make_shared<GraphScheduler>(speaker, GraphScheduler::Clock::DEVICE, 0);
+        scheduler->start();
+
+        // serveで受けたグループはネットワークのスレッドから足されるので、groupsはmutexで守る
         std::vector<std::shared_ptr<MixerSideGroup>> groups;
-        boost::thread inputThread([&viewSystem, &audioSystem, &view, &masterVolume, &groups]() {
+        std::mutex groupsMutex;
+        auto addGroup = [&view, &scheduler, &groups, &groupsMutex](const std::shared_ptr<MixerSideGroup>& group) {
+            std::lock_guard<std::mutex> lock(groupsMutex);
+            scheduler->rebuild();
+            group->start();
+            view->addGroup(group);
+            groups.push_back(group);
+        };
+        // castで作る、マスターの出力を配るUnit。一度作ったら繋いだままにする
+        std::shared_ptr<AsioBroadcastSendInUnit> caster;
+        boost::thread inputThread([&viewSystem, &audioSystem, &view, &masterVolume, &groups, &groupsMutex, &scheduler, &addGroup, &caster]() {
             std::string input;
             int prevPort = 10000;
+            NetworkTransport transport = NetworkTransport::TCP;
+            // muxの間は、bgのポートの引数を共有の接続の中でのstreamの番号として使う
+            std::shared_ptr<AsioStreamReceiver> muxReceiver;
+            unsigned short muxPort = 0;
+            // serveの間は、繋いできた送り手のstreamごとにグループを作る
+            std::shared_ptr<AsioStreamReceiver> server;
             while(std::getline(std::cin, input)){
                 try{
                     const static std::unordered_map<std::string, boost::function<void(const std::vector<std::string>&)>> procs = {
-                        {"bg", [&groups, &view, &masterVolume](const std::vector<std::string>& args) {
+                        // proto tcp|udp|shm  shmは同じホストどうしで、ポートの番号を共有メモリの名前に使う
+                        {"proto", [&transport](const std::vector<std::string>& args) {
+                            transport = parseNetworkTransport(args.at(1));
+                        }},
+                        // mux <port>|off  以降に作るグループを一本のTCPの接続から受ける
+                        {"mux", [&muxReceiver, &muxPort](const std::vector<std::string>& args) {
+                            if(args.at(1) == "off"){
+                                muxReceiver.reset();
+                                return;
+                            }
+                            muxPort = boost::lexical_cast<unsigned short>(args.at(1));
+                            muxReceiver = std::make_shared<AsioStreamReceiver>(muxPort);
+                        }},
+                        // serve <port>|off  一つのポートで何台からでも受ける
+                        // 送り手は名乗った番号で区別するので、同じホストの何本のmicからでも受けられる
+                        {"serve", [&server, &masterVolume, &addGroup](const std::vector<std::string>& args) {
+                            if(args.at(1) == "off"){
+                                server.reset();
+                                return;
+                            }
+                            const unsigned short port = boost::lexical_cast<unsigned short>(args.at(1));
+                            // グループがreceiverを持つので、handlerからは弱く参照する
+                            auto holder = std::make_shared<std::weak_ptr<AsioStreamReceiver>>();
+                            server = std::make_shared<AsioStreamReceiver>(port,
+                                [holder, &masterVolume, &addGroup](const std::string& peer, std::uint16_t stream) {
+                                    auto receiver = holder->lock();
+                                    if(!receiver)   return;
+                                    addGroup(std::make_shared<MixerSideGroup>(
+                                        peer + "/" + toString(stream),
+                                        std::make_shared<AsioNetworkRecvOutUnit>(receiver, stream, peer),
+                                        masterVolume
+                                    ));
+                                });
+                            *holder = server;
+                        }},
+                        {"bg", [&masterVolume, &transport, &muxReceiver, &muxPort, &addGroup](const std::vector<std::string>& args) {
                             unsigned short port = boost::lexical_cast<unsigned short>(args.at(1));
-                            auto group = std::make_shared<MixerSideGroup>(
-                                port,
+                            auto group = muxReceiver ?
+                                std::make_shared<MixerSideGroup>(
+                                    "mux_" + toString(muxPort) + "/" + toString(port),
+                                    std::make_shared<AsioNetworkRecvOutUnit>(muxReceiver, port),
+                                    masterVolume
+                                ) :
+                                std::make_shared<MixerSideGroup>(
+                                    "conn_" + toString(port),
+                                    createNetworkRecvUnit(transport, port),
+                                    masterVolume
+                                );
+                            addGroup(group);
+                        }},
+                        // cast <port> [group] [format]|on|off  マスターの出力を何台にでも配る
+                        // groupを渡せばマルチキャストでも送る。聞き手は相手のミキサーでlistenする
+                        {"cast", [&caster, &masterVolume, &scheduler](const std::vector<std::string>& args) {
+                            if(args.at(1) == "off" || args.at(1) == "on"){
+                                if(!caster) return;
+                                if(args.at(1) == "off") caster->stop();
+                                else                    caster->start();
+                                return;
+                            }
+                            if(caster){
+                                std::cout << "ALREADY CASTING" << std::endl;
+                                return;
+                            }
+                            const unsigned short port = boost::lexical_cast<unsigned short>(args.at(1));
+                            const std::string group = args.size() >= 3 && args.at(2) != "-" ? args.at(2) : "";
+                            const std::uint8_t format = args.size() >= 4 ? parseSampleFormat(args.at(3)) : wire::SAMPLE_FLOAT32;
+                            caster = std::make_shared<AsioBroadcastSendInUnit>(port, group, format);
+                            caster->setName("master/cast");
+                            connect({masterVolume}, {caster});
+                            scheduler->rebuild();
+                            caster->start();
+                        }},
+                        // listen <ipaddr> <port>  castしている相手を聞く。ipaddrがマルチキャストのグループならUDPで受ける
+                        {"listen", [&masterVolume, &addGroup](const std::vector<std::string>& args) {
+                            const std::string ipaddr = args.at(1);
+                            const unsigned short port = boost::lexical_cast<unsigned short>(args.at(2));
+                            addGroup(std::make_shared<MixerSideGroup>(
+                                "cast_" + ipaddr + "/" + toString(port),
+                                createBroadcastRecvUnit(port, ipaddr),
                                 masterVolume
-                            );
-                            group->start();
-                            view->addGroup(group);
-                            groups.push_back(group);
+                            ));
                         }},
                         {"bgp", [&prevPort](const std::vector<std::string>& args) {
                             std::vector<std::string> newArgs(args);
                             newArgs.push_back(boost::lexical_cast<std::string>(++prevPort));
                             procs.at("bg")(newArgs);
                         }},
-                        {"sync", [&groups](const std::vector<std::string>& args) {
+                        {"sync", [&groups, &groupsMutex](const std::vector<std::string>& args) {
+                            std::lock_guard<std::mutex> lock(groupsMutex);
                             for(auto& g : groups)   g->stop();
                             for(auto& g : groups)   g->start();
+                        }},
+                        // stat [reset]
+                        {"stat", [&scheduler](const std::vector<std::string>& args) {
+                            if(args.size() >= 2 && args.at(1) == "reset"){
+                                Unit::resetAllStats();
+                                return;
+                            }
+                            std::cout <<
+                                "scheduler cycles:" << scheduler->getCycleCount() <<
+                                " last:" << scheduler->getLastCycleTime() << "us" <<
+                                " max:" << scheduler->getMaxCycleTime() << "us" <<
+                                " nodes:" << scheduler->getScheduleSize() << std::endl;
+                            Unit::writeAllStats(std::cout);
                         }}
                     };
                     std::vector<std::string> args;
@@ -203,9 +324,18 @@ int main(int argc, char **argv)
         });
         viewSystem.run();
 
+        scheduler->stop();
         speaker->stop();
         masterVolume->stop();
-        for(auto& g : groups)   g->stop();
+        if(caster)  caster->stop();
+        // receiverを片付けるとそのhandlerの終わりを待つので、lockの外で捨てる
+        std::vector<std::shared_ptr<MixerSideGroup>> remaining;
+        {
+            std::lock_guard<std::mutex> lock(groupsMutex);
+            remaining.swap(groups);
+        }
+        for(auto& g : remaining)    g->stop();
+        remaining.clear();
 
         std::cout << "SUCCESS" << std::endl;
     }
@@ -86,6 +86,7 @@ public:
 // recorder
 int main(int argc, char **argv)
 {
+    setWaveFormatFromArgs(argc, argv);
     std::shared_ptr<AudioSystem> system(std::make_shared<PAAudioSystem>());
 
     // User input
@@ -0,0 +1,360 @@
+#include "asio_broadcast.hpp"
+#include "helper.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+AsioBroadcastSendInUnit::AsioBroadcastSendInUnit(unsigned short port, const std::string& group, std::uint8_t format)
+    : format_(format), isRunning_(false), seq_(0),
+      subscriberCount_(0), encoded_(0), dropped_(0), rejected_(0)
+{
+    acceptor_ = createAcceptor(port);
+    if(!group.empty()){
+        groupEndpoint_ = boost::asio::ip::udp::endpoint(boost::asio::ip::address::from_string(group), port);
+        udpSocket_ = createUdpSocket();
+        // 同じホストの聞き手にも届ける
+        udpSocket_->set_option(boost::asio::ip::multicast::enable_loopback(true));
+    }
+}
+
+AsioBroadcastSendInUnit::~AsioBroadcastSendInUnit()
+{
+    // 待ちを全部終わらせないとkill()が返らない
+    postProc([this]() {
+        isRunning_ = false;
+        acceptor_->close();
+        while(!subscribers_.empty())    removeSubscriber(subscribers_.front());
+    });
+    kill();
+}
+
+std::shared_ptr<EncodedWave> AsioBroadcastSendInUnit::acquire()
+{
+    for(auto& encoded : pool_){
+        if(encoded.use_count() == 1){
+            // 最後に持っていた書き込みが読み終えてから触る
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return encoded;
+        }
+    }
+    pool_.push_back(std::make_shared<EncodedWave>());
+    return pool_.back();
+}
+
+EncodedWavePtr AsioBroadcastSendInUnit::encode(const PCMWavePtr& wave)
+{
+    auto ret = acquire();
+    ret->wave = wave;
+    ret->seq = seq_++;
+    FrameCodec<WaveData>::storePrefix(*wave, format_, ret->seq, ret->prefix.data());
+    const auto body = FrameCodec<WaveData>::encodeBody(*wave, format_, ret->scratch);
+    ret->body = body.first;
+    ret->length = body.second;
+    if(udpSocket_)  storeFragmentHeads(*wave, format_, ret->seq, ret->length, ret->fragmentHeads);
+    encoded_.fetch_add(1, std::memory_order_relaxed);
+    return ret;
+}
+
+void AsioBroadcastSendInUnit::sendMulticast(const EncodedWave& encoded)
+{
+    for(size_t i = 0;i < encoded.fragmentHeads.size();i++){
+        const size_t offset = i * wire::FRAGMENT_PAYLOAD_SIZE;
+        std::array<boost::asio::const_buffer, 2> buffers = {{
+            boost::asio::buffer(encoded.fragmentHeads[i]),
+            boost::asio::buffer(encoded.body + offset, std::min<size_t>(wire::FRAGMENT_PAYLOAD_SIZE, encoded.length - offset))
+        }};
+        boost::system::error_code error;
+        udpSocket_->send_to(buffers, groupEndpoint_, 0, error);
+        if(error){
+            // 一つでも欠けたら聞き手では組み立てられない
+            std::cout << "UDP_SEND_ERROR: " << error.message() << std::endl;
+            recordDrop();
+            return;
+        }
+    }
+}
+
+void AsioBroadcastSendInUnit::startAccept()
+{
+    auto conn = createConnection();
+    acceptor_->async_accept(conn->getSocket(), wrap([this, conn](const boost::system::error_code& error) {
+        if(error){
+            if(error != boost::asio::error::operation_aborted)
+                std::cout << "ASYNC_ACCEPT_ERROR: " << error.message() << std::endl;
+            return;
+        }
+        if(!isRunning_){
+            conn->close();
+            return;
+        }
+        startHandshake(conn);
+        startAccept();
+    }));
+}
+
+void AsioBroadcastSendInUnit::startHandshake(const ConnectionPtr& conn)
+{
+    // 聞き手の形を確かめて、結果とこちらの送る形を返す
+    conn->asyncRead<HelloData>(wrap([this, conn](const boost::system::error_code& error, const boost::optional<HelloData>& hello) {
+        if(error || !hello){
+            if(error == boost::asio::error::invalid_argument)   rejected_.fetch_add(1, std::memory_order_relaxed);
+            std::cout << "HANDSHAKE_ERROR: " << error.message() << std::endl;
+            conn->close();
+            return;
+        }
+
+        const std::uint8_t status = hello->check();
+        conn->asyncWrite<HelloData>(HelloData::current(format_, status),
+            wrap([this, conn, status](const boost::system::error_code& error, const boost::optional<HelloData>&) {
+                if(error || status != wire::HELLO_OK || !isRunning_){
+                    std::cout << "HANDSHAKE_ERROR: " << (error ? error.message() : "session format mismatch") << std::endl;
+                    conn->close();
+                    return;
+                }
+
+                auto sub = std::make_shared<Subscriber>();
+                sub->conn = conn;
+                boost::system::error_code endpointError;
+                sub->peer = conn->getSocket().remote_endpoint(endpointError).address().to_string();
+                sub->queue.set_capacity(MAX_QUEUE_BLOCKS + MAX_BATCH_BLOCKS);
+                sub->inFlight = 0;
+                subscribers_.push_back(sub);
+                subscriberCount_ = subscribers_.size();
+            })
+        );
+    }));
+}
+
+void AsioBroadcastSendInUnit::startSend(const SubscriberPtr& sub)
+{
+    // 書き込み中に溜まった分をまとめて書く。符号は全員で同じものを指す
+    sub->batch.clear();
+    for(auto it = sub->queue.begin();it != sub->queue.end() && sub->batch.size() < MAX_BATCH_BLOCKS;++it)
+        sub->batch.push_back(*it);
+    sub->inFlight = sub->batch.size();
+
+    sub->conn->asyncWrite<EncodedWavePtr>(sub->batch,
+        wrap([this, sub](const boost::system::error_code& error, const boost::optional<EncodedWavePtr>&) {
+            // 外した後に終わった書き込み
+            if(std::find(subscribers_.begin(), subscribers_.end(), sub) == subscribers_.end())  return;
+            sub->queue.erase_begin(sub->inFlight);
+            sub->inFlight = 0;
+            if(error){
+                std::cout << "ASYNC_WRITE_ERROR: " << sub->peer << " " << error.message() << std::endl;
+                removeSubscriber(sub);
+                return;
+            }
+            if(!sub->queue.empty()) startSend(sub);
+        })
+    );
+}
+
+void AsioBroadcastSendInUnit::removeSubscriber(const SubscriberPtr& sub)
+{
+    auto it = std::find(subscribers_.begin(), subscribers_.end(), sub);
+    if(it == subscribers_.end())    return;
+    sub->conn->close();
+    sub->queue.clear();
+    subscribers_.erase(it);
+    subscriberCount_ = subscribers_.size();
+}
+
+void AsioBroadcastSendInUnit::broadcast(const PCMWavePtr& wave)
+{
+    if(!isRunning_ || (!udpSocket_ && subscribers_.empty()))   return;
+
+    const auto encoded = encode(wave);
+    if(udpSocket_)  sendMulticast(*encoded);
+
+    for(auto& sub : subscribers_){
+        // 遅い聞き手は、書き込みに渡していないものの古い方から捨てる
+        if(sub->queue.size() - sub->inFlight >= MAX_QUEUE_BLOCKS){
+            sub->queue.erase(sub->queue.begin() + sub->inFlight);
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+        sub->queue.push_back(encoded);
+        if(sub->inFlight == 0)  startSend(sub);
+    }
+}
+
+void AsioBroadcastSendInUnit::startImpl()
+{
+    postProc([this]() {
+        isRunning_ = true;
+        seq_ = 0;
+        startAccept();
+    });
+}
+
+void AsioBroadcastSendInUnit::stopImpl()
+{
+    postProc([this]() {
+        isRunning_ = false;
+        acceptor_->cancel();
+        while(!subscribers_.empty())    removeSubscriber(subscribers_.front());
+    });
+}
+
+void AsioBroadcastSendInUnit::inputImpl(PCMWavePtr wave)
+{
+    postProc([this, wave]() { broadcast(wave); });
+}
+
+void AsioBroadcastSendInUnit::writeStatsImpl(std::ostream& os)
+{
+    os << "    subscribers:" << subscriberCount_ <<
+        " group:" << (udpSocket_ ? groupEndpoint_.address().to_string() : "-") <<
+        " encoded:" << encoded_ <<
+        " overflow:" << dropped_ <<
+        " rejected:" << rejected_ << std::endl;
+}
+
+///
+
+AsioBroadcastRecvOutUnit::AsioBroadcastRecvOutUnit(unsigned short port, const std::string& ipaddr)
+    : port_(port), ipaddr_(ipaddr),
+      drift_(std::chrono::microseconds(1000000LL * PCMWave::bufferSize() / PCMWave::sampleRate()))
+{}
+
+AsioBroadcastRecvOutUnit::~AsioBroadcastRecvOutUnit()
+{
+    postProc([this]() { closeConnect(); });
+    kill();
+}
+
+void AsioBroadcastRecvOutUnit::startConnect()
+{
+    conn_ = createConnection();
+    auto conn = conn_;
+    conn->getSocket().async_connect(
+        boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string(ipaddr_), port_),
+        wrap([this, conn](const boost::system::error_code& error) {
+            if(conn != conn_)   return;
+            if(error){
+                std::cout << "ASYNC_CONNECT_ERROR: " << error.message() << std::endl;
+                return;
+            }
+            startHandshake();
+        })
+    );
+}
+
+void AsioBroadcastRecvOutUnit::startHandshake()
+{
+    // こちらの形を伝え、返事が同じ形で、送る形式が分かるものなら聞き始める
+    auto conn = conn_;
+    conn->asyncWrite<HelloData>(HelloData::current(wire::SAMPLE_FLOAT64), wrap([this, conn](const boost::system::error_code& error, const boost::optional<HelloData>&) {
+        if(conn != conn_)   return;
+        if(error){
+            std::cout << "HANDSHAKE_ERROR: " << error.message() << std::endl;
+            closeConnect();
+            return;
+        }
+        conn->asyncRead<HelloData>(wrap([this, conn](const boost::system::error_code& error, const boost::optional<HelloData>& hello) {
+            if(conn != conn_)   return;
+            if(error || !hello){
+                std::cout << "HANDSHAKE_ERROR: " << error.message() << std::endl;
+                closeConnect();
+                return;
+            }
+            if(hello->status != wire::HELLO_OK || hello->check() != wire::HELLO_OK){
+                std::cout << "HANDSHAKE_ERROR: session format mismatch (local " <<
+                    PCMWave::sampleRate() << "Hz/" << PCMWave::bufferSize() << ", remote " <<
+                    hello->sampleRate << "Hz/" << hello->bufferSize << ")" << std::endl;
+                closeConnect();
+                return;
+            }
+            // 繋ぎ直したら、相手の時計も溜まり具合も連番も変わっているので測り直す
+            concealer_.reset();
+            transit_.reset();
+            drift_.reset();
+            setSocketStatus(true);
+            startRead();
+        }));
+    }));
+}
+
+void AsioBroadcastRecvOutUnit::startRead()
+{
+    auto conn = conn_;
+    conn->asyncReadLoop<WaveData>(wrap([this, conn](const boost::system::error_code& error,
+                                                    const Connection::FrameBatchPtr<WaveData>& frames) {
+        if(conn != conn_)   return;
+        for(auto& wave : *frames)   receive(wave);
+        if(error){
+            std::cout << "ASYNC_RECV_ERROR: " << ipaddr_ << " " << error.message() << std::endl;
+            closeConnect();
+        }
+    }));
+}
+
+void AsioBroadcastRecvOutUnit::receive(const WaveData& wave)
+{
+    if(wave.data->size() != PCMWave::bufferSize()){
+        std::cout << "ASYNC_RECV_ERROR: buffer size mismatch (" << wave.data->size() << ")" << std::endl;
+        recordDrop();
+        return;
+    }
+    transit_.record(wave.data->captureTime());
+
+    // 下流に目標ほど溜まっていなければ、その分だけは抜けを埋めても遅れは伸びない
+    const auto drift = drift_.getStats();
+    const int target = drift.isLocked ? static_cast<int>(std::ceil(drift.targetDepth)) : 1;
+    concealer_.push(wave.seq, wave.data, target - getOutputQueueDepth(), concealed_);
+
+    for(auto& block : concealed_){
+        drift_.push(block, getOutputQueueDepth(), compensated_);
+        for(auto& w : compensated_) send(std::move(w));
+        compensated_.clear();
+    }
+    concealed_.clear();
+}
+
+void AsioBroadcastRecvOutUnit::closeConnect()
+{
+    if(conn_)   conn_->close();
+    conn_.reset();
+    setSocketStatus(false);
+}
+
+void AsioBroadcastRecvOutUnit::startImpl()
+{
+    setSocketStatus(false);
+    postProc([this]() { startConnect(); });
+}
+
+void AsioBroadcastRecvOutUnit::stopImpl()
+{
+    postProc([this]() { closeConnect(); });
+}
+
+void AsioBroadcastRecvOutUnit::writeStatsImpl(std::ostream& os)
+{
+    const auto drift = drift_.getStats();
+    const auto loss = concealer_.getStats();
+    const auto transit = transit_.getStats();
+    os << "    cast:" << ipaddr_ << "/" << port_ << std::endl;
+    os << "    recv:" << loss.received <<
+        " lost:" << loss.lost <<
+        " reordered:" << loss.reordered <<
+        " concealed:" << loss.concealed <<
+        " restarted:" << loss.restarted << std::endl;
+    os << "    latency:" << transit.latencyUS << "us" <<
+        " min:" << transit.minLatencyUS << "us" <<
+        " max:" << transit.maxLatencyUS << "us" <<
+        " jitter:" << transit.jitterUS << "us" << std::endl;
+    os << "    drift:" << drift.driftPPM << "ppm" <<
+        " ratio:" << drift.ratioPPM << "ppm" <<
+        " depth:" << drift.depth << "/";
+    if(drift.isLocked)  os << drift.targetDepth << std::endl;
+    else                os << "-" << std::endl;
+}
+
+///
+
+UnitPtr createBroadcastRecvUnit(unsigned short port, const std::string& ipaddr)
+{
+    if(boost::asio::ip::address::from_string(ipaddr).is_multicast())
+        return std::make_shared<AsioUdpRecvOutUnit>(port, ipaddr);
+    return std::make_shared<AsioBroadcastRecvOutUnit>(port, ipaddr);
+}
@@ -0,0 +1,160 @@
+#pragma once
+#ifndef ___ASIO_BROADCAST_HPP___
+#define ___ASIO_BROADCAST_HPP___
+
+// ミキサーの出力を何台の聞き手にでも配る
+//
+// ブロックは一度だけ符号化し、その一つの符号を全ての聞き手で共有する
+//   UDP: マルチキャストのグループへ断片を一度ずつ送る。何台が聞いていても送るのは一度
+//        聞き手はAsioUdpRecvOutUnitにグループを渡して受ける
+//   TCP: マルチキャストの届かない聞き手は、AsioBroadcastRecvOutUnitでこちらへ繋ぐ
+//        接続ごとにヘッダを書くだけで、符号はそのまま指して書く
+// 遅い聞き手は待たずに、その聞き手のキューの古いものから捨てる。抜けは聞き手が埋める
+
+#include "asio_network.hpp"
+#include <boost/circular_buffer.hpp>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+// 一度だけ符号化したブロック
+// 作って配った後は書き換えないので、いくつの書き込みから指していてもよい
+struct EncodedWave
+{
+    // FLOAT64でlittle endianのホストなら、bodyはこのブロックの中身を指す
+    PCMWavePtr wave;
+    std::uint32_t seq;
+    std::array<char, FrameCodec<WaveData>::PREFIX_SIZE> prefix;
+    std::vector<char> scratch;
+    const char *body;
+    size_t length;
+    // マルチキャストで送るときだけ作る
+    std::vector<FragmentHead> fragmentHeads;
+};
+using EncodedWavePtr = std::shared_ptr<const EncodedWave>;
+
+// 符号化済みのものをWAVEフレームとして書く。送るだけで、受ける側はWaveDataとして読む
+template<>
+struct FrameCodec<EncodedWavePtr>
+{
+    enum {
+        TYPE = wire::FRAME_WAVE,
+        PREFIX_SIZE = FrameCodec<WaveData>::PREFIX_SIZE,
+    };
+
+    static std::uint16_t stream(const EncodedWavePtr&) { return 0; }
+
+    static size_t encode(const EncodedWavePtr& t, char *prefix, std::vector<char>&,
+                         std::vector<boost::asio::const_buffer>& buffers)
+    {
+        std::copy(t->prefix.begin(), t->prefix.end(), prefix);
+        buffers.push_back(boost::asio::buffer(t->body, t->length));
+        return t->length;
+    }
+};
+
+// 受け取ったものを符号化して配る
+// portはTCPで聞き手を待ち受けるのと、マルチキャストの宛先に使う
+// groupが空ならマルチキャストでは送らない
+class AsioBroadcastSendInUnit : public Unit, private AsioNetworkBase
+{
+private:
+    enum {
+        // 聞き手ごとに、書き込みを待てるブロックの数。溢れたら古いものから捨てる
+        MAX_QUEUE_BLOCKS = 16,
+        // 一回の書き込みにまとめるブロックの数
+        MAX_BATCH_BLOCKS = 8,
+    };
+
+    struct Subscriber
+    {
+        ConnectionPtr conn;
+        std::string peer;
+        // 先頭のinFlight個は書き込み中
+        // 待ちはMAX_QUEUE_BLOCKS、書き込み中はMAX_BATCH_BLOCKSを超えないので、その分だけ取っておく
+        boost::circular_buffer<EncodedWavePtr> queue;
+        size_t inFlight;
+        // 書き込みに渡す入れ物。接続と取り替えながら使い回す
+        std::vector<EncodedWavePtr> batch;
+    };
+    using SubscriberPtr = std::shared_ptr<Subscriber>;
+
+private:
+    const std::uint8_t format_;
+    // groupがなければudpSocket_はない
+    boost::asio::ip::udp::endpoint groupEndpoint_;
+    std::unique_ptr<boost::asio::ip::udp::socket> udpSocket_;
+    // 以下はstrandの中だけで触る
+    std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor_;
+    bool isRunning_;
+    std::vector<SubscriberPtr> subscribers_;
+    // 誰も指さなくなったものを使い回す
+    std::vector<std::shared_ptr<EncodedWave>> pool_;
+    std::uint32_t seq_;
+
+    std::atomic<int> subscriberCount_;
+    std::atomic<std::uint64_t> encoded_, dropped_, rejected_;
+
+private:
+    std::shared_ptr<EncodedWave> acquire();
+    EncodedWavePtr encode(const PCMWavePtr& wave);
+    void sendMulticast(const EncodedWave& encoded);
+    void startAccept();
+    void startHandshake(const ConnectionPtr& conn);
+    void startSend(const SubscriberPtr& sub);
+    void removeSubscriber(const SubscriberPtr& sub);
+    void broadcast(const PCMWavePtr& wave);
+
+public:
+    AsioBroadcastSendInUnit(unsigned short port, const std::string& group = "", std::uint8_t format = wire::SAMPLE_FLOAT32);
+    ~AsioBroadcastSendInUnit();
+
+    void startImpl();
+    void stopImpl();
+    void inputImpl(PCMWavePtr wave);
+    void writeStatsImpl(std::ostream& os);
+
+    int getSubscriberCount() const { return subscriberCount_; }
+    std::uint64_t getEncodedCount() const { return encoded_; }
+    std::uint64_t getDroppedCount() const { return dropped_; }
+};
+
+// AsioBroadcastSendInUnitへTCPで繋いで聞く
+// 届いたブロックは、連番の抜けを埋め、送り手との時計のずれを打ち消してから流す
+class AsioBroadcastRecvOutUnit : public Unit, private AsioNetworkBase
+{
+private:
+    const unsigned short port_;
+    const std::string ipaddr_;
+    TransitMeter transit_;
+    // 以下はstrandの中だけで触る
+    ConnectionPtr conn_;
+    LossConcealer concealer_;
+    DriftCompensator drift_;
+    std::vector<PCMWavePtr> concealed_, compensated_;
+
+private:
+    void startConnect();
+    void startHandshake();
+    void startRead();
+    void receive(const WaveData& wave);
+    void closeConnect();
+
+public:
+    AsioBroadcastRecvOutUnit(unsigned short port, const std::string& ipaddr);
+    ~AsioBroadcastRecvOutUnit();
+
+    void startImpl();
+    void stopImpl();
+    void writeStatsImpl(std::ostream& os);
+
+    LossConcealer::Stats getLossStats() const { return concealer_.getStats(); }
+    TransitMeter::Stats getTransitStats() const { return transit_.getStats(); }
+};
+
+// ipaddrがマルチキャストのグループならUDPで、そうでなければTCPで聞くUnitを作る
+UnitPtr createBroadcastRecvUnit(unsigned short port, const std::string& ipaddr);
+
+#endif
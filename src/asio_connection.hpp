@@ -2,36 +2,204 @@
 #ifndef ___CONNECTION_HPP___
 #define ___CONNECTION_HPP___
 
-//#include <boost/archive/binary_iarchive.hpp>
-//#include <boost/archive/binary_oarchive.hpp>
-#include "eos/portable_iarchive.hpp"
-#include "eos/portable_oarchive.hpp"
+#include "wireformat.hpp"
 #include <boost/asio.hpp>
-#include <boost/bind.hpp>
 #include <boost/function.hpp>
 #include <boost/optional.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
 #include <array>
-#include <iomanip>
+#include <atomic>
 #include <memory>
-#include <sstream>
 #include <string>
+#include <type_traits>
 #include <vector>
 
-class Connection
+// 非同期の操作がhandlerを置く場所を使い回す  // thread safe
+// slotSizeまでのものを同時にslotCount個まで置ける。足りないときと大きすぎるときは普通に確保する
+class HandlerMemory
 {
 private:
-    enum {
-        HEADER_LENGTH = 8,
-    };
+    using Unit = std::aligned_storage<64>::type;
+
+private:
+    const int slotCount_;
+    const size_t slotUnits_;
+    std::unique_ptr<Unit[]> units_;
+    std::unique_ptr<std::atomic<bool>[]> inUse_;
+
+    HandlerMemory(const HandlerMemory&);
+    HandlerMemory& operator=(const HandlerMemory&);
+
+public:
+    HandlerMemory(int slotCount, size_t slotSize)
+        : slotCount_(slotCount), slotUnits_((slotSize + sizeof(Unit) - 1) / sizeof(Unit)),
+          units_(new Unit[slotCount * slotUnits_]), inUse_(new std::atomic<bool>[slotCount])
+    {
+        for(int i = 0;i < slotCount_;i++)   inUse_[i].store(false, std::memory_order_relaxed);
+    }
+
+    void *allocate(std::size_t size)
+    {
+        if(size <= slotUnits_ * sizeof(Unit)){
+            for(int i = 0;i < slotCount_;i++){
+                if(!inUse_[i].exchange(true, std::memory_order_acquire))    return &units_[i * slotUnits_];
+            }
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void *p)
+    {
+        const Unit *u = static_cast<const Unit *>(p);
+        if(units_.get() <= u && u < units_.get() + slotCount_ * slotUnits_){
+            inUse_[(u - units_.get()) / slotUnits_].store(false, std::memory_order_release);
+            return;
+        }
+        ::operator delete(p);
+    }
+};
+
+// handlerを包んで、asioがその置き場所をmemoryから取るようにする
+// memoryは包んだhandlerが全て捨てられるまで生かしておくこと
+template<class Handler>
+class AllocHandler
+{
+private:
+    HandlerMemory *memory_;
+    Handler handler_;
+
+public:
+    AllocHandler(HandlerMemory& memory, Handler handler)
+        : memory_(&memory), handler_(std::move(handler))
+    {}
+
+    template<class... Args> void operator()(Args&&... args)
+    {
+        handler_(std::forward<Args>(args)...);
+    }
+
+    friend void *asio_handler_allocate(std::size_t size, AllocHandler *self)
+    {
+        return self->memory_->allocate(size);
+    }
+
+    friend void asio_handler_deallocate(void *p, std::size_t, AllocHandler *self)
+    {
+        self->memory_->deallocate(p);
+    }
+};
 
+template<class Handler> AllocHandler<Handler> allocHandler(HandlerMemory& memory, Handler handler)
+{
+    return AllocHandler<Handler>(memory, std::move(handler));
+}
+
+// wireformat.hppのフレームを送受信する
+// Tごとの中身の詰め方はFrameCodec<T>に任せる
+// 非同期の操作は終わるまでConnectionを生かしておくので、途中で手放してもよい
+// socketに触るのは接続ごとのstrandの中だけなので、共有のio_serviceを何本のスレッドが回していてもよい
+// 変換もこのstrandで行い、呼び出し元のhandlerは渡されたまま呼ぶ（strandに載せるのは呼び出し元の仕事）
+// 流れ続けるフレームは、まとめて書いてまとめて読む
+//   書き: いくつものフレームを一つのasync_writeで書く
+//   読み: 一度に届いた分から、揃ったフレームを全部取り出す
+// 流れ続けている間はヒープを使わない
+//   書き: 入れ物と書き込みの状態は接続が持って使い回す
+//   読み: 読み続ける間の状態を一つだけ作り、フレームの束も使い回す
+//   asioの操作の置き場所は、読みと書きそれぞれのHandlerMemoryから取る
+class Connection : public std::enable_shared_from_this<Connection>
+{
 public:
     template<class T> using AsyncHandler = boost::function<void(const boost::system::error_code&, const boost::optional<T>&)>;
-    template<class T> using AsyncHandlerPtr = std::shared_ptr<AsyncHandler<T>>;
-    using HeaderBuffer = std::array<char, HEADER_LENGTH>;
-    using BodyBuffer = std::vector<char>;
+    // 読み続けるときに渡すフレームの束
+    // 接続が使い回すので、handlerから返った後も要るものはコピーして持つこと
+    template<class T> using FrameBatchPtr = std::shared_ptr<const std::vector<T>>;
+    template<class T> using AsyncBatchHandler = boost::function<void(const boost::system::error_code&, const FrameBatchPtr<T>&)>;
+    using HeadBuffer = std::array<char, wire::MAX_HEAD_SIZE>;
+
+private:
+    enum {
+        READ_BUFFER_SIZE = 64 * 1024,
+        // 読み書きそれぞれで、同時に置いておけるhandlerの数と大きさ
+        // 書き込みの操作はバッファの列の写しを抱えるので大きい
+        HANDLER_SLOT_COUNT = 4,
+        HANDLER_SLOT_SIZE = 2048,
+    };
+
+    // asioにstd::vectorのバッファ列を渡すと、書き終わるまでの間に列ごとコピーされるので、
+    // 状態の中の列を指すだけのものを渡す
+    struct ConstBufferRange
+    {
+        using value_type = boost::asio::const_buffer;
+        using const_iterator = const boost::asio::const_buffer *;
+
+        const_iterator first, last;
+
+        const_iterator begin() const { return first; }
+        const_iterator end() const { return last; }
+    };
+
+private:
+    // 書き込みが終わるまで生かしておくもの
+    // dataを持っている間は、ボディとして指している中身も生きている
+    template<class T>
+    struct WriteState
+    {
+        std::vector<T> data;
+        std::vector<HeadBuffer> heads;
+        std::vector<std::vector<char>> scratches;
+        std::vector<boost::asio::const_buffer> buffers;
+        bool isBusy;
+
+        WriteState()
+            : isBusy(false)
+        {}
+    };
+
+    template<class T>
+    struct ReadState
+    {
+        T data;
+        HeadBuffer head;
+        std::vector<char> scratch;
+    };
+
+    // 読み続ける間の状態
+    template<class T>
+    struct ReadLoop
+    {
+        AsyncBatchHandler<T> handler;
+        std::vector<std::shared_ptr<std::vector<T>>> batches;
+        std::vector<char> scratch;
+
+        // 誰も持っていない束を空にして返す
+        std::shared_ptr<std::vector<T>> acquire()
+        {
+            for(auto& batch : batches){
+                if(batch.use_count() == 1){
+                    // 最後に持っていた側が読み終えてから触る
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    batch->clear();
+                    return batch;
+                }
+            }
+            batches.push_back(std::make_shared<std::vector<T>>());
+            return batches.back();
+        }
+    };
 
 private:
     boost::asio::ip::tcp::socket socket_;
+    boost::asio::io_service::strand strand_;
+    HandlerMemory readMemory_, writeMemory_;
+    // asyncReadLoop()で読んで、まだフレームとして取り出していない分
+    std::vector<char> readBuffer_;
+    size_t readBegin_, readEnd_;
+    // 使い回す書き込みの状態。中身はWriteState<T>で、writeType_はtypeKey<T>()
+    // 呼び出し元のスレッドで入れ物を取り替えるので、strandではなくmutexで守る
+    boost::mutex writeMtx_;
+    std::shared_ptr<void> writeState_;
+    const void *writeType_;
 
 public:
     inline Connection(boost::asio::io_service& ioService);
@@ -39,20 +207,49 @@ public:
     const boost::asio::ip::tcp::socket& getSocket() const { return socket_; }
     boost::asio::ip::tcp::socket& getSocket() { return socket_; }
 
+    // 読み書きの途中なら、それらはoperation_abortedで終わる
+    void close()
+    {
+        auto self = shared_from_this();
+        strand_.dispatch([self]() {
+            boost::system::error_code error;
+            self->socket_.close(error);
+        });
+    }
+
     template<class T> inline void write(const T& t);
     template<class T> inline void read(T& t);
 
-    template<class T> inline void asyncWrite(const T& t, const AsyncHandler<T>& orgHandler);
-    template<class T> inline void asyncRead(const AsyncHandler<T>& orgHandler);
-    
-private:
-    template<class T> inline void makeDataToWrite(const T& t, std::string& header, std::string& body);
-    inline size_t determineBodyLength(const HeaderBuffer& header);
-    template<class T> inline void extractData(T& t, const std::string& body);
+    // handlerはAsyncHandler<T>として呼ばれる
+    template<class T, class Handler> inline void asyncWrite(const T& t, Handler handler);
+    // tsを順に、一回の書き込みで送る
+    // tsの中身は書き終わるまで接続が預かり、tsには前の書き込みで使った空の入れ物を返す
+    template<class T, class Handler> inline void asyncWrite(std::vector<T>& ts, Handler handler);
+    template<class T, class Handler> inline void asyncRead(Handler handler);
+    // 切れるかエラーになるまで読み続け、フレームが揃うたびに揃った分を全部渡す
+    // エラーのときもそれまでに揃った分は渡し、それで終わる
+    // 一度使ったらasyncRead()と混ぜないこと
+    template<class T> inline void asyncReadLoop(const AsyncBatchHandler<T>& orgHandler);
 
-    template<class T> inline void handleWrite(const boost::system::error_code& error, AsyncHandlerPtr<T> handler, std::shared_ptr<T> data, std::shared_ptr<std::string>, std::shared_ptr<std::string>);
-    template<class T> inline void handleReadHeader(const boost::system::error_code& error, AsyncHandlerPtr<T> handler, std::shared_ptr<HeaderBuffer> headerBuffer);
-    template<class T> inline void handleReadBody(const boost::system::error_code& error, AsyncHandlerPtr<T> handler, std::shared_ptr<BodyBuffer> bodyBuffer);
+private:
+    template<class T> static size_t headSize() { return wire::HEADER_SIZE + FrameCodec<T>::PREFIX_SIZE; }
+    // 同じフレームの種類を違うTで書くこともあるので、Tそのものを見分ける
+    template<class T> static const void *typeKey()
+    {
+        static const char key = 0;
+        return &key;
+    }
+    template<class T> static inline void loadHeader(const char *head, wire::FrameHeader& header);
+    template<class T> inline void makeDataToWrite(const T& t, HeadBuffer& head, std::vector<char>& scratch, std::vector<boost::asio::const_buffer>& buffers);
+    template<class T> inline boost::asio::mutable_buffer prepareBody(T& t, const char *head, std::vector<char>& scratch);
+    template<class T> inline size_t takeFrames(std::vector<T>& frames, std::vector<char>& scratch);
+    template<class T> inline void readSome(const std::shared_ptr<ReadLoop<T>>& loop);
+    template<class T> inline std::shared_ptr<WriteState<T>> acquireWriteState();
+    template<class T> inline void releaseWriteState(WriteState<T>& state);
+
+    template<class T, class Handler> inline void startWrite(const std::shared_ptr<WriteState<T>>& state, Handler handler);
+    template<class T, class Handler> inline void handleReadHeader(const boost::system::error_code& error, const Handler& handler, const std::shared_ptr<ReadState<T>>& state);
+    template<class T, class Handler> inline void handleReadBody(const boost::system::error_code& error, const Handler& handler, const std::shared_ptr<ReadState<T>>& state);
 };
 
 using ConnectionPtr = std::shared_ptr<Connection>;
@@ -60,167 +257,266 @@ using ConnectionPtr = std::shared_ptr<Connection>;
 ///
 
 Connection::Connection(boost::asio::io_service& ioService)
-    : socket_(ioService)
+    : socket_(ioService), strand_(ioService),
+      readMemory_(HANDLER_SLOT_COUNT, HANDLER_SLOT_SIZE), writeMemory_(HANDLER_SLOT_COUNT, HANDLER_SLOT_SIZE),
+      readBegin_(0), readEnd_(0), writeType_(nullptr)
 {}
 
 template<class T>
 void Connection::write(const T& t)
 {
-    // make data to write
-    std::string header, body;
-    makeDataToWrite(t, header, body);
-
-    // write
+    HeadBuffer head;
+    std::vector<char> scratch;
     std::vector<boost::asio::const_buffer> buffers;
-    buffers.push_back(boost::asio::buffer(header));
-    buffers.push_back(boost::asio::buffer(body));
+    makeDataToWrite(t, head, scratch, buffers);
     boost::asio::write(socket_, buffers);
 }
 
 template<class T>
 void Connection::read(T& t)
 {
-    // read header
-    HeaderBuffer header;
-    boost::asio::read(socket_, boost::asio::buffer(header.data(), header.size()));
-    
-    // read body
-    BodyBuffer body;
-    body.resize(determineBodyLength(header));
+    HeadBuffer head;
+    std::vector<char> scratch;
+    boost::asio::read(socket_, boost::asio::buffer(head.data(), headSize<T>()));
+    auto body = prepareBody(t, head.data(), scratch);
     boost::asio::read(socket_, boost::asio::buffer(body));
+    if(!FrameCodec<T>::finish(t, scratch))
+        throw boost::system::system_error(boost::asio::error::invalid_argument);
+}
 
-    // extract data
-    extractData(t, std::string(body.data(), body.size()));
+template<class T, class Handler>
+void Connection::asyncWrite(const T& t, Handler handler)
+{
+    std::vector<T> ts(1, t);
+    asyncWrite(ts, std::move(handler));
+}
+
+template<class T, class Handler>
+void Connection::asyncWrite(std::vector<T>& ts, Handler handler)
+{
+    auto state = acquireWriteState<T>();
+    state->data.swap(ts);
+    auto self = shared_from_this();
+
+    // 書く順はasyncWriteを呼んだ順のまま
+    strand_.dispatch(allocHandler(writeMemory_, [self, state, handler]() {
+        self->startWrite<T>(state, handler);
+    }));
+}
+
+template<class T, class Handler>
+void Connection::startWrite(const std::shared_ptr<WriteState<T>>& state, Handler handler)
+{
+    // ヘッダと中身を別々のバッファのまま一度に書く
+    const size_t n = state->data.size();
+    if(state->heads.size() < n)     state->heads.resize(n);
+    if(state->scratches.size() < n) state->scratches.resize(n);
+    state->buffers.clear();
+    for(size_t i = 0;i < n;i++)
+        makeDataToWrite(state->data[i], state->heads[i], state->scratches[i], state->buffers);
+
+    const ConstBufferRange buffers = {state->buffers.data(), state->buffers.data() + state->buffers.size()};
+    auto self = shared_from_this();
+    boost::asio::async_write(socket_, buffers, strand_.wrap(allocHandler(writeMemory_,
+        [self, state, handler](const boost::system::error_code& error, size_t) mutable {
+            self->releaseWriteState(*state);
+            handler(error, boost::optional<T>());
+        })));
 }
 
 template<class T>
-void Connection::asyncWrite(const T& t, const AsyncHandler<T>& orgHandler)
+std::shared_ptr<Connection::WriteState<T>> Connection::acquireWriteState()
 {
-    // make data to write
-    auto header = std::make_shared<std::string>(), body = std::make_shared<std::string>();
-    try{
-        makeDataToWrite(t, *header, *body);
-    }
-    catch(boost::system::error_code &ex){
-        socket_.get_io_service().post(boost::bind(orgHandler, ex, boost::none));
-        return;
-    }
-    catch(std::exception& ex){
-        socket_.get_io_service().post(boost::bind(orgHandler, boost::system::error_code(), boost::none));
-        return;
+    boost::mutex::scoped_lock lock(writeMtx_);
+    if(writeType_ == typeKey<T>()){
+        auto state = std::static_pointer_cast<WriteState<T>>(writeState_);
+        if(!state->isBusy){
+            state->isBusy = true;
+            return state;
+        }
+        // 書き終わる前に重ねて書くときは、その回だけ別に作る
+        auto extra = std::make_shared<WriteState<T>>();
+        extra->isBusy = true;
+        return extra;
     }
 
-    // copy data
-    auto handler = std::make_shared<AsyncHandler<T>>(orgHandler);
-    
-    // write
-    std::vector<boost::asio::const_buffer> buffers;
-    buffers.push_back(boost::asio::buffer(*header));
-    buffers.push_back(boost::asio::buffer(*body));
-    boost::asio::async_write(socket_, buffers,
-        boost::bind(&Connection::handleWrite<T>, this, boost::asio::placeholders::error, handler, nullptr, header, body));
+    auto state = std::make_shared<WriteState<T>>();
+    state->isBusy = true;
+    writeState_ = state;
+    writeType_ = typeKey<T>();
+    return state;
 }
 
 template<class T>
-void Connection::asyncRead(const AsyncHandler<T>& orgHandler)
+void Connection::releaseWriteState(WriteState<T>& state)
 {
-    // prepare
-    auto handler = std::make_shared<AsyncHandler<T>>(orgHandler);
-    auto headerBuffer = std::make_shared<HeaderBuffer>();
+    boost::mutex::scoped_lock lock(writeMtx_);
+    // 容量は残したまま、預かっていた中身を手放す
+    state.data.clear();
+    state.isBusy = false;
+}
 
-    boost::asio::async_read(socket_, boost::asio::buffer(headerBuffer->data(), headerBuffer->size()),
-        boost::bind(&Connection::handleReadHeader<T>, this, boost::asio::placeholders::error, handler, headerBuffer));
+template<class T, class Handler>
+void Connection::asyncRead(Handler handler)
+{
+    auto state = std::make_shared<ReadState<T>>();
+    auto self = shared_from_this();
+
+    strand_.dispatch([self, handler, state]() {
+        boost::asio::async_read(self->socket_, boost::asio::buffer(state->head.data(), headSize<T>()), self->strand_.wrap(
+            [self, handler, state](const boost::system::error_code& error, size_t) {
+                self->handleReadHeader<T>(error, handler, state);
+            }));
+    });
 }
 
 template<class T>
-void Connection::makeDataToWrite(const T& t, std::string& header, std::string& body)
+void Connection::asyncReadLoop(const AsyncBatchHandler<T>& orgHandler)
 {
-    // serialize
-    std::ostringstream os;
-    //boost::archive::binary_oarchive ar(os);
-    eos::portable_oarchive ar(os);
-    ar << t;
-    body = os.str();
+    auto loop = std::make_shared<ReadLoop<T>>();
+    loop->handler = orgHandler;
+    auto self = shared_from_this();
+    strand_.dispatch([self, loop]() { self->readSome<T>(loop); });
+}
 
-    // format the header
-    os.str("");
-    os << std::setw(HEADER_LENGTH) << std::hex << body.size();
-    if(!os || os.str().size() != HEADER_LENGTH)
-        throw boost::system::error_code(boost::asio::error::invalid_argument);
-    header = os.str();
+template<class T>
+void Connection::readSome(const std::shared_ptr<ReadLoop<T>>& loop)
+{
+    auto frames = loop->acquire();
+    size_t need;
+    try{
+        need = takeFrames(*frames, loop->scratch);
+    }
+    catch(boost::system::system_error& ex){
+        loop->handler(ex.code(), frames);
+        return;
+    }
+    if(!frames->empty())    loop->handler(boost::system::error_code(), frames);
+
+    // 残りを前に詰めて、途中のフレームが収まるだけの場所を空けてから読む
+    std::copy(readBuffer_.begin() + readBegin_, readBuffer_.begin() + readEnd_, readBuffer_.begin());
+    readEnd_ -= readBegin_;
+    readBegin_ = 0;
+    if(readBuffer_.size() < std::max<size_t>(need, READ_BUFFER_SIZE))
+        readBuffer_.resize(std::max<size_t>(need, READ_BUFFER_SIZE));
+    auto self = shared_from_this();
+    socket_.async_read_some(boost::asio::buffer(readBuffer_.data() + readEnd_, readBuffer_.size() - readEnd_),
+        strand_.wrap(allocHandler(readMemory_, [self, loop](const boost::system::error_code& error, size_t size) {
+            self->readEnd_ += size;
+            if(error){
+                loop->handler(error, loop->acquire());
+                return;
+            }
+            self->readSome<T>(loop);
+        })));
 }
 
-size_t Connection::determineBodyLength(const HeaderBuffer& header)
+// 読んだ分から揃ったフレームを取り出して、次のフレームを揃えるのに要る全体の長さを返す
+template<class T>
+size_t Connection::takeFrames(std::vector<T>& frames, std::vector<char>& scratch)
 {
-    std::istringstream is(std::string(header.data(), header.size()));
-    std::size_t size = 0;
-    if(!(is >> std::hex >> size))
-        boost::system::error_code error(boost::asio::error::invalid_argument);
-    return size;
+    for(;;){
+        const char *head = readBuffer_.data() + readBegin_;
+        const size_t available = readEnd_ - readBegin_;
+        if(available < headSize<T>())   return headSize<T>();
+
+        // 続きを待つ前に前置きまで確かめておく
+        // 長さは上限で抑えてあるので、そのまま場所を広げてよい
+        wire::FrameHeader header;
+        loadHeader<T>(head, header);
+        if(!FrameCodec<T>::check(header.length - FrameCodec<T>::PREFIX_SIZE, head + wire::HEADER_SIZE))
+            throw boost::system::system_error(boost::asio::error::invalid_argument);
+        const size_t total = wire::HEADER_SIZE + header.length;
+        if(available < total)   return total;
+
+        T t;
+        auto body = prepareBody(t, head, scratch);
+        const char *src = head + headSize<T>();
+        std::copy(src, src + boost::asio::buffer_size(body), boost::asio::buffer_cast<char *>(body));
+        if(!FrameCodec<T>::finish(t, scratch))
+            throw boost::system::system_error(boost::asio::error::invalid_argument);
+        frames.push_back(std::move(t));
+        readBegin_ += total;
+    }
 }
 
 template<class T>
-void Connection::extractData(T& t, const std::string& body)
+void Connection::makeDataToWrite(const T& t, HeadBuffer& head, std::vector<char>& scratch, std::vector<boost::asio::const_buffer>& buffers)
 {
-    std::istringstream is(body);
-    //boost::archive::binary_iarchive ar(is);
-    eos::portable_iarchive ar(is);
-    ar >> t;
+    buffers.push_back(boost::asio::buffer(head.data(), headSize<T>()));
+    const size_t length = FrameCodec<T>::encode(t, head.data() + wire::HEADER_SIZE, scratch, buffers);
+    wire::FrameHeader(FrameCodec<T>::TYPE, FrameCodec<T>::PREFIX_SIZE + length, FrameCodec<T>::stream(t)).store(head.data());
 }
 
+// 形と長さの合わないヘッダはinvalid_argumentで弾く
+// 長さを信じて確保する前に、ここで上限と比べておく
 template<class T>
-void Connection::handleWrite(const boost::system::error_code& error, AsyncHandlerPtr<T> handler, std::shared_ptr<T> data, std::shared_ptr<std::string>, std::shared_ptr<std::string>)
+void Connection::loadHeader(const char *head, wire::FrameHeader& header)
 {
-    (*handler)(error, boost::none);
+    if(!header.load(head) || header.type != FrameCodec<T>::TYPE ||
+       header.length < FrameCodec<T>::PREFIX_SIZE || header.length > FrameCodec<T>::maxLength())
+        throw boost::system::system_error(boost::asio::error::invalid_argument);
 }
 
 template<class T>
-void Connection::handleReadHeader(const boost::system::error_code& error, AsyncHandlerPtr<T> handler, std::shared_ptr<HeaderBuffer> headerBuffer)
+boost::asio::mutable_buffer Connection::prepareBody(T& t, const char *head, std::vector<char>& scratch)
 {
+    // 残りのボディはできればtの中へ直接読み込む
+    wire::FrameHeader header;
+    loadHeader<T>(head, header);
+    FrameCodec<T>::setStream(t, header.stream);
+    boost::asio::mutable_buffer body;
+    if(!FrameCodec<T>::prepare(t, header.length - FrameCodec<T>::PREFIX_SIZE, head + wire::HEADER_SIZE, scratch, body))
+        throw boost::system::system_error(boost::asio::error::invalid_argument);
+    return body;
+}
+
+template<class T, class Handler>
+void Connection::handleReadHeader(const boost::system::error_code& error, const Handler& handler, const std::shared_ptr<ReadState<T>>& state)
+{
+    Handler h = handler;
     if(error){
-        (*handler)(error, boost::none);
+        h(error, boost::optional<T>());
         return;
     }
 
-    // determine length
-    size_t size;
+    boost::asio::mutable_buffer body;
     try{
-        size = determineBodyLength(*headerBuffer);
+        body = prepareBody(state->data, state->head.data(), state->scratch);
     }
-    catch(boost::system::error_code& ex){
+    catch(boost::system::system_error& ex){
         // header isn't valid, inform the caller
-        (*handler)(ex, boost::none);
+        h(ex.code(), boost::optional<T>());
         return;
     }
 
-    // start to receive
-    auto bodyBuffer = std::make_shared<BodyBuffer>(size);
-    boost::asio::async_read(socket_, boost::asio::buffer(*bodyBuffer),
-        boost::bind(&Connection::handleReadBody<T>, this, boost::asio::placeholders::error, handler, bodyBuffer));
+    if(boost::asio::buffer_size(body) == 0){
+        handleReadBody<T>(error, handler, state);
+        return;
+    }
+    auto self = shared_from_this();
+    boost::asio::async_read(socket_, boost::asio::buffer(body), strand_.wrap(
+        [self, handler, state](const boost::system::error_code& error, size_t) {
+            self->handleReadBody<T>(error, handler, state);
+        }));
 }
 
-template<class T>
-void Connection::handleReadBody(const boost::system::error_code& error, AsyncHandlerPtr<T> handler, std::shared_ptr<BodyBuffer> bodyBuffer)
+template<class T, class Handler>
+void Connection::handleReadBody(const boost::system::error_code& error, const Handler& handler, const std::shared_ptr<ReadState<T>>& state)
 {
+    Handler h = handler;
     if(error && error != boost::asio::error::eof){
-        (*handler)(error, boost::none);
+        h(error, boost::optional<T>());
         return;
     }
 
-    // extract data
-    T t;
-    try{
-        std::string data(bodyBuffer->data(), bodyBuffer->size());
-        extractData(t, data);
-    }
-    catch(std::exception& ex){
+    if(!FrameCodec<T>::finish(state->data, state->scratch)){
         // unable to decode data
-        (*handler)(error, boost::none);
+        h(boost::asio::error::invalid_argument, boost::optional<T>());
         return;
     }
 
-    (*handler)(error, t);
+    h(error, boost::optional<T>(state->data));
 }
 
 #endif
-
@@ -1,21 +1,131 @@
 #include "asio_network.hpp"
+#include "shm_network.hpp"
 #include "helper.hpp"
 #include "error.hpp"
+#include "kernel.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <future>
+#include <random>
+#include <sstream>
 
-AsioNetworkBase::AsioNetworkBase()
+std::pair<const char *, size_t> FrameCodec<WaveData>::encodeBody(const PCMWave& wave, int format, std::vector<char>& scratch)
 {
+    const int count = wave.size() * wave.channels();
+    const double *src = wave.raw();
+    switch(format)
+    {
+    case wire::SAMPLE_LOSSLESS16:
+        scratch.clear();
+        LosslessCodec::encode(wave, scratch);
+        return std::make_pair(scratch.data(), scratch.size());
+
+    case wire::SAMPLE_FLOAT64:
+        if(wire::IS_LITTLE_ENDIAN_HOST)
+            return std::make_pair(reinterpret_cast<const char *>(src), rawLength(wave));
+        scratch.assign(reinterpret_cast<const char *>(src), reinterpret_cast<const char *>(src + count));
+        break;
+
+    case wire::SAMPLE_INT16:
+        scratch.resize(count * 2);
+        kernel::simd::toInt16(reinterpret_cast<std::int16_t *>(scratch.data()), src, count);
+        break;
+
+    case wire::SAMPLE_INT24:
+        scratch.resize(count * 3);
+        kernel::simd::toInt24(scratch.data(), src, count);
+        break;
+
+    case wire::SAMPLE_FLOAT32:
+        scratch.resize(count * 4);
+        kernel::simd::toFloat32(reinterpret_cast<float *>(scratch.data()), src, count);
+        break;
+
+    default:
+        BOOST_THROW_EXCEPTION(CablesError());
+    }
+    if(format != wire::SAMPLE_INT24)
+        wire::toLittleEndian(scratch.data(), count, wire::sampleBytes(format));
+    return std::make_pair(scratch.data(), scratch.size());
+}
+
+bool FrameCodec<WaveData>::decodeBody(int format, const char *src, size_t size, PCMWave& wave)
+{
+    if(format == wire::SAMPLE_LOSSLESS16)
+        return LosslessCodec::decode(src, size, wave);
+
+    const int count = wave.size() * wave.channels();
+    if(size != bodyLength(wave, format))    return false;
+    double *dst = wave.raw();
+
+    // 入れ替えが要るのはbig endianのホストだけなので、そのときだけ写してから直す
+    std::vector<char> swapped;
+    if(!wire::IS_LITTLE_ENDIAN_HOST && format != wire::SAMPLE_INT24){
+        swapped.assign(src, src + size);
+        wire::toLittleEndian(swapped.data(), count, wire::sampleBytes(format));
+        src = swapped.data();
+    }
+
+    switch(format)
+    {
+    case wire::SAMPLE_FLOAT64:
+        if(src != reinterpret_cast<const char *>(dst))
+            std::copy(src, src + size, reinterpret_cast<char *>(dst));
+        return true;
+    case wire::SAMPLE_INT16:
+        kernel::simd::fromInt16(dst, reinterpret_cast<const std::int16_t *>(src), count);
+        return true;
+    case wire::SAMPLE_INT24:
+        kernel::simd::fromInt24(dst, src, count);
+        return true;
+    case wire::SAMPLE_FLOAT32:
+        kernel::simd::fromFloat32(dst, reinterpret_cast<const float *>(src), count);
+        return true;
+    default:
+        return false;
+    }
+}
+
+///
+
+int AsioServicePool::requestedThreadCount_ = 0;
+
+AsioServicePool::AsioServicePool(int threadCount)
+{
+    if(threadCount <= 0)    threadCount = std::max(1u, boost::thread::hardware_concurrency());
     work_ = make_unique<boost::asio::io_service::work>(ioService_);
-    ioServer_ = make_unique<boost::thread>([this]() {
-        try{
-            ioService_.run();
-        }
-        catch(std::exception& ex){
-            ZARU_CHECK(ex.what());
-        }
-        catch(...){
-            ZARU_CHECK("fatal error");
-        }
-    });
+    for(int i = 0;i < threadCount;i++){
+        threads_.push_back(make_unique<boost::thread>([this]() {
+            try{
+                ioService_.run();
+            }
+            catch(std::exception& ex){
+                ZARU_CHECK(ex.what());
+            }
+            catch(...){
+                ZARU_CHECK("fatal error");
+            }
+        }));
+    }
+}
+
+void AsioServicePool::setThreadCount(int threadCount)
+{
+    requestedThreadCount_ = threadCount;
+}
+
+AsioServicePool& AsioServicePool::getInstance()
+{
+    // 終了時にまだ動いているhandlerがあるかもしれないので破棄しない
+    static AsioServicePool *instance = new AsioServicePool(requestedThreadCount_);
+    return *instance;
+}
+
+AsioNetworkBase::AsioNetworkBase()
+    : ioService_(AsioServicePool::getInstance().getService()), strand_(ioService_)
+{
+    pending_.count = 0;
 }
 
 AsioNetworkBase::~AsioNetworkBase()
@@ -25,10 +135,8 @@ AsioNetworkBase::~AsioNetworkBase()
 
 void AsioNetworkBase::kill()
 {
-    if(work_){
-        work_.reset();
-        ioServer_->join();
-    }
+    boost::mutex::scoped_lock lock(pending_.mtx);
+    while(pending_.count > 0)   pending_.cond.wait(lock);
 }
 
 std::unique_ptr<boost::asio::ip::tcp::acceptor> AsioNetworkBase::createAcceptor(unsigned short port)
@@ -42,157 +150,789 @@ ConnectionPtr AsioNetworkBase::createConnection()
     return std::make_shared<Connection>(ioService_);
 }
 
+std::unique_ptr<boost::asio::ip::udp::socket> AsioNetworkBase::createUdpSocket(unsigned short port)
+{
+    if(port == 0)
+        return make_unique<boost::asio::ip::udp::socket>(ioService_, boost::asio::ip::udp::v4());
+    return make_unique<boost::asio::ip::udp::socket>(
+        ioService_, boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), port));
+}
+
+std::unique_ptr<boost::asio::ip::udp::socket> AsioNetworkBase::createMulticastSocket(unsigned short port, const std::string& group)
+{
+    using boost::asio::ip::udp;
+    auto ret = make_unique<udp::socket>(ioService_, udp::v4());
+    ret->set_option(udp::socket::reuse_address(true));
+    ret->bind(udp::endpoint(udp::v4(), port));
+    ret->set_option(boost::asio::ip::multicast::join_group(boost::asio::ip::address::from_string(group)));
+    return ret;
+}
 
 ///
 
-AsioNetworkRecvOutUnit::AsioNetworkRecvOutUnit(unsigned short port)
-    : hasConnected_(false)
+std::string AsioStreamReceiver::peerName(const boost::asio::ip::tcp::endpoint& endpoint, std::uint32_t sender)
+{
+    // 名乗らない送り手は、繋ぐたびに変わるポートまで含めて別のものとみなす
+    std::ostringstream ss;
+    ss << endpoint.address().to_string();
+    if(sender == 0) ss << ":" << endpoint.port();
+    else            ss << "#" << std::hex << sender;
+    return ss.str();
+}
+
+AsioStreamReceiver::AsioStreamReceiver(unsigned short port)
+    : isAccepting_(false), unrouted_(0), rejected_(0)
 {
     acceptor_ = createAcceptor(port);
 }
 
-AsioNetworkRecvOutUnit::~AsioNetworkRecvOutUnit()
+AsioStreamReceiver::AsioStreamReceiver(unsigned short port, const StreamHandler& handler)
+    : handler_(handler), isAccepting_(false), unrouted_(0), rejected_(0)
 {
+    acceptor_ = createAcceptor(port);
+    postProc([this]() { startAccept(); });
+}
+
+AsioStreamReceiver::~AsioStreamReceiver()
+{
+    // 待ちを全部終わらせないとkill()が返らない
+    postProc([this]() {
+        acceptor_->close();
+        while(!peers_.empty())  closePeer(peers_.begin()->first);
+    });
     kill();
 }
 
-void AsioNetworkRecvOutUnit::startAccept()
+void AsioStreamReceiver::attach(const std::string& peer, std::uint16_t stream, AsioNetworkRecvOutUnit *unit)
 {
-    hasConnected_ = false;
-    conn_ = createConnection();
-    acceptor_->async_accept(conn_->getSocket(),[this](const boost::system::error_code& error) {
+    unit->setConnected(false);
+    postProc([this, peer, stream, unit]() {
+        const RouteKey key(peer, stream);
+        routes_[key] = unit;
+        requested_.erase(key);
+        unit->setConnected(peers_.count(peer) != 0);
+        if(!isAccepting_ && peers_.empty()) startAccept();
+    });
+}
+
+void AsioStreamReceiver::detach(const std::string& peer, std::uint16_t stream, AsioNetworkRecvOutUnit *unit)
+{
+    // 配っている最中にUnitが消えないよう、strandの中で外し終わるまで待つ
+    auto done = std::make_shared<std::promise<void>>();
+    postProc([this, peer, stream, unit, done]() {
+        auto it = routes_.find(RouteKey(peer, stream));
+        if(it != routes_.end() && it->second == unit){
+            it->second->setConnected(false);
+            routes_.erase(it);
+        }
+        // 一本だけ受ける版は、誰も聞いていなければ切る
+        if(!isServer() && routes_.empty()){
+            acceptor_->cancel();
+            while(!peers_.empty())  closePeer(peers_.begin()->first);
+        }
+        done->set_value();
+    });
+    done->get_future().wait();
+}
+
+int AsioStreamReceiver::getPeerCount()
+{
+    auto count = std::make_shared<std::promise<int>>();
+    postProc([this, count]() { count->set_value(peers_.size()); });
+    return count->get_future().get();
+}
+
+void AsioStreamReceiver::setPeerConnected(const std::string& peer, bool hasConnected)
+{
+    auto begin = routes_.lower_bound(RouteKey(peer, 0));
+    for(auto it = begin;it != routes_.end() && it->first.first == peer;++it)
+        it->second->setConnected(hasConnected);
+}
+
+void AsioStreamReceiver::closePeer(const std::string& peer)
+{
+    auto it = peers_.find(peer);
+    if(it == peers_.end())  return;
+    it->second->close();
+    peers_.erase(it);
+    setPeerConnected(peer, false);
+}
+
+void AsioStreamReceiver::startAccept()
+{
+    isAccepting_ = true;
+    auto conn = createConnection();
+    acceptor_->async_accept(conn->getSocket(), wrap([this, conn](const boost::system::error_code& error) {
+        isAccepting_ = false;
         if(error){
             std::cout << "ASYNC_ACCEPT_ERROR: " << error.message() << std::endl;
+            // 全部外れて止めた直後に付け直されていれば、待ち受けをやり直す
+            if(error == boost::asio::error::operation_aborted && acceptor_->is_open() &&
+               !routes_.empty() && peers_.empty())
+                startAccept();
             return;
         }
+        startHandshake(conn);
+        // サーバは次の送り手も待つ
+        if(isServer())  startAccept();
+    }));
+}
 
-        hasConnected_ = true;
-        setSocketStatus(true);
-        startRead();
-    });
+void AsioStreamReceiver::startHandshake(const ConnectionPtr& conn)
+{
+    // 送り手の形を確かめて、結果とこちらの形を返す
+    // 合わなければ返してから切る
+    conn->asyncRead<HelloData>(wrap([this, conn](const boost::system::error_code& error, const boost::optional<HelloData>& hello) {
+        if(error || !hello){
+            if(error == boost::asio::error::invalid_argument)   rejected_.fetch_add(1, std::memory_order_relaxed);
+            std::cout << "HANDSHAKE_ERROR: " << error.message() << std::endl;
+            if(!isServer()) startAccept();
+            return;
+        }
+
+        const std::uint8_t status = hello->check();
+        const std::uint32_t sender = hello->sender;
+        conn->asyncWrite<HelloData>(HelloData::current(hello->format, status),
+            wrap([this, conn, status, sender](const boost::system::error_code& error, const boost::optional<HelloData>&) {
+                if(error || status != wire::HELLO_OK){
+                    std::cout << "HANDSHAKE_ERROR: " << (error ? error.message() : "session format mismatch") << std::endl;
+                    conn->close();
+                    if(!isServer()) startAccept();
+                    return;
+                }
+
+                // 一本だけ受ける版では、送り手は区別しない
+                std::string peer;
+                if(isServer()){
+                    boost::system::error_code endpointError;
+                    peer = peerName(conn->getSocket().remote_endpoint(endpointError), sender);
+                }
+                // 同じ送り手が繋ぎ直したときだけ、古い接続が残っている
+                closePeer(peer);
+                peers_[peer] = conn;
+                setPeerConnected(peer, true);
+                startRead(peer, conn);
+            })
+        );
+    }));
+}
+
+void AsioStreamReceiver::startRead(const std::string& peer, const ConnectionPtr& conn)
+{
+    // 切れるまで読み続け、一度に届いた分はまとめて受け取る
+    conn->asyncReadLoop<WaveData>(wrap([this, peer, conn](const boost::system::error_code& error,
+                                                          const Connection::FrameBatchPtr<WaveData>& frames) {
+        handleRecvWaveData(peer, conn, error, *frames);
+    }));
+}
+
+void AsioStreamReceiver::handleRecvWaveData(const std::string& peer, const ConnectionPtr& conn,
+                                            const boost::system::error_code& error, const std::vector<WaveData>& frames)
+{
+    // 繋ぎ直されたり切られたりした古い接続
+    auto current = peers_.find(peer);
+    if(current == peers_.end() || current->second != conn)  return;
+
+    // 壊れたフレームの手前までは配る
+    for(auto& wave : frames)    route(peer, wave);
+
+    if(error){
+        // 壊れたフレームの後ろはどこから読めばよいか分からないので、接続ごと切って次を待つ
+        const bool isRejected = error == boost::asio::error::invalid_argument;
+        if(isRejected)  rejected_.fetch_add(1, std::memory_order_relaxed);
+        std::cout << "ASYNC_RECV_ERROR: " << peer << " " << error.message() << std::endl;
+        closePeer(peer);
+        if(!isServer() && (error == boost::asio::error::eof || isRejected)) startAccept();
+    }
 }
 
-void AsioNetworkRecvOutUnit::startRead()
+void AsioStreamReceiver::route(const std::string& peer, const WaveData& wave)
 {
-    conn_->asyncRead<WaveData>(boost::bind(&AsioNetworkRecvOutUnit::handleRecvWaveData, this, _1, _2));
+    const RouteKey key(peer, wave.stream);
+    auto it = routes_.find(key);
+    if(it == routes_.end()){
+        unrouted_.fetch_add(1, std::memory_order_relaxed);
+        if(isServer() && requested_.insert(key).second)
+            handler_(peer, wave.stream);
+    }
+    else if(wave.data->size() != PCMWave::bufferSize()){
+        std::cout << "ASYNC_RECV_ERROR: buffer size mismatch (" << wave.data->size() << ")" << std::endl;
+        it->second->recordDrop();
+    }
+    else{
+        it->second->receive(wave);
+    }
+}
+
+AsioNetworkRecvOutUnit::AsioNetworkRecvOutUnit(unsigned short port)
+    : receiver_(std::make_shared<AsioStreamReceiver>(port)), stream_(0),
+      drift_(std::chrono::microseconds(1000000LL * PCMWave::bufferSize() / PCMWave::sampleRate()))
+{}
+
+AsioNetworkRecvOutUnit::AsioNetworkRecvOutUnit(const std::shared_ptr<AsioStreamReceiver>& receiver, std::uint16_t stream, const std::string& peer)
+    : receiver_(receiver), peer_(peer), stream_(stream),
+      drift_(std::chrono::microseconds(1000000LL * PCMWave::bufferSize() / PCMWave::sampleRate()))
+{}
+
+AsioNetworkRecvOutUnit::~AsioNetworkRecvOutUnit()
+{
+    // 止めずに捨てられても、receiverに自分を残さない
+    receiver_->detach(peer_, stream_, this);
 }
 
 void AsioNetworkRecvOutUnit::startImpl()
 {
-    setSocketStatus(false);
-    postProc([this]() { startAccept(); });
+    receiver_->attach(peer_, stream_, this);
 }
 
 void AsioNetworkRecvOutUnit::stopImpl()
 {
-    postProc([this]() {
-        acceptor_->cancel();
-        conn_.reset();
-        hasConnected_ = false;
-        setSocketStatus(false);
-    });
+    receiver_->detach(peer_, stream_, this);
+}
+
+void AsioNetworkRecvOutUnit::setConnected(bool hasConnected)
+{
+    // 繋ぎ直したら、相手の時計も溜まり具合も連番も変わっているので測り直す
+    if(hasConnected){
+        concealer_.reset();
+        transit_.reset();
+        drift_.reset();
+    }
+    setSocketStatus(hasConnected);
 }
 
-void AsioNetworkRecvOutUnit::handleRecvWaveData(const boost::system::error_code& error, const boost::optional<WaveData>& data)
+void AsioNetworkRecvOutUnit::receive(const WaveData& wave)
 {
-    if(error || !data){
-        std::cout << "ASYNC_RECV_ERROR: " << error.message() << std::endl;
-        setSocketStatus(false);
-        hasConnected_ = false;
-        if(error == boost::asio::error::eof)    startAccept();
-        return;
+    transit_.record(wave.data->captureTime());
+
+    // 下流に目標ほど溜まっていなければ、その分だけは抜けを埋めても遅れは伸びない
+    const auto drift = drift_.getStats();
+    const int target = drift.isLocked ? static_cast<int>(std::ceil(drift.targetDepth)) : 1;
+    concealer_.push(wave.seq, wave.data, target - getOutputQueueDepth(), concealed_);
+
+    for(auto& block : concealed_){
+        drift_.push(block, getOutputQueueDepth(), compensated_);
+        for(auto& w : compensated_) send(std::move(w));
+        compensated_.clear();
     }
+    concealed_.clear();
+}
 
-    auto& wave = *data;
-    send(wave.data);
-    if(hasConnected_)   startRead();
+void AsioNetworkRecvOutUnit::writeStatsImpl(std::ostream& os)
+{
+    const auto drift = drift_.getStats();
+    const auto loss = concealer_.getStats();
+    const auto transit = transit_.getStats();
+    os << "    peer:" << (peer_.empty() ? "-" : peer_) << " stream:" << stream_ <<
+        " unrouted:" << receiver_->getUnroutedCount() <<
+        " rejected:" << receiver_->getRejectedCount() << std::endl;
+    os << "    recv:" << loss.received <<
+        " lost:" << loss.lost <<
+        " reordered:" << loss.reordered <<
+        " concealed:" << loss.concealed <<
+        " restarted:" << loss.restarted << std::endl;
+    os << "    latency:" << transit.latencyUS << "us" <<
+        " min:" << transit.minLatencyUS << "us" <<
+        " max:" << transit.maxLatencyUS << "us" <<
+        " jitter:" << transit.jitterUS << "us" << std::endl;
+    os << "    drift:" << drift.driftPPM << "ppm" <<
+        " ratio:" << drift.ratioPPM << "ppm" <<
+        " depth:" << drift.depth << "/";
+    if(drift.isLocked)  os << drift.targetDepth << std::endl;
+    else                os << "-" << std::endl;
 }
 
 ///
 
-AsioNetworkSendInUnit::AsioNetworkSendInUnit(const unsigned short port, const std::string& ipaddr)
-    : port_(port), ipaddr_(ipaddr), hasConnected_(false)
+AsioStreamSender::AsioStreamSender(const unsigned short port, const std::string& ipaddr, std::uint8_t format,
+                                   const SendQueueLimit& limit)
+    : port_(port), ipaddr_(ipaddr), inFlight_(0),
+      senderId_((std::random_device()() ^ static_cast<std::uint32_t>(std::chrono::steady_clock::now().time_since_epoch().count())) | 1),
+      hasConnected_(false), attachCount_(0), format_(format), limit_(limit),
+      depth_(0), maxDepth_(0), limitBlocks_(limit.blocks), dropped_(0), writes_(0), writtenBlocks_(0)
 {}
 
-AsioNetworkSendInUnit::~AsioNetworkSendInUnit()
+AsioStreamSender::~AsioStreamSender()
 {
     kill();
 }
 
-void AsioNetworkSendInUnit::startConnect()
+void AsioStreamSender::startConnect()
 {
     conn_ = createConnection();
     hasConnected_ = false;
-    conn_->getSocket().async_connect(
+    auto conn = conn_;
+    conn->getSocket().async_connect(
         boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string(ipaddr_), port_),
-        [this](const boost::system::error_code& error) {
+        wrap([this, conn](const boost::system::error_code& error) {
+            if(conn != conn_)   return;
             if(error){
                 std::cout << "ASYNC_CONNECT_ERROR: " << error.message() << std::endl;
                 return;
             }
-            hasConnected_ = true;
-        }
+            startHandshake();
+        })
     );
 }
 
-void AsioNetworkSendInUnit::startSend()
+void AsioStreamSender::startHandshake()
+{
+    // 送る形を伝え、受け手の返事がこちらと同じ形でなければ送らずに切る
+    auto conn = conn_;
+    conn->asyncWrite<HelloData>(HelloData::current(format_, wire::HELLO_OK, senderId_), wrap([this, conn](const boost::system::error_code& error, const boost::optional<HelloData>&) {
+        if(conn != conn_)   return;
+        if(error){
+            std::cout << "HANDSHAKE_ERROR: " << error.message() << std::endl;
+            closeConnect();
+            return;
+        }
+        conn->asyncRead<HelloData>(wrap([this, conn](const boost::system::error_code& error, const boost::optional<HelloData>& hello) {
+            if(conn != conn_)   return;
+            if(error || !hello){
+                std::cout << "HANDSHAKE_ERROR: " << error.message() << std::endl;
+                closeConnect();
+                return;
+            }
+            if(hello->status != wire::HELLO_OK || hello->check() != wire::HELLO_OK){
+                std::cout << "HANDSHAKE_ERROR: session format mismatch (local " <<
+                    PCMWave::sampleRate() << "Hz/" << PCMWave::bufferSize() << ", remote " <<
+                    hello->sampleRate << "Hz/" << hello->bufferSize << ")" << std::endl;
+                closeConnect();
+                return;
+            }
+            hasConnected_ = true;
+        }));
+    }));
+}
+
+void AsioStreamSender::startSend()
 {
-    conn_->asyncWrite<WaveData>(*waveQue_.front(),
-        [this](const boost::system::error_code& error, const boost::optional<WaveData>&) {
-            waveQue_.pop_front();
+    // 待っているものをまとめて一度に書く
+    // batch_は接続と入れ物を取り替えながら使い回す
+    batch_.clear();
+    size_t bytes = 0;
+    for(auto it = waveQue_.begin();it != waveQue_.end() && (batch_.empty() || bytes < MAX_BATCH_BYTES);++it){
+        const WaveData& data = *it;
+        bytes += FrameCodec<WaveData>::bodyLength(*data.data, data.format);
+        waiting_[data.stream]--;
+        batch_.push_back(data);
+    }
+    inFlight_ = batch_.size();
+    writes_++;
+    writtenBlocks_ += batch_.size();
+
+    auto conn = conn_;
+    conn->asyncWrite<WaveData>(batch_,
+        wrap([this, conn](const boost::system::error_code& error, const boost::optional<WaveData>&) {
+            if(conn != conn_)   return;
+            waveQue_.erase_begin(inFlight_);
+            inFlight_ = 0;
+            updateDepth();
             if(error){
                 std::cout << "ASYNC_WRITE_ERROR: " << error.message() << std::endl;
                 closeConnect();
                 return;
             }
             if(!waveQue_.empty())   startSend();
-        }
+        })
     );
 }
 
-void AsioNetworkSendInUnit::closeConnect()
+void AsioStreamSender::closeConnect()
 {
+    if(conn_)   conn_->close();
     conn_.reset();
     hasConnected_ = false;
+    waveQue_.clear();
+    inFlight_ = 0;
+    waiting_.clear();
+    nextSeq_.clear();
+    updateDepth();
 }
 
-void AsioNetworkSendInUnit::startImpl()
+void AsioStreamSender::enqueue(const WaveData& data)
 {
-    postProc([this]() { startConnect(); });
+    int& waiting = waiting_[data.stream];
+    if(waiting >= limit_.blocks){
+        auto isWaiting = [&data](const WaveData& d) { return d.stream == data.stream; };
+        // 書き込み中のものには触らない
+        const auto begin = waveQue_.begin() + inFlight_;
+        switch(limit_.policy)
+        {
+        case SendQueuePolicy::DROP_NEWEST:
+            dropped_++;
+            return;
+        case SendQueuePolicy::DROP_OLDEST:
+            waveQue_.erase(std::find_if(begin, waveQue_.end(), isWaiting));
+            waiting--;
+            dropped_++;
+            break;
+        case SendQueuePolicy::COALESCE:
+            waveQue_.erase(std::remove_if(begin, waveQue_.end(), isWaiting), waveQue_.end());
+            dropped_ += waiting;
+            waiting = 0;
+            break;
+        }
+    }
+
+    // 書き込み中のものと、streamごとに上限までの待ちが入る
+    if(waveQue_.full()) waveQue_.set_capacity(waveQue_.capacity() * 2 + limit_.blocks);
+    waveQue_.push_back(data);
+    waiting++;
+    updateDepth();
+    if(inFlight_ == 0)  startSend();
 }
 
-void AsioNetworkSendInUnit::stopImpl()
+void AsioStreamSender::updateDepth()
+{
+    const int depth = waveQue_.size();
+    depth_ = depth;
+    if(depth > maxDepth_)   maxDepth_ = depth;
+}
+
+void AsioStreamSender::attach()
 {
     postProc([this]() {
-        closeConnect();
-        waveQue_.clear();
+        if(attachCount_++ == 0) startConnect();
     });
 }
 
-void AsioNetworkSendInUnit::inputImpl(const PCMWave& wave)
+void AsioStreamSender::detach()
 {
-    std::shared_ptr<WaveData> data = std::make_shared<WaveData>(wave);
-    postProc([this, data]() {
+    postProc([this]() {
+        if(--attachCount_ == 0) closeConnect();
+    });
+}
+
+void AsioStreamSender::push(std::uint16_t stream, PCMWavePtr wave)
+{
+    WaveData data(std::move(wave), format_, stream);
+    postProc([this, data]() mutable {
         if(!hasConnected_) return;
-        bool isProcessing = !waveQue_.empty();
-        waveQue_.push_back(data);
-        if(!isProcessing)   startSend();
+        data.seq = nextSeq_[data.stream]++;
+        enqueue(data);
     });
 }
 
-/*
-// Pool ver
-void AsioNetworkSendInUnit::inputImpl(const PCMWave& wave)
+void AsioStreamSender::setQueueLimit(const SendQueueLimit& limit)
+{
+    limitBlocks_ = limit.blocks;
+    // 縮めたときは、次に来たものから上限に合わせる
+    postProc([this, limit]() { limit_ = limit; });
+}
+
+AsioNetworkSendInUnit::AsioNetworkSendInUnit(const unsigned short port, const std::string& ipaddr, std::uint8_t format,
+                                             const SendQueueLimit& limit)
+    : sender_(std::make_shared<AsioStreamSender>(port, ipaddr, format, limit)), stream_(0)
+{}
+
+AsioNetworkSendInUnit::AsioNetworkSendInUnit(const std::shared_ptr<AsioStreamSender>& sender, std::uint16_t stream)
+    : sender_(sender), stream_(stream)
+{}
+
+AsioNetworkSendInUnit::~AsioNetworkSendInUnit()
+{}
+
+void AsioNetworkSendInUnit::startImpl()
+{
+    sender_->attach();
+}
+
+void AsioNetworkSendInUnit::stopImpl()
 {
-    std::shared_ptr<PCMWave> data = std::make_shared<PCMWave>(wave);
-    postProc([this, data]() {
-        currentData_->data.at(currentDataIndex_++) = data;
-        if(currentDataIndex_ != currentData_->data.size())  return;
-        bool isProcessing = !waveQue_.empty();
-        waveQue_.push_back(currentData_);
-        currentData_ = std::make_shared<WaveData>();
-        currentDataIndex_ = 0;
-        if(!isProcessing)   startSend();
+    sender_->detach();
+}
+
+void AsioNetworkSendInUnit::inputImpl(PCMWavePtr wave)
+{
+    sender_->push(stream_, std::move(wave));
+}
+
+void AsioNetworkSendInUnit::writeStatsImpl(std::ostream& os)
+{
+    // 接続を共有しているときは、送り待ちの数は全streamの合計で、上限はstreamごと
+    os << "    stream:" << stream_ <<
+        " queue:" << sender_->getQueueDepth() <<
+        " max:" << sender_->getMaxQueueDepth() <<
+        " limit:" << sender_->getQueueLimit() << "/stream" <<
+        " overflow:" << sender_->getDroppedCount() <<
+        " batch:" << sender_->getAverageBatchSize() << std::endl;
+}
+
+///
+
+void storeFragmentHeads(const PCMWave& wave, std::uint8_t format, std::uint32_t seq, size_t length,
+                        std::vector<FragmentHead>& heads)
+{
+    const int count = std::max<size_t>(1, (length + wire::FRAGMENT_PAYLOAD_SIZE - 1) / wire::FRAGMENT_PAYLOAD_SIZE);
+    heads.resize(count);
+    for(int i = 0;i < count;i++){
+        const size_t size = std::min<size_t>(wire::FRAGMENT_PAYLOAD_SIZE, length - i * wire::FRAGMENT_PAYLOAD_SIZE);
+        char *prefix = heads[i].data() + wire::HEADER_SIZE;
+        wire::FrameHeader(wire::FRAME_WAVE_FRAGMENT, wire::FRAGMENT_PREFIX_SIZE + size).store(heads[i].data());
+        wire::storeLE32(prefix, seq);
+        wire::storeLE16(prefix + 4, i);
+        wire::storeLE16(prefix + 6, count);
+        FrameCodec<WaveData>::storePrefix(wave, format, seq, prefix + 8);
+    }
+}
+
+AsioUdpSendInUnit::AsioUdpSendInUnit(const unsigned short port, const std::string& ipaddr, std::uint8_t format)
+    : endpoint_(boost::asio::ip::address::from_string(ipaddr), port), seq_(0), format_(format)
+{}
+
+AsioUdpSendInUnit::~AsioUdpSendInUnit()
+{
+    kill();
+}
+
+void AsioUdpSendInUnit::sendWave(const PCMWavePtr& wave)
+{
+    if(!udpSocket_) return;
+
+    // 先に全部を送る形式にしてから、それを断片に分ける
+    const auto body = FrameCodec<WaveData>::encodeBody(*wave, format_, scratch_);
+    const char *raw = body.first;
+    const size_t length = body.second;
+    storeFragmentHeads(*wave, format_, seq_++, length, heads_);
+
+    for(size_t i = 0;i < heads_.size();i++){
+        const size_t offset = i * wire::FRAGMENT_PAYLOAD_SIZE;
+        std::array<boost::asio::const_buffer, 2> buffers = {{
+            boost::asio::buffer(heads_[i]),
+            boost::asio::buffer(raw + offset, std::min<size_t>(wire::FRAGMENT_PAYLOAD_SIZE, length - offset))
+        }};
+        boost::system::error_code error;
+        udpSocket_->send_to(buffers, endpoint_, 0, error);
+        if(error){
+            // 一つでも欠けたら受け手では組み立てられない
+            std::cout << "UDP_SEND_ERROR: " << error.message() << std::endl;
+            recordDrop();
+            return;
+        }
+    }
+}
+
+void AsioUdpSendInUnit::startImpl()
+{
+    postProc([this]() {
+        udpSocket_ = createUdpSocket();
+        seq_ = 0;
     });
 }
-*/
+
+void AsioUdpSendInUnit::stopImpl()
+{
+    postProc([this]() { udpSocket_.reset(); });
+}
+
+void AsioUdpSendInUnit::inputImpl(PCMWavePtr wave)
+{
+    postProc([this, wave]() { sendWave(wave); });
+}
+
+///
+
+AsioUdpRecvOutUnit::AsioUdpRecvOutUnit(unsigned short port, const std::string& group)
+    : recvBuffer_(MAX_DATAGRAM_SIZE), isReceiving_(false), rejected_(0),
+      jitter_(std::chrono::microseconds(1000000LL * PCMWave::bufferSize() / PCMWave::sampleRate())),
+      period_(1000000LL * PCMWave::bufferSize() / PCMWave::sampleRate())
+{
+    udpSocket_ = group.empty() ? createUdpSocket(port) : createMulticastSocket(port, group);
+}
+
+AsioUdpRecvOutUnit::~AsioUdpRecvOutUnit()
+{
+    kill();
+}
+
+void AsioUdpRecvOutUnit::startReceive()
+{
+    if(isReceiving_)    return;
+    isReceiving_ = true;
+    udpSocket_->async_receive_from(boost::asio::buffer(recvBuffer_), sender_,
+        wrap(boost::bind(&AsioUdpRecvOutUnit::handleReceive, this,
+            boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred)));
+}
+
+void AsioUdpRecvOutUnit::handleReceive(const boost::system::error_code& error, size_t size)
+{
+    isReceiving_ = false;
+    if(error == boost::asio::error::operation_aborted)  return;
+    if(error)   std::cout << "UDP_RECV_ERROR: " << error.message() << std::endl;
+    else if(!assemble(size))    rejected_.fetch_add(1, std::memory_order_relaxed);
+    startReceive();
+}
+
+bool AsioUdpRecvOutUnit::assemble(size_t size)
+{
+    // 形の合わないデータグラムは捨てて、falseを返す
+    const char *data = recvBuffer_.data();
+    wire::FrameHeader header;
+    if(size < wire::HEADER_SIZE + wire::FRAGMENT_PREFIX_SIZE)   return false;
+    if(!header.load(data) || header.type != wire::FRAME_WAVE_FRAGMENT)  return false;
+    if(header.length != size - wire::HEADER_SIZE)   return false;
+
+    const char *prefix = data + wire::HEADER_SIZE;
+    const std::uint32_t seq = wire::loadLE32(prefix);
+    const int index = wire::loadLE16(prefix + 4), count = wire::loadLE16(prefix + 6);
+    if(count == 0 || index >= count)    return false;
+
+    auto it = partials_.find(seq);
+    if(it == partials_.end()){
+        // 断片の数が前置きの示す長さに見合うかを、ブロックを取る前に確かめる
+        size_t capacity;
+        if(!FrameCodec<WaveData>::checkPrefix(prefix + 8, capacity))    return false;
+        if(static_cast<size_t>(count - 1) * wire::FRAGMENT_PAYLOAD_SIZE > capacity)    return false;
+        Partial partial;
+        if(!FrameCodec<WaveData>::loadPrefix(prefix + 8, partial.wave))    return false;
+        partial.count = count;
+        partial.received = 0;
+        partial.encodedLength = 0;
+        partial.hasReceived.assign(count, false);
+        partials_.insert(std::make_pair(seq, std::move(partial)));
+
+        // 揃わないまま古くなったものは諦める
+        while(partials_.size() > MAX_PARTIAL_COUNT){
+            partials_.erase(partials_.begin());
+            recordDrop();
+        }
+        it = partials_.find(seq);
+        if(it == partials_.end())   return true;
+    }
+
+    auto& partial = it->second;
+    PCMWave& wave = partial.wave.data.mutate();
+    // FLOAT64だけはブロックへ直接組み立て、それ以外は揃ってから変換する
+    const bool isEncoded = partial.wave.format != wire::SAMPLE_FLOAT64;
+    const size_t offset = static_cast<size_t>(index) * wire::FRAGMENT_PAYLOAD_SIZE;
+    const size_t payload = size - wire::HEADER_SIZE - wire::FRAGMENT_PREFIX_SIZE;
+    // 最後以外の断片はちょうどFRAGMENT_PAYLOAD_SIZEの長さ
+    const size_t capacity = FrameCodec<WaveData>::bodyLength(wave, partial.wave.format);
+    if(count != partial.count || offset + payload > capacity)   return false;
+    if(index + 1 < count && payload != wire::FRAGMENT_PAYLOAD_SIZE) return false;
+    // 重なって届いたもの
+    if(partial.hasReceived[index])  return true;
+
+    const char *src = prefix + wire::FRAGMENT_PREFIX_SIZE;
+    if(isEncoded){
+        if(partial.encoded.empty()) partial.encoded.resize(static_cast<size_t>(count) * wire::FRAGMENT_PAYLOAD_SIZE);
+        std::copy(src, src + payload, partial.encoded.begin() + offset);
+        if(index + 1 == count)  partial.encodedLength = offset + payload;
+    }
+    else{
+        std::copy(src, src + payload, reinterpret_cast<char *>(wave.raw()) + offset);
+    }
+    partial.hasReceived[index] = true;
+    if(++partial.received < partial.count)  return true;
+
+    WaveData complete = std::move(partial.wave);
+    std::vector<char> encoded = std::move(partial.encoded);
+    encoded.resize(partial.encodedLength);
+    partials_.erase(it);
+    if(!FrameCodec<WaveData>::finish(complete, encoded))    return false;
+    transit_.record(complete.data->captureTime());
+    jitter_.push(seq, std::move(complete.data));
+    return true;
+}
+
+void AsioUdpRecvOutUnit::construct()
+{
+    jitter_.reset();
+    transit_.reset();
+    deadline_ = std::chrono::steady_clock::now();
+    postProc([this]() {
+        partials_.clear();
+        startReceive();
+    });
+}
+
+PCMWavePtr AsioUdpRecvOutUnit::update()
+{
+    // 送り手とは別の、こちらの時計で一周期ずつ進める
+    // 時計のずれはJitterBufferの深さの増減として現れる
+    using steady_clock = std::chrono::steady_clock;
+    deadline_ += period_;
+    if(deadline_ + period_ < steady_clock::now())   deadline_ = steady_clock::now();
+    auto wait = std::chrono::duration_cast<std::chrono::microseconds>(deadline_ - steady_clock::now());
+    if(wait.count() > 0)
+        boost::this_thread::sleep(boost::posix_time::microseconds(wait.count()));
+    endWait();
+    return jitter_.pop();
+}
+
+void AsioUdpRecvOutUnit::destruct() noexcept
+{
+    postProc([this]() { udpSocket_->cancel(); });
+}
+
+void AsioUdpRecvOutUnit::writeStatsImpl(std::ostream& os)
+{
+    auto stats = jitter_.getStats();
+    os <<
+        "    jitter:" << stats.jitterUS << "us" <<
+        " depth:" << stats.depth << "/" << stats.targetDepth <<
+        " recv:" << stats.received <<
+        " late:" << stats.late <<
+        " lost:" << stats.lost <<
+        " concealed:" << stats.concealed <<
+        " skipped:" << stats.skipped << std::endl;
+    // 揺らぎは上の到着間隔のものを見る
+    const auto transit = transit_.getStats();
+    os << "    latency:" << transit.latencyUS << "us" <<
+        " min:" << transit.minLatencyUS << "us" <<
+        " max:" << transit.maxLatencyUS << "us" << std::endl;
+    os << "    rejected:" << rejected_ << std::endl;
+}
+
+///
+
+NetworkTransport parseNetworkTransport(const std::string& name)
+{
+    if(name == "tcp")   return NetworkTransport::TCP;
+    if(name == "udp")   return NetworkTransport::UDP;
+    if(name == "shm")   return NetworkTransport::SHM;
+    BOOST_THROW_EXCEPTION(CablesError());
+}
+
+std::uint8_t parseSampleFormat(const std::string& name)
+{
+    if(name == "raw" || name == "f64")  return wire::SAMPLE_FLOAT64;
+    if(name == "f32")       return wire::SAMPLE_FLOAT32;
+    if(name == "i24")       return wire::SAMPLE_INT24;
+    if(name == "i16")       return wire::SAMPLE_INT16;
+    if(name == "lossless")  return wire::SAMPLE_LOSSLESS16;
+    BOOST_THROW_EXCEPTION(CablesError());
+}
+
+SendQueueLimit parseSendQueueLimit(const std::string& size, const std::string& policy)
+{
+    SendQueuePolicy p;
+    if(policy == "oldest")          p = SendQueuePolicy::DROP_OLDEST;
+    else if(policy == "newest")     p = SendQueuePolicy::DROP_NEWEST;
+    else if(policy == "coalesce")   p = SendQueuePolicy::COALESCE;
+    else    BOOST_THROW_EXCEPTION(CablesError());
+
+    if(size.size() > 2 && size.compare(size.size() - 2, 2, "ms") == 0)
+        return SendQueueLimit::fromMilliseconds(boost::lexical_cast<int>(size.substr(0, size.size() - 2)), p);
+    return SendQueueLimit(boost::lexical_cast<int>(size), p);
+}
+
+UnitPtr createNetworkSendUnit(NetworkTransport transport, unsigned short port, const std::string& ipaddr,
+                              std::uint8_t format, const SendQueueLimit& limit)
+{
+    if(transport == NetworkTransport::UDP)
+        return std::make_shared<AsioUdpSendInUnit>(port, ipaddr, format);
+    if(transport == NetworkTransport::SHM)
+        return std::make_shared<ShmSendInUnit>(port);
+    return std::make_shared<AsioNetworkSendInUnit>(port, ipaddr, format, limit);
+}
+
+UnitPtr createNetworkRecvUnit(NetworkTransport transport, unsigned short port)
+{
+    if(transport == NetworkTransport::UDP)
+        return std::make_shared<AsioUdpRecvOutUnit>(port);
+    if(transport == NetworkTransport::SHM)
+        return std::make_shared<ShmRecvOutUnit>(port);
+    return std::make_shared<AsioNetworkRecvOutUnit>(port);
+}
@@ -7,109 +7,729 @@
 // ということでboost::asioのみ対応、Adapter書ける人求む
 
 #include "asio_connection.hpp"
+#include "wireformat.hpp"
 #include "socket.hpp"
 #include "pcmwave.hpp"
-#include <boost/serialization/array.hpp>
+#include "wavepool.hpp"
+#include "jitterbuffer.hpp"
+#include "losslesscodec.hpp"
+#include "driftcompensator.hpp"
+#include "lossconcealer.hpp"
+#include "helper.hpp"
+#include <boost/circular_buffer.hpp>
 #include <boost/thread.hpp>
-#include <deque>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
 
-namespace boost {
-    namespace serialization {
-        template <class Archive>
-        void serialize(Archive& ar, PCMWave::Sample& data, const unsigned int version) 
-        {
-            ar & data.left & data.right;
-        }
+struct WaveData
+{
+    PCMWavePtr data;
+    // 送るときの形式。受け取ったときは届いた形式が入る
+    std::uint8_t format;
+    // 接続の中での流れの番号
+    std::uint16_t stream;
+    // 流れの中でのブロックの連番。送り手が付ける
+    // 録った時刻はdataが持っている
+    std::uint32_t seq;
 
-        template <class Archive>
-        void serialize(Archive& ar, PCMWave& data, const unsigned int version) 
-        {
-            ar & data.get();
+    WaveData()
+        : format(wire::SAMPLE_FLOAT64), stream(0), seq(0)
+    {}
+    WaveData(PCMWavePtr data_, std::uint8_t format_ = wire::SAMPLE_FLOAT64, std::uint16_t stream_ = 0, std::uint32_t seq_ = 0)
+        : data(std::move(data_)), format(format_), stream(stream_), seq(seq_)
+    {}
+};
+
+// WAVEフレームのボディ
+//   u16 channels
+//   u8  sampleFormat   wire::SampleFormat
+//   u8  reserved       0
+//   u32 frames
+//   u32 seq            流れの中での連番
+//   i64 captureTime    録った時刻。PCMWave::currentTime()の単位で、分からなければ0
+//   PCM                インターリーブのまま
+//     SAMPLE_FLOAT64     f64 x frames x channels
+//     SAMPLE_INT16       i16 x frames x channels
+//     SAMPLE_INT24       i24 x frames x channels
+//     SAMPLE_FLOAT32     f32 x frames x channels
+//     SAMPLE_LOSSLESS16  LosslessCodecの符号
+// FLOAT64はブロックの中身をそのまま指して送り、受け取るときもブロックへ直接読み込む
+// それ以外はscratchで変換する
+template<>
+struct FrameCodec<WaveData>
+{
+    enum {
+        TYPE = wire::FRAME_WAVE,
+        PREFIX_SIZE = 20,
+    };
+
+    static std::uint16_t stream(const WaveData& t) { return t.stream; }
+    static void setStream(WaveData& t, std::uint16_t stream) { t.stream = stream; }
+
+    static size_t rawLength(const PCMWave& wave) { return wave.size() * wave.channels() * sizeof(double); }
+    // 圧縮してもこれより長くはならない
+    static size_t maxEncodedLength(const PCMWave& wave) { return rawLength(wave) + 64; }
+    // formatでのPCMの長さ。LOSSLESS16なら上限
+    static size_t bodyLength(size_t frames, int channels, int format)
+    {
+        if(format == wire::SAMPLE_LOSSLESS16)   return frames * channels * sizeof(double) + 64;
+        return frames * channels * wire::sampleBytes(format);
+    }
+    static size_t bodyLength(const PCMWave& wave, int format) { return bodyLength(wave.size(), wave.channels(), format); }
+    // 今のセッションで正しいボディの長さの上限
+    // 一つのブロックより長いフレームは作らないので、これを超えるヘッダは読まずに捨てる
+    static size_t maxLength()
+    {
+        return PREFIX_SIZE + bodyLength(PCMWave::bufferSize(), PCMWave::MAX_CHANNEL_COUNT, wire::SAMPLE_FLOAT64);
+    }
+
+    static void storePrefix(const PCMWave& wave, std::uint8_t format, std::uint32_t seq, char *prefix)
+    {
+        wire::storeLE16(prefix, wave.channels());
+        prefix[2] = static_cast<char>(format);
+        prefix[3] = 0;
+        wire::storeLE32(prefix + 4, wave.size());
+        wire::storeLE32(prefix + 8, seq);
+        wire::storeLE64(prefix + 12, static_cast<std::uint64_t>(wave.captureTime()));
+    }
+
+    // 前置きを確かめて、それが示すPCMの長さ(LOSSLESS16なら上限)をlengthに入れる
+    // 何も確保しないので、長さを確かめてからブロックを取れる
+    static bool checkPrefix(const char *prefix, size_t& length)
+    {
+        const int channels = wire::loadLE16(prefix);
+        const int format = static_cast<std::uint8_t>(prefix[2]);
+        const size_t frames = wire::loadLE32(prefix + 4);
+        if(channels < 1 || PCMWave::MAX_CHANNEL_COUNT < channels)  return false;
+        if(!wire::isValidSampleFormat(format))  return false;
+        if(frames > static_cast<size_t>(PCMWave::bufferSize()))    return false;
+        length = bodyLength(frames, channels, format);
+        return true;
+    }
+
+    // 前置きの形のブロックをプールから取ってt.dataに入れる。中身は不定
+    static bool loadPrefix(const char *prefix, WaveData& t)
+    {
+        size_t length;
+        if(!checkPrefix(prefix, length))    return false;
+        const int channels = wire::loadLE16(prefix);
+        const int format = static_cast<std::uint8_t>(prefix[2]);
+        const size_t frames = wire::loadLE32(prefix + 4);
+
+        t.format = format;
+        t.seq = wire::loadLE32(prefix + 8);
+        t.data = PCMWavePool::getInstance().allocate(channels);
+        PCMWave& wave = t.data.mutate();
+        if(wave.size() != frames)   wave.reshape(frames, channels);
+        wave.setCaptureTime(static_cast<std::int64_t>(wire::loadLE64(prefix + 12)));
+        return true;
+    }
+
+    // PCMをformatで送る順のバイト列にして、その先頭と長さを返す
+    // FLOAT64でlittle endianのホストならブロックの中身をそのまま指し、
+    // それ以外はscratchに書く
+    static std::pair<const char *, size_t> encodeBody(const PCMWave& wave, int format, std::vector<char>& scratch);
+    // encodeBodyの逆。waveの形は前置きで合わせておくこと。長さが合わなければfalse
+    static bool decodeBody(int format, const char *src, size_t size, PCMWave& wave);
+
+    static size_t encode(const WaveData& t, char *prefix, std::vector<char>& scratch,
+                         std::vector<boost::asio::const_buffer>& buffers)
+    {
+        storePrefix(*t.data, t.format, t.seq, prefix);
+        auto body = encodeBody(*t.data, t.format, scratch);
+        buffers.push_back(boost::asio::buffer(body.first, body.second));
+        return body.second;
+    }
+
+    static bool check(size_t restLength, const char *prefix)
+    {
+        size_t length;
+        if(!checkPrefix(prefix, length))    return false;
+        if(static_cast<std::uint8_t>(prefix[2]) == wire::SAMPLE_LOSSLESS16)    return restLength <= length;
+        return restLength == length;
+    }
+
+    static bool prepare(WaveData& t, size_t restLength, const char *prefix, std::vector<char>& scratch,
+                        boost::asio::mutable_buffer& body)
+    {
+        // 長さが合ってからブロックを取る
+        if(!check(restLength, prefix))  return false;
+        if(!loadPrefix(prefix, t))  return false;
+        PCMWave& wave = t.data.mutate();
+
+        if(t.format == wire::SAMPLE_FLOAT64){
+            body = boost::asio::buffer(wave.raw(), restLength);
+        }
+        else{
+            scratch.resize(restLength);
+            body = boost::asio::buffer(scratch);
         }
+        return true;
     }
-}
 
-struct WaveData
+    static bool finish(WaveData& t, const std::vector<char>& scratch)
+    {
+        if(!t.data) return false;
+        PCMWave& wave = t.data.mutate();
+        if(t.format == wire::SAMPLE_FLOAT64)
+            return decodeBody(t.format, reinterpret_cast<const char *>(wave.raw()), rawLength(wave), wave);
+        return decodeBody(t.format, scratch.data(), scratch.size(), wave);
+    }
+};
+
+// FRAME_HELLOのボディ
+// 繋いだ直後に交換して、セッションの形が合わなければどちらも切る
+struct HelloData
 {
-    PCMWave data;
+    std::uint32_t sampleRate, bufferSize;
+    std::uint8_t format, status;
+    std::uint32_t sender;
 
-    WaveData(){}
-    WaveData(const PCMWave& data_)
-        : data(data_)
+    HelloData()
+        : sampleRate(0), bufferSize(0), format(wire::SAMPLE_FLOAT64), status(wire::HELLO_OK), sender(0)
     {}
+    // このプロセスのセッションの形で作る
+    static HelloData current(std::uint8_t format, std::uint8_t status = wire::HELLO_OK, std::uint32_t sender = 0)
+    {
+        HelloData ret;
+        ret.sampleRate = PCMWave::sampleRate();
+        ret.bufferSize = PCMWave::bufferSize();
+        ret.format = format;
+        ret.status = status;
+        ret.sender = sender;
+        return ret;
+    }
 
-    friend class boost::serialization::access;
-    template<class Archive>
-    void serialize(Archive& ar, const unsigned int version)
+    // 受け取ったものをこちらの形と比べる
+    std::uint8_t check() const
     {
-        ar & data;
+        if(!wire::isValidSampleFormat(format))  return wire::HELLO_UNSUPPORTED;
+        if(sampleRate != static_cast<std::uint32_t>(PCMWave::sampleRate()) ||
+           bufferSize != static_cast<std::uint32_t>(PCMWave::bufferSize()))
+            return wire::HELLO_FORMAT_MISMATCH;
+        return wire::HELLO_OK;
     }
 };
 
-class AsioNetworkBase
+template<>
+struct FrameCodec<HelloData>
+{
+    enum {
+        TYPE = wire::FRAME_HELLO,
+        PREFIX_SIZE = 16,
+    };
+
+    static std::uint16_t stream(const HelloData&) { return 0; }
+    static void setStream(HelloData&, std::uint16_t) {}
+    static size_t maxLength() { return PREFIX_SIZE; }
+
+    static size_t encode(const HelloData& t, char *prefix, std::vector<char>&, std::vector<boost::asio::const_buffer>&)
+    {
+        wire::storeLE32(prefix, t.sampleRate);
+        wire::storeLE32(prefix + 4, t.bufferSize);
+        prefix[8] = static_cast<char>(t.format);
+        prefix[9] = static_cast<char>(t.status);
+        wire::storeLE16(prefix + 10, 0);
+        wire::storeLE32(prefix + 12, t.sender);
+        return 0;
+    }
+
+    static bool check(size_t restLength, const char *) { return restLength == 0; }
+
+    static bool prepare(HelloData& t, size_t restLength, const char *prefix, std::vector<char>&,
+                        boost::asio::mutable_buffer& body)
+    {
+        if(!check(restLength, prefix))  return false;
+        t.sampleRate = wire::loadLE32(prefix);
+        t.bufferSize = wire::loadLE32(prefix + 4);
+        t.format = static_cast<std::uint8_t>(prefix[8]);
+        t.status = static_cast<std::uint8_t>(prefix[9]);
+        t.sender = wire::loadLE32(prefix + 12);
+        body = boost::asio::mutable_buffer();
+        return true;
+    }
+
+    static bool finish(HelloData&, const std::vector<char>&) { return true; }
+};
+
+// 全てのネットワークのUnitが共有するio_serviceと、それを回すスレッド
+// スレッドの数は接続の数ではなくコアの数に合わせる
+class AsioServicePool
 {
 private:
+    static int requestedThreadCount_;
+
     boost::asio::io_service ioService_;
     std::unique_ptr<boost::asio::io_service::work> work_;
-    std::unique_ptr<boost::thread> ioServer_;
+    std::vector<std::unique_ptr<boost::thread>> threads_;
+
+private:
+    AsioServicePool(int threadCount);
+
+public:
+    // 最初にgetInstance()を呼ぶ前に決めておく。0以下ならコア数
+    static void setThreadCount(int threadCount);
+    static AsioServicePool& getInstance();
+
+    boost::asio::io_service& getService() { return ioService_; }
+    int getThreadCount() const { return threads_.size(); }
+};
+
+// 共有のio_serviceの上に自分用のstrandを一つ持つ
+// postProc()とwrap()したhandlerはこのstrandで一つずつ走るので、
+// 派生クラスの状態は今まで通り一本のスレッドから触るつもりで書いてよい
+class AsioNetworkBase
+{
+private:
+    enum {
+        // このオブジェクトのhandlerを同時に置いておける数と大きさ。溢れた分は普通に確保する
+        HANDLER_SLOT_COUNT = 16,
+        HANDLER_SLOT_SIZE = 512,
+    };
+
+    // postしたものとwrap()したhandlerのうち、まだ終わっていないものの数
+    struct PendingCount
+    {
+        boost::mutex mtx;
+        boost::condition_variable cond;
+        int count;
+        // 数えているhandlerの置き場所
+        HandlerMemory memory;
+
+        PendingCount()
+            : count(0), memory(HANDLER_SLOT_COUNT, HANDLER_SLOT_SIZE)
+        {}
+
+        void add()
+        {
+            SCOPED_LOCK(mtx);
+            count++;
+        }
+
+        void release()
+        {
+            SCOPED_LOCK(mtx);
+            if(--count == 0)    cond.notify_all();
+        }
+    };
+
+    // 写しも含めて、全て捨てられるまでkill()を待たせる
+    // asioが操作を置く場所はPendingCountのmemoryから取る
+    template<class Handler>
+    class Tracked
+    {
+    private:
+        mutable Handler handler_;
+        PendingCount *pending_;
+
+    public:
+        Tracked(Handler handler, PendingCount& pending)
+            : handler_(std::move(handler)), pending_(&pending)
+        {
+            pending_->add();
+        }
+
+        Tracked(const Tracked& rhs)
+            : handler_(rhs.handler_), pending_(rhs.pending_)
+        {
+            pending_->add();
+        }
+
+        // 移した先が数を引き継ぐ
+        Tracked(Tracked&& rhs)
+            : handler_(std::move(rhs.handler_)), pending_(rhs.pending_)
+        {
+            rhs.pending_ = nullptr;
+        }
+
+        ~Tracked()
+        {
+            if(pending_)    pending_->release();
+        }
+
+        Tracked& operator=(const Tracked&) = delete;
+
+        template<class... Args> void operator()(Args&&... args) const
+        {
+            handler_(std::forward<Args>(args)...);
+        }
+
+        friend void *asio_handler_allocate(std::size_t size, Tracked *self)
+        {
+            return self->pending_->memory.allocate(size);
+        }
+
+        friend void asio_handler_deallocate(void *p, std::size_t, Tracked *self)
+        {
+            self->pending_->memory.deallocate(p);
+        }
+    };
+
+private:
+    boost::asio::io_service& ioService_;
+    boost::asio::io_service::strand strand_;
+    PendingCount pending_;
+
+    template<class Handler> Tracked<Handler> track(Handler handler)
+    {
+        return Tracked<Handler>(std::move(handler), pending_);
+    }
 
 public:
     AsioNetworkBase();
     virtual ~AsioNetworkBase();
 
+    // このオブジェクトのhandlerが全て終わるまで待つ
+    // 待ち続けている読み込みなどがあれば返らないので、先に閉じておくこと
+    // strandの中からは呼ばないこと
     void kill();
     std::unique_ptr<boost::asio::ip::tcp::acceptor> createAcceptor(unsigned short port);
     ConnectionPtr createConnection();
+    // portが0なら送信用に開くだけで、bindしない
+    std::unique_ptr<boost::asio::ip::udp::socket> createUdpSocket(unsigned short port = 0);
+    // マルチキャストのgroupに加わってportで受ける。同じホストの他の受け手とportを分け合える
+    std::unique_ptr<boost::asio::ip::udp::socket> createMulticastSocket(unsigned short port, const std::string& group);
 
     template<class Proc> void postProc(Proc proc)
     {
-        ioService_.post(proc);
+        strand_.post(track(std::move(proc)));
+    }
+
+    // 非同期の操作に渡すhandlerは全てこれを通す
+    template<class Handler> auto wrap(Handler handler)
+        -> decltype(std::declval<boost::asio::io_service::strand&>().wrap(std::declval<Tracked<Handler>>()))
+    {
+        return strand_.wrap(track(std::move(handler)));
     }
 };
 
 
-class AsioNetworkRecvOutUnit : public Unit, private AsioNetworkBase
+class AsioNetworkRecvOutUnit;
+
+// TCPで受けて、フレームを送り手とstreamごとにAsioNetworkRecvOutUnitへ配る
+// 一本だけ受ける版と、何本でも受けるサーバ版がある
+//   一本だけ: 登録されたUnitが一つでもあれば待ち受け、なくなれば切る
+//             送り手の区別はせず、peerは常に空
+//   サーバ:   ずっと待ち受け、送り手はIPアドレスとHELLOの送り手の番号で区別する
+//             知らない流れが来たらStreamHandlerに知らせるので、そこでUnitを作って登録する
+//             同じ送り手が繋ぎ直したら古い接続を切り、登録済みのUnitへそのまま配る
+//             同じホストやNATの後ろの別の送り手は、番号が違うので互いに切り合わない
+// どちらも登録のない流れのフレームは捨てる
+class AsioStreamReceiver : private AsioNetworkBase
 {
+public:
+    // strandの中で呼ばれる
+    using StreamHandler = std::function<void(const std::string& peer, std::uint16_t stream)>;
+
 private:
+    using RouteKey = std::pair<std::string, std::uint16_t>;
+
+private:
+    const StreamHandler handler_;
+    // 以下はstrandの中だけで触る
     std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor_;
-    ConnectionPtr conn_;
-    bool hasConnected_;
+    bool isAccepting_;
+    // 握手を済ませた接続
+    std::map<std::string, ConnectionPtr> peers_;
+    std::map<RouteKey, AsioNetworkRecvOutUnit *> routes_;
+    // handler_に知らせて、まだ登録されていないもの
+    std::set<RouteKey> requested_;
+    std::atomic<std::uint64_t> unrouted_, rejected_;
 
 private:
+    // サーバで送り手を区別する名前。"address#sender"
+    static std::string peerName(const boost::asio::ip::tcp::endpoint& endpoint, std::uint32_t sender);
+    bool isServer() const { return static_cast<bool>(handler_); }
     void startAccept();
-    void startRead();
+    void startHandshake(const ConnectionPtr& conn);
+    void startRead(const std::string& peer, const ConnectionPtr& conn);
+    void handleRecvWaveData(const std::string& peer, const ConnectionPtr& conn,
+                            const boost::system::error_code& error, const std::vector<WaveData>& frames);
+    void route(const std::string& peer, const WaveData& wave);
+    void setPeerConnected(const std::string& peer, bool hasConnected);
+    void closePeer(const std::string& peer);
+
+public:
+    // 一本だけ受ける
+    AsioStreamReceiver(unsigned short port);
+    // 何本でも受ける
+    AsioStreamReceiver(unsigned short port, const StreamHandler& handler);
+    ~AsioStreamReceiver();
+
+    void attach(const std::string& peer, std::uint16_t stream, AsioNetworkRecvOutUnit *unit);
+    // 戻ったときにはもうunitへは配らない
+    // strandの中からは呼ばないこと
+    void detach(const std::string& peer, std::uint16_t stream, AsioNetworkRecvOutUnit *unit);
+    // 登録のない流れに来て捨てたフレームの数
+    std::uint64_t getUnroutedCount() const { return unrouted_; }
+    // 形や長さが正しくなくて弾いたフレームの数。弾いた接続は切る
+    std::uint64_t getRejectedCount() const { return rejected_; }
+    // 今繋がっている送り手の数
+    int getPeerCount();
+};
+
+// 届いたブロックは、連番の抜けを埋め、送り手との時計のずれを打ち消してから流す
+class AsioNetworkRecvOutUnit : public Unit
+{
+    friend class AsioStreamReceiver;
+private:
+    std::shared_ptr<AsioStreamReceiver> receiver_;
+    const std::string peer_;
+    const std::uint16_t stream_;
+    TransitMeter transit_;
+    // 以下はreceiverのstrandの中だけで触る
+    LossConcealer concealer_;
+    DriftCompensator drift_;
+    std::vector<PCMWavePtr> concealed_, compensated_;
+
+private:
+    void setConnected(bool hasConnected);
+    void receive(const WaveData& wave);
 
 public:
+    // portで一本だけ受ける
     AsioNetworkRecvOutUnit(unsigned short port);
+    // receiverに届く、peerからのstreamの流れを受ける
+    AsioNetworkRecvOutUnit(const std::shared_ptr<AsioStreamReceiver>& receiver, std::uint16_t stream, const std::string& peer = "");
     ~AsioNetworkRecvOutUnit();
 
     void startImpl();
     void stopImpl();
+    void writeStatsImpl(std::ostream& os);
+
+    DriftCompensator::Stats getDriftStats() const { return drift_.getStats(); }
+    LossConcealer::Stats getLossStats() const { return concealer_.getStats(); }
+    TransitMeter::Stats getTransitStats() const { return transit_.getStats(); }
+};
 
-    void handleRecvWaveData(const boost::system::error_code& error, const boost::optional<WaveData>& data);
+// 送り待ちのブロックが溜まりすぎたときの振る舞い
+enum class SendQueuePolicy
+{
+    DROP_OLDEST,    // 一番古い待ちを捨てる
+    DROP_NEWEST,    // 来たものを捨てる
+    COALESCE,       // その流れの待ちを全部捨てて、来たものだけにする
 };
 
-class AsioNetworkSendInUnit : public Unit, private AsioNetworkBase
+// 送り待ちの上限。streamごとのブロックの数で数える
+// 書き込み中のものは数えない
+struct SendQueueLimit
+{
+    enum {
+        DEFAULT_MILLISECONDS = 500,
+    };
+
+    int blocks;
+    SendQueuePolicy policy;
+
+    SendQueueLimit()
+        : SendQueueLimit(fromMilliseconds(DEFAULT_MILLISECONDS))
+    {}
+    SendQueueLimit(int blocks_, SendQueuePolicy policy_ = SendQueuePolicy::DROP_OLDEST)
+        : blocks(std::max(1, blocks_)), policy(policy_)
+    {}
+
+    // 今のセッションの形式で、ms分を下回らない数のブロック
+    static SendQueueLimit fromMilliseconds(int ms, SendQueuePolicy policy = SendQueuePolicy::DROP_OLDEST)
+    {
+        const long long perBlock = PCMWave::bufferSize() * 1000LL;
+        return SendQueueLimit(static_cast<int>((ms * static_cast<long long>(PCMWave::sampleRate()) + perBlock - 1) / perBlock), policy);
+    }
+};
+
+// TCPの接続を一本張って、複数のAsioNetworkSendInUnitのブロックをstream付きで流す
+// 登録されたUnitが一つでもあれば繋ぎ、なくなれば切る
+// 回線が詰まっても、送り待ちはSendQueueLimitを超えて伸びない
+class AsioStreamSender : private AsioNetworkBase
 {
 private:
+    enum {
+        // 一度の書き込みにまとめる量の目安
+        // 書き込み中に溜まった分を次にまとめて書くので、空いていれば一つずつ、混んでいればまとめて書く
+        MAX_BATCH_BYTES = 256 * 1024,
+    };
+
+private:
+    // 以下はstrandの中だけで触る
     ConnectionPtr conn_;
     unsigned short port_;
     std::string ipaddr_;
-    std::deque<std::shared_ptr<WaveData>> waveQue_;
+    // 先頭のinFlight_個は書き込み中
+    // 一杯になったときだけ広げるので、落ち着いてからは確保しない
+    boost::circular_buffer<WaveData> waveQue_;
+    size_t inFlight_;
+    // 書き込みに渡す入れ物。中身は接続と取り替えるので、容量は持ち越される
+    std::vector<WaveData> batch_;
+    // streamごとの、まだ書き込みに渡していないブロックの数
+    std::map<std::uint16_t, int> waiting_;
+    // streamごとの次の連番。溢れて捨てたものも番号は使うので、受け手には抜けに見える
+    std::map<std::uint16_t, std::uint32_t> nextSeq_;
+    // HELLOで名乗る番号。繋ぎ直しても変えないので、受け手は古い接続を置き換える
+    const std::uint32_t senderId_;
     bool hasConnected_;
+    int attachCount_;
+    const std::uint8_t format_;
+    SendQueueLimit limit_;
+
+    std::atomic<int> depth_, maxDepth_, limitBlocks_;
+    std::atomic<std::uint64_t> dropped_, writes_, writtenBlocks_;
 
 private:
     void startConnect();
+    void startHandshake();
     void startSend();
     void closeConnect();
+    void enqueue(const WaveData& data);
+    void updateDepth();
+
+public:
+    AsioStreamSender(const unsigned short port, const std::string& ipaddr, std::uint8_t format = wire::SAMPLE_FLOAT64,
+                     const SendQueueLimit& limit = SendQueueLimit());
+    ~AsioStreamSender();
+
+    void attach();
+    void detach();
+    void push(std::uint16_t stream, PCMWavePtr wave);
+    void setQueueLimit(const SendQueueLimit& limit);
+
+    // 書き込み中のものも含めた、今の送り待ちの数と、その最大
+    int getQueueDepth() const { return depth_; }
+    int getMaxQueueDepth() const { return maxDepth_; }
+    int getQueueLimit() const { return limitBlocks_; }
+    // 溢れて捨てたブロックの数
+    std::uint64_t getDroppedCount() const { return dropped_; }
+    // 一度の書き込みにまとめたブロックの数の平均
+    double getAverageBatchSize() const { return writes_ == 0 ? 0 : static_cast<double>(writtenBlocks_) / writes_; }
+};
+
+class AsioNetworkSendInUnit : public Unit
+{
+private:
+    std::shared_ptr<AsioStreamSender> sender_;
+    const std::uint16_t stream_;
 
 public:
-    AsioNetworkSendInUnit(const unsigned short port, const std::string& ipaddr);
+    // ipaddr:portへ一本だけ送る
+    AsioNetworkSendInUnit(const unsigned short port, const std::string& ipaddr, std::uint8_t format = wire::SAMPLE_FLOAT64,
+                          const SendQueueLimit& limit = SendQueueLimit());
+    // senderの接続にstreamとして載せる
+    AsioNetworkSendInUnit(const std::shared_ptr<AsioStreamSender>& sender, std::uint16_t stream);
     ~AsioNetworkSendInUnit();
 
     void startImpl();
     void stopImpl();
-    void inputImpl(const PCMWave& wave);
+    void inputImpl(PCMWavePtr wave);
+    void writeStatsImpl(std::ostream& os);
+};
+
+// mic/mixerから選ぶ送り方
+enum class NetworkTransport
+{
+    TCP,
+    UDP,    // 遅延を抑えたいとき。失われたブロックは受け手が埋める
+    SHM,    // 同じホストどうし。共有メモリの環で渡す(shm_network.hpp)
+};
+NetworkTransport parseNetworkTransport(const std::string& name);
+// "raw"(= "f64"), "f32", "i24", "i16", "lossless"
+std::uint8_t parseSampleFormat(const std::string& name);
+// size: ブロックの数か"<n>ms"  policy: "oldest", "newest", "coalesce"
+SendQueueLimit parseSendQueueLimit(const std::string& size, const std::string& policy = "oldest");
+// formatはwire::SampleFormat。受け手は届いた形式に合わせるので指定しなくてよい
+// limitはTCPのときだけ使う。SHMではipaddrとformatも使わない
+UnitPtr createNetworkSendUnit(NetworkTransport transport, unsigned short port, const std::string& ipaddr,
+                              std::uint8_t format = wire::SAMPLE_FLOAT64, const SendQueueLimit& limit = SendQueueLimit());
+UnitPtr createNetworkRecvUnit(NetworkTransport transport, unsigned short port);
+
+// UDPの断片のヘッダと前置き
+using FragmentHead = std::array<char, wire::HEADER_SIZE + wire::FRAGMENT_PREFIX_SIZE>;
+// lengthバイトに符号化したwaveを分ける断片の、ヘッダと前置きをheadsに並べる
+void storeFragmentHeads(const PCMWave& wave, std::uint8_t format, std::uint32_t seq, size_t length,
+                        std::vector<FragmentHead>& heads);
+
+// UDPで送る版
+// ブロックを連番付きの断片に分けて、一つずつデータグラムで送りっぱなしにする
+// 宛先にマルチキャストのグループを渡してもよい
+class AsioUdpSendInUnit : public Unit, private AsioNetworkBase
+{
+private:
+    std::unique_ptr<boost::asio::ip::udp::socket> udpSocket_;
+    boost::asio::ip::udp::endpoint endpoint_;
+    std::uint32_t seq_;
+    std::vector<char> scratch_;
+    std::vector<FragmentHead> heads_;
+    const std::uint8_t format_;
+
+private:
+    void sendWave(const PCMWavePtr& wave);
+
+public:
+    AsioUdpSendInUnit(const unsigned short port, const std::string& ipaddr, std::uint8_t format = wire::SAMPLE_FLOAT64);
+    ~AsioUdpSendInUnit();
+
+    void startImpl();
+    void stopImpl();
+    void inputImpl(PCMWavePtr wave);
+};
+
+// UDPで受ける版
+// 受信はstrandの中で断片を組み立ててJitterBufferに入れるだけで、
+// 下流へはこのUnitのスレッドが自分の時計で一周期ごとに取り出して流す
+class AsioUdpRecvOutUnit : public ThreadOutUnit, private AsioNetworkBase
+{
+private:
+    enum {
+        MAX_DATAGRAM_SIZE = 65536,
+        // 組み立て途中のブロックはこれだけ覚えておく
+        MAX_PARTIAL_COUNT = 8,
+    };
+
+    struct Partial
+    {
+        WaveData wave;
+        int count, received;
+        std::vector<bool> hasReceived;
+        // FLOAT64以外は揃ってから変換する
+        std::vector<char> encoded;
+        size_t encodedLength;
+    };
+
+private:
+    std::unique_ptr<boost::asio::ip::udp::socket> udpSocket_;
+    boost::asio::ip::udp::endpoint sender_;
+    std::vector<char> recvBuffer_;
+    std::map<std::uint32_t, Partial> partials_;
+    bool isReceiving_;
+    // 形の合わないデータグラムの数
+    std::atomic<std::uint64_t> rejected_;
+
+    JitterBuffer jitter_;
+    TransitMeter transit_;
+    const std::chrono::microseconds period_;
+    std::chrono::steady_clock::time_point deadline_;
+
+private:
+    void startReceive();
+    void handleReceive(const boost::system::error_code& error, size_t size);
+    bool assemble(size_t size);
+
+public:
+    // groupを渡すと、そのマルチキャストのグループに加わって受ける
+    AsioUdpRecvOutUnit(unsigned short port, const std::string& group = "");
+    ~AsioUdpRecvOutUnit();
+
+    void construct();
+    PCMWavePtr update();
+    void destruct() noexcept;
+    void writeStatsImpl(std::ostream& os);
+
+    JitterBuffer::Stats getJitterStats() const { return jitter_.getStats(); }
+    TransitMeter::Stats getTransitStats() const { return transit_.getStats(); }
+    std::uint64_t getRejectedCount() const { return rejected_; }
 };
 
 #endif
@@ -3,6 +3,7 @@
 #define ___AUDIO_HPP___
 
 #include "pcmwave.hpp"
+#include "wavepool.hpp"
 #include <memory>
 #include <vector>
 
@@ -14,7 +15,7 @@ public:
 
     virtual void start() = 0;
     virtual void stop() = 0;
-    virtual PCMWave read() = 0;
+    virtual PCMWavePtr read() = 0;
     virtual void write(const PCMWave& wave) = 0;
 };
 
@@ -39,8 +40,10 @@ public:
     virtual AudioDevicePtr getDefaultInputDevice() = 0;
     virtual AudioDevicePtr getDefaultOutputDevice() = 0;
     virtual std::vector<AudioDevicePtr> getValidDevices() = 0;
+    // channelsが1ならステレオに複製したブロックを、
+    // それ以上ならそのチャンネル数のブロックをread()で返す
     virtual std::unique_ptr<AudioStream> createInputStream(
-        const AudioDevicePtr& device) = 0;
+        const AudioDevicePtr& device, int channels = 1) = 0;
     virtual std::unique_ptr<AudioStream> createOutputStream(
         const AudioDevicePtr& device) = 0;
 
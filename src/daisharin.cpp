@@ -11,7 +11,7 @@ Daisharin::Daisharin(const Config& config)
       delayPoints_(config.delayPointsSize),
       feedPhase_(false),
       reverbTime_(config.reverbTime), 
-      tremoloSpeed_(config.tremoloSpeed / PCMWave::SAMPLE_RATE * pi() * 2),
+      tremoloSpeed_(config.tremoloSpeed / PCMWave::sampleRate() * pi() * 2),
       bufferSize_(config.delayBufferSize),
       lpfHighDump_(config.lpfHighDump)
 {
@@ -47,7 +47,7 @@ double Daisharin::calcFeedback(int offset)
     feedPhase_ ^= 1;
     return (feedPhase_ ? -1 : 1) *
         std::pow(
-            0.001, divd(offset, PCMWave::SAMPLE_RATE) / (reverbTime_ * 0.001))
+            0.001, divd(offset, PCMWave::sampleRate()) / (reverbTime_ * 0.001))
         / std::sqrt(delayPoints_.size());
 }
 
@@ -88,11 +88,11 @@ PCMWave::Sample Daisharin::procReverb(const PCMWave::Sample& input)
     return output - input;
 }
 
-PCMWave Daisharin::update(const PCMWave& input)
+PCMWavePtr Daisharin::update(const PCMWave& input)
 {
-    PCMWave res;
-    auto it = res.begin();
+    PCMWavePtr res = PCMWavePool::getInstance().allocate();
+    auto it = res.mutate().begin();
     for(auto& sample : input)
         *(it++) = procReverb(sample);
-    return std::move(res);
+    return res;
 }
@@ -5,6 +5,7 @@
 // thanks to http://codezine.jp/article/detail/315
 
 #include "pcmwave.hpp"
+#include "wavepool.hpp"
 #include <vector>
 #include <random>
 
@@ -52,7 +53,7 @@ public:
 public:
     Daisharin(const Config& config);
 
-    PCMWave update(const PCMWave& input);
+    PCMWavePtr update(const PCMWave& input);
 };
 
 #endif
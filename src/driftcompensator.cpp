@@ -0,0 +1,65 @@
+#include "driftcompensator.hpp"
+#include "helper.hpp"
+#include <algorithm>
+
+constexpr double DriftCompensator::SMOOTH_TIME;
+constexpr double DriftCompensator::WARMUP_TIME;
+constexpr double DriftCompensator::TIME_CONSTANT;
+constexpr double DriftCompensator::MAX_DEVIATION;
+
+DriftCompensator::DriftCompensator(std::chrono::microseconds period)
+    : periodSec_(period.count() / 1e6)
+{
+    reset();
+}
+
+void DriftCompensator::reset()
+{
+    SCOPED_LOCK(mtx_);
+    resampler_.reset();
+    elapsedSec_ = 0;
+    hasDepth_ = isLocked_ = false;
+    depth_ = targetDepth_ = 0;
+    integral_ = deviation_ = 0;
+}
+
+void DriftCompensator::push(const PCMWavePtr& wave, int depth, std::vector<PCMWavePtr>& out)
+{
+    SCOPED_LOCK(mtx_);
+    elapsedSec_ += periodSec_;
+    if(!hasDepth_)  depth_ = depth;
+    hasDepth_ = true;
+    depth_ += (depth - depth_) * std::min(1.0, periodSec_ / SMOOTH_TIME);
+
+    if(!isLocked_){
+        // 繋がった直後の深さが落ち着くまでは何もしない
+        if(elapsedSec_ >= WARMUP_TIME){
+            targetDepth_ = depth_;
+            isLocked_ = true;
+        }
+    }
+    else{
+        // 溜まりすぎていれば速く読む（比を1より大きくする）
+        // 遅延はd(遅延)/dt = ずれ - 比の差 で動くので、PIで閉じると s^2 + KP s + KI になる
+        const double KP = 2 / TIME_CONSTANT, KI = 1 / (TIME_CONSTANT * TIME_CONSTANT);
+        const double errorSec = (depth_ - targetDepth_) * periodSec_;
+        integral_ = std::max(-MAX_DEVIATION, std::min(MAX_DEVIATION, integral_ + KI * errorSec * periodSec_));
+        deviation_ = std::max(-MAX_DEVIATION, std::min(MAX_DEVIATION, KP * errorSec + integral_));
+    }
+
+    resampler_.push(*wave, 1 + deviation_);
+    PCMWavePtr ret;
+    while(resampler_.pop(ret))  out.push_back(std::move(ret));
+}
+
+DriftCompensator::Stats DriftCompensator::getStats() const
+{
+    SCOPED_LOCK(mtx_);
+    Stats ret;
+    ret.driftPPM = integral_ * 1e6;
+    ret.ratioPPM = deviation_ * 1e6;
+    ret.depth = depth_;
+    ret.targetDepth = targetDepth_;
+    ret.isLocked = isLocked_;
+    return ret;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#ifndef ___DRIFTCOMPENSATOR_HPP___
+#define ___DRIFTCOMPENSATOR_HPP___
+
+// 送り手と受け手の時計のずれを打ち消して、受けた流れの遅延を一定に保つ  // thread safe
+//
+// ずれは、届いたブロックが下流の辺にいくつ溜まっているかの移り変わりとして見える
+// 深さを均して、落ち着いた頃の深さを目標にし、そこからの差をPI制御で
+// VariableResamplerの比に戻す。積分の項がそのまま時計のずれの見積もりになる
+
+#include "resampler.hpp"
+#include <boost/thread.hpp>
+#include <chrono>
+#include <vector>
+
+class DriftCompensator
+{
+public:
+    struct Stats
+    {
+        // 正なら送り手の時計が速い
+        double driftPPM;
+        // 今掛けている比の1からの差
+        double ratioPPM;
+        double depth, targetDepth;
+        bool isLocked;
+    };
+
+private:
+    // 時間はすべて秒
+    static constexpr double SMOOTH_TIME = 2.0;
+    static constexpr double WARMUP_TIME = 5.0;
+    // 追従の時定数。臨界制動になるように係数を決める
+    static constexpr double TIME_CONSTANT = 120.0;
+    // 比を動かすのはここまで（音程にして2cent弱）
+    static constexpr double MAX_DEVIATION = 1000e-6;
+
+private:
+    mutable boost::mutex mtx_;
+    VariableResampler resampler_;
+    const double periodSec_;
+
+    double elapsedSec_;
+    bool hasDepth_, isLocked_;
+    double depth_, targetDepth_;
+    double integral_, deviation_;
+
+public:
+    // periodは1ブロックの長さ
+    DriftCompensator(std::chrono::microseconds period);
+
+    void reset();
+    // 届いたブロックと、その時点の下流の深さを渡す
+    // 比を掛けた結果、出来上がったブロックをoutに積む（0個か1個、たまに2個）
+    void push(const PCMWavePtr& wave, int depth, std::vector<PCMWavePtr>& out);
+
+    Stats getStats() const;
+};
+
+#endif
@@ -24,10 +24,18 @@ void FakeFilterSwitchUnit::change(int index)
     if(nowIndex_ != -1) filters_.at(nowIndex_)->reset();
 }
 
-void FakeFilterSwitchUnit::inputImpl(const PCMWave& src)
+void FakeFilterSwitchUnit::inputImpl(PCMWavePtr src)
 {
     SCOPED_LOCK(mtx_);
 
     int index = nowIndex_;
-    send(index < 0 ? src : std::move(filters_.at(index)->proc(src)));
+    if(index < 0){
+        send(std::move(src));
+        return;
+    }
+    // フィルタが新しく作ったブロックにも、録った時刻を引き継ぐ
+    const std::int64_t captureTime = src->captureTime();
+    PCMWavePtr dst = filters_.at(index)->proc(std::move(src));
+    if(dst && dst->captureTime() != captureTime)    dst.mutate().setCaptureTime(captureTime);
+    send(std::move(dst));
 }
@@ -4,6 +4,7 @@
 
 #include "pcmwave.hpp"
 #include "socket.hpp"
+#include "wavepool.hpp"
 #include <boost/thread.hpp>
 #include <memory>
 #include <vector>
@@ -15,7 +16,7 @@ public:
     virtual ~FakeFilter(){}
 
     virtual void reset() = 0;
-    virtual PCMWave proc(const PCMWave& src) = 0;
+    virtual PCMWavePtr proc(PCMWavePtr src) = 0;
 };
 using FakeFilterPtr = std::shared_ptr<FakeFilter>;
 
@@ -33,7 +34,7 @@ public:
     // -1 : through
     void change(int index);
 
-    void inputImpl(const PCMWave& src);
+    void inputImpl(PCMWavePtr src);
 };
 
 #endif
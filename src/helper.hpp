@@ -3,6 +3,7 @@
 #define ___HELPER_HPP___
 
 #include "audio.hpp"
+#include <boost/lexical_cast.hpp>
 #include <memory>
 #include <sstream>
 #include <vector>
@@ -39,6 +40,16 @@ inline std::string toString(int src)
     return ss.str();
 }
 
+// コマンドライン引数 [sampleRate [bufferSize]] をPCMWaveに反映する
+inline void setWaveFormatFromArgs(int argc, char **argv)
+{
+    int sampleRate = PCMWave::DEFAULT_SAMPLE_RATE;
+    if(argc >= 2)   sampleRate = boost::lexical_cast<int>(argv[1]);
+    int bufferSize = sampleRate / 10;   // 100ms
+    if(argc >= 3)   bufferSize = boost::lexical_cast<int>(argv[2]);
+    PCMWave::setFormat(sampleRate, bufferSize);
+}
+
 inline void writeDeviceInfo(std::ostream& os, const std::vector<AudioDevicePtr>& devices)
 {
     indexedForeach(devices, [&os](int i, const AudioDevicePtr& dev){
@@ -0,0 +1,136 @@
+#include "jitterbuffer.hpp"
+#include "helper.hpp"
+#include <algorithm>
+#include <cmath>
+
+JitterBuffer::JitterBuffer(std::chrono::microseconds period)
+    : periodUS_(static_cast<double>(period.count()))
+{
+    reset();
+}
+
+void JitterBuffer::reset()
+{
+    SCOPED_LOCK(mtx_);
+    blocks_.clear();
+    isPlaying_ = false;
+    nextSeq_ = 0;
+    concealCount_ = 0;
+    concealer_.reset();
+    hasTransit_ = false;
+    lastTransitUS_ = jitterUS_ = 0;
+    targetDepth_ = MIN_DEPTH + 1;
+    received_ = late_ = lost_ = concealed_ = skipped_ = 0;
+}
+
+void JitterBuffer::updateJitter(std::uint32_t seq, Clock::time_point arrival)
+{
+    // 送信側は一定間隔で送っているとみなして、到着時刻とのずれの揺らぎを測る
+    if(!hasTransit_)    origin_ = arrival;
+    const double arrivalUS = std::chrono::duration_cast<std::chrono::microseconds>(arrival - origin_).count();
+    const double transitUS = arrivalUS - seq * periodUS_;
+    if(hasTransit_){
+        const double d = std::fabs(transitUS - lastTransitUS_);
+        jitterUS_ += (d - jitterUS_) / 16;
+    }
+    hasTransit_ = true;
+    lastTransitUS_ = transitUS;
+
+    // 揺らぎの3倍まで吸収できるだけ溜める
+    const int depth = static_cast<int>(std::ceil(3 * jitterUS_ / periodUS_)) + MIN_DEPTH;
+    targetDepth_ = std::max<int>(MIN_DEPTH, std::min<int>(MAX_DEPTH, depth));
+}
+
+void JitterBuffer::push(std::uint32_t seq, PCMWavePtr wave, Clock::time_point arrival)
+{
+    SCOPED_LOCK(mtx_);
+    received_++;
+    // 大きく戻ったら送り手が繋ぎ直したとみなして、測り直す
+    if(isPlaying_ && isBefore(seq + MAX_DEPTH * 2, nextSeq_)){
+        blocks_.clear();
+        isPlaying_ = false;
+        hasTransit_ = false;
+    }
+    updateJitter(seq, arrival);
+    if(isPlaying_ && isBefore(seq, nextSeq_)){
+        late_++;
+        return;
+    }
+    blocks_[seq] = std::move(wave);
+
+    // 溜まりすぎた分は古い方から捨てて、遅延を縮める
+    while(static_cast<int>(blocks_.size()) > targetDepth_ + MAX_DEPTH){
+        blocks_.erase(blocks_.begin());
+        skipped_++;
+    }
+}
+
+PCMWavePtr JitterBuffer::pop()
+{
+    SCOPED_LOCK(mtx_);
+    if(!isPlaying_){
+        if(static_cast<int>(blocks_.size()) < targetDepth_)
+            return PCMWavePool::getInstance().allocateZero();
+        isPlaying_ = true;
+        nextSeq_ = blocks_.begin()->first;
+        concealCount_ = 0;
+    }
+
+    // 目標より溜まっていれば、一つ飛ばして追いつく
+    if(static_cast<int>(blocks_.size()) > targetDepth_ * 2 && blocks_.begin()->first == nextSeq_){
+        blocks_.erase(blocks_.begin());
+        nextSeq_++;
+        skipped_++;
+        concealer_.markSplice();
+    }
+
+    while(!blocks_.empty() && isBefore(blocks_.begin()->first, nextSeq_))
+        blocks_.erase(blocks_.begin());
+    // 大きく飛んだら、埋めずにそこまで進める
+    if(!blocks_.empty() && isBefore(nextSeq_ + MAX_DEPTH, blocks_.begin()->first)){
+        nextSeq_ = blocks_.begin()->first;
+        concealer_.markSplice();
+    }
+
+    auto it = blocks_.find(nextSeq_);
+    if(it != blocks_.end()){
+        PCMWavePtr ret = std::move(it->second);
+        blocks_.erase(it);
+        nextSeq_++;
+        concealCount_ = 0;
+        return concealer_.next(ret);
+    }
+
+    concealCount_++;
+    if(!blocks_.empty()){
+        // 後ろが来ているので、これは失われた
+        lost_++;
+        nextSeq_++;
+    }
+    // 何も来ていなければ遅れているだけかもしれないので、番号は進めずに待つ
+    // このとき遅延は一周期分伸びる
+    concealed_++;
+    PCMWavePtr ret = concealer_.next(PCMWavePtr());
+    if(blocks_.empty() && concealCount_ >= REBUFFER_COUNT){
+        // 送り手が止まったとみなして、次に来たものから溜め直す
+        // 埋めたものはもう無音まで絞れているので、続きは無音から始めてよい
+        isPlaying_ = false;
+        concealer_.reset();
+    }
+    return ret;
+}
+
+JitterBuffer::Stats JitterBuffer::getStats() const
+{
+    SCOPED_LOCK(mtx_);
+    Stats ret;
+    ret.received = received_;
+    ret.late = late_;
+    ret.lost = lost_;
+    ret.concealed = concealed_;
+    ret.skipped = skipped_;
+    ret.depth = blocks_.size();
+    ret.targetDepth = targetDepth_;
+    ret.jitterUS = jitterUS_;
+    return ret;
+}
@@ -0,0 +1,71 @@
+#pragma once
+#ifndef ___JITTERBUFFER_HPP___
+#define ___JITTERBUFFER_HPP___
+
+// 順番も間隔もばらばらに届くブロックを、連番どおり一定間隔で取り出すためのバッファ  // thread safe
+//
+// 到着間隔の揺らぎ(RFC 3550のjitter)を測って、溜めておくブロック数を決める
+// 溜まりすぎたら古いものを捨てて遅延を詰め、抜けた番号はLossConcealerで埋める
+// 埋め方も、飛ばしたところの継ぎ目の混ぜ方もLossConcealerと同じ
+
+#include "wavepool.hpp"
+#include "lossconcealer.hpp"
+#include <boost/thread.hpp>
+#include <chrono>
+#include <cstdint>
+#include <map>
+
+class JitterBuffer
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    enum {
+        MIN_DEPTH = 1,
+        MAX_DEPTH = 20,
+        // 何も来ないまま埋め続けたら溜め直す
+        REBUFFER_COUNT = 10,
+    };
+
+    struct Stats
+    {
+        std::uint64_t received, late, lost, concealed, skipped;
+        int depth, targetDepth;
+        double jitterUS;
+    };
+
+private:
+    mutable boost::mutex mtx_;
+    std::map<std::uint32_t, PCMWavePtr> blocks_;
+    const double periodUS_;
+
+    bool isPlaying_;
+    std::uint32_t nextSeq_;
+    // 続けて埋めた回数。埋めた中身はconcealer_が作る
+    int concealCount_;
+    LossConcealer concealer_;
+
+    bool hasTransit_;
+    double lastTransitUS_, jitterUS_;
+    Clock::time_point origin_;
+    int targetDepth_;
+
+    std::uint64_t received_, late_, lost_, concealed_, skipped_;
+
+private:
+    static bool isBefore(std::uint32_t lhs, std::uint32_t rhs) { return static_cast<std::int32_t>(lhs - rhs) < 0; }
+    void updateJitter(std::uint32_t seq, Clock::time_point arrival);
+
+public:
+    // periodは1ブロックの長さ
+    JitterBuffer(std::chrono::microseconds period);
+
+    void reset();
+    void push(std::uint32_t seq, PCMWavePtr wave, Clock::time_point arrival = Clock::now());
+    // 一周期ごとに呼ぶ。溜まるまでや、埋められないときは無音を返す
+    PCMWavePtr pop();
+
+    Stats getStats() const;
+};
+
+#endif
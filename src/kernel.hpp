@@ -0,0 +1,259 @@
+#pragma once
+#ifndef ___KERNEL_HPP___
+#define ___KERNEL_HPP___
+
+// PCMWaveの中身をまとめて処理するための関数群
+// よく使うバッファサイズではループ長をコンパイル時定数にした版が使われるので
+// 小さいブロックでも端数処理なしでベクトル化される(src/を-O3でビルドしたとき)
+
+#include "pcmwave.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace kernel {
+
+// N == 0 のときは実行時のsizeを使う
+// ループ長が定数になるのはバスと同じステレオのときだけで、
+// それ以外のチャンネル数では size * channels 回の普通のループになる
+template<int N>
+struct Length
+{
+    static int get(int size) { return (N != 0 ? N : size) * PCMWave::CHANNEL_COUNT; }
+    static int get(int size, int channels)
+    {
+        return channels == PCMWave::CHANNEL_COUNT ? get(size) : size * channels;
+    }
+
+    template<class Func>
+    static void loop(int size, int channels, Func func)
+    {
+        if(channels == PCMWave::CHANNEL_COUNT){
+            const int n = get(size);
+            for(int i = 0;i < n;i++)    func(i);
+        }
+        else{
+            const int n = size * channels;
+            for(int i = 0;i < n;i++)    func(i);
+        }
+    }
+};
+
+template<int N>
+struct Scale
+{
+    static void run(int size, int channels, double *__restrict buf, double gain)
+    {
+        Length<N>::loop(size, channels, [=](int i) { buf[i] *= gain; });
+    }
+};
+
+template<int N>
+struct Gate
+{
+    static void run(int size, int channels, double *__restrict buf, double threshold)
+    {
+        Length<N>::loop(size, channels, [=](int i) {
+            buf[i] = (-threshold <= buf[i] && buf[i] <= threshold) ? 0 : buf[i];
+        });
+    }
+};
+
+// 以下はMixや形式の変換で使う、短い列に対する処理
+// 最適化の設定によらず同じ速さになるよう手で書いておく
+// x86-64なら必ずあるSSE2だけを使う。それより新しい命令はビルドの設定で有効にしていない
+namespace simd {
+
+// acc[i] = src[i] * gain
+inline void scaleTo(double *__restrict acc, const double *__restrict src, double gain, int n)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128d g = _mm_set1_pd(gain);
+    for(;i + 2 <= n;i += 2)
+        _mm_storeu_pd(acc + i, _mm_mul_pd(_mm_loadu_pd(src + i), g));
+#endif
+    for(;i < n;i++) acc[i] = src[i] * gain;
+}
+
+// acc[i] += src[i] * gain
+inline void addScaled(double *__restrict acc, const double *__restrict src, double gain, int n)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128d g = _mm_set1_pd(gain);
+    for(;i + 2 <= n;i += 2){
+        __m128d a = _mm_loadu_pd(acc + i);
+        a = _mm_add_pd(a, _mm_mul_pd(_mm_loadu_pd(src + i), g));
+        _mm_storeu_pd(acc + i, a);
+    }
+#endif
+    for(;i < n;i++) acc[i] += src[i] * gain;
+}
+
+// dst[i] = clamp(acc[i], -limit, limit)
+inline void clampTo(double *__restrict dst, const double *__restrict acc, double limit, int n)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128d hi = _mm_set1_pd(limit), lo = _mm_set1_pd(-limit);
+    for(;i + 2 <= n;i += 2)
+        _mm_storeu_pd(dst + i, _mm_max_pd(lo, _mm_min_pd(hi, _mm_loadu_pd(acc + i))));
+#endif
+    for(;i < n;i++) dst[i] = std::max(-limit, std::min(limit, acc[i]));
+}
+
+// 全てが[-limit, limit]に収まっていればtrue
+inline bool isWithin(const double *__restrict src, double limit, int n)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128d hi = _mm_set1_pd(limit), lo = _mm_set1_pd(-limit);
+    __m128d out = _mm_setzero_pd();
+    for(;i + 2 <= n;i += 2){
+        const __m128d v = _mm_loadu_pd(src + i);
+        out = _mm_or_pd(out, _mm_or_pd(_mm_cmpgt_pd(v, hi), _mm_cmplt_pd(v, lo)));
+    }
+    if(_mm_movemask_pd(out))    return false;
+#endif
+    for(;i < n;i++){
+        if(src[i] < -limit || limit < src[i])   return false;
+    }
+    return true;
+}
+
+// ネットワークに載せる形式との変換
+// 整数は[-1, 1]に収めてから最も近い値に丸める
+// int24以外のバイト順はホストのまま
+
+// dst[i] = round(clamp(src[i]) * 0x7FFF)
+inline void toInt16(std::int16_t *__restrict dst, const double *__restrict src, int n)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128d hi = _mm_set1_pd(1.0), lo = _mm_set1_pd(-1.0), scale = _mm_set1_pd(0x7FFF);
+    auto load = [&](int j) {
+        return _mm_cvtpd_epi32(_mm_mul_pd(_mm_max_pd(lo, _mm_min_pd(hi, _mm_loadu_pd(src + j))), scale));
+    };
+    for(;i + 8 <= n;i += 8){
+        const __m128i a = _mm_unpacklo_epi64(load(i), load(i + 2));
+        const __m128i b = _mm_unpacklo_epi64(load(i + 4), load(i + 6));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_packs_epi32(a, b));
+    }
+#endif
+    for(;i < n;i++) dst[i] = static_cast<std::int16_t>(std::lrint(std::max(-1.0, std::min(1.0, src[i])) * 0x7FFF));
+}
+
+// dst[i] = src[i] / 0x7FFF
+inline void fromInt16(double *__restrict dst, const std::int16_t *__restrict src, int n)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128d scale = _mm_set1_pd(1.0 / 0x7FFF);
+    for(;i + 4 <= n;i += 4){
+        // 符号を保ったまま32bitに広げる
+        __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(src + i));
+        v = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        _mm_storeu_pd(dst + i, _mm_mul_pd(_mm_cvtepi32_pd(v), scale));
+        _mm_storeu_pd(dst + i + 2, _mm_mul_pd(_mm_cvtepi32_pd(_mm_unpackhi_epi64(v, v)), scale));
+    }
+#endif
+    for(;i < n;i++) dst[i] = src[i] * (1.0 / 0x7FFF);
+}
+
+// 3バイトずつlittle endianで詰める。詰め替えがあるのでスカラーのまま
+inline void toInt24(char *__restrict dst, const double *__restrict src, int n)
+{
+    for(int i = 0;i < n;i++){
+        const std::int32_t v = std::lrint(std::max(-1.0, std::min(1.0, src[i])) * 0x7FFFFF);
+        dst[i * 3] = static_cast<char>(v);
+        dst[i * 3 + 1] = static_cast<char>(v >> 8);
+        dst[i * 3 + 2] = static_cast<char>(v >> 16);
+    }
+}
+
+inline void fromInt24(double *__restrict dst, const char *__restrict src, int n)
+{
+    const unsigned char *s = reinterpret_cast<const unsigned char *>(src);
+    for(int i = 0;i < n;i++){
+        // 上位バイトを符号付きで読んで広げる
+        const std::int32_t v = static_cast<std::int32_t>(
+            static_cast<std::uint32_t>(static_cast<std::int8_t>(s[i * 3 + 2])) << 16 |
+            s[i * 3 + 1] << 8 | s[i * 3]);
+        dst[i] = v * (1.0 / 0x7FFFFF);
+    }
+}
+
+inline void toFloat32(float *__restrict dst, const double *__restrict src, int n)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    for(;i + 4 <= n;i += 4)
+        _mm_storeu_ps(dst + i, _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(src + i)), _mm_cvtpd_ps(_mm_loadu_pd(src + i + 2))));
+#endif
+    for(;i < n;i++) dst[i] = static_cast<float>(src[i]);
+}
+
+inline void fromFloat32(double *__restrict dst, const float *__restrict src, int n)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    for(;i + 4 <= n;i += 4){
+        const __m128 v = _mm_loadu_ps(src + i);
+        _mm_storeu_pd(dst + i, _mm_cvtps_pd(v));
+        _mm_storeu_pd(dst + i + 2, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+    }
+#endif
+    for(;i < n;i++) dst[i] = src[i];
+}
+
+}   // namespace simd
+
+// count個の入力にそれぞれgainを掛けて足し合わせ、[-limit, limit]に収めてdstに書く
+// CHUNK個ずつL1に載る作業領域で全入力を足してから書き出すので、
+// 入力が何本あってもメモリを舐めるのは一回で済む
+// 作業領域を経由するので、dstはsrcs[0]と同じでもよい
+template<int N>
+struct Mix
+{
+    enum {
+        CHUNK = 512,    // 4KB
+    };
+
+    static void run(int size, int channels, double *dst,
+                    const double *const *srcs, const double *gains, int count, double limit)
+    {
+        const int n = Length<N>::get(size, channels);
+        double acc[CHUNK];
+        for(int begin = 0;begin < n;begin += CHUNK){
+            const int len = std::min<int>(CHUNK, n - begin);
+            simd::scaleTo(acc, srcs[0] + begin, gains[0], len);
+            for(int k = 1;k < count;k++)
+                simd::addScaled(acc, srcs[k] + begin, gains[k], len);
+            simd::clampTo(dst + begin, acc, limit, len);
+        }
+    }
+};
+
+}   // namespace kernel
+
+template<template<int> class Kernel, class... Args>
+void dispatchBufferSize(int size, Args&&... args)
+{
+    switch(size)
+    {
+    case   64:  Kernel<  64>::run(size, std::forward<Args>(args)...);  break;
+    case  128:  Kernel< 128>::run(size, std::forward<Args>(args)...);  break;
+    case  256:  Kernel< 256>::run(size, std::forward<Args>(args)...);  break;
+    case  512:  Kernel< 512>::run(size, std::forward<Args>(args)...);  break;
+    case 4410:  Kernel<4410>::run(size, std::forward<Args>(args)...);  break;   // 100ms @ 44.1kHz
+    case 4800:  Kernel<4800>::run(size, std::forward<Args>(args)...);  break;   // 100ms @ 48kHz
+    default:    Kernel<   0>::run(size, std::forward<Args>(args)...);  break;
+    }
+}
+
+#endif
@@ -0,0 +1,188 @@
+#include "lossconcealer.hpp"
+#include "helper.hpp"
+#include <algorithm>
+#include <cmath>
+
+TransitMeter::TransitMeter()
+{
+    reset();
+}
+
+void TransitMeter::reset()
+{
+    SCOPED_LOCK(mtx_);
+    count_ = 0;
+    lastTransitUS_ = latencyUS_ = minLatencyUS_ = maxLatencyUS_ = jitterUS_ = 0;
+}
+
+void TransitMeter::record(std::int64_t captureTime, std::int64_t arrivalTime)
+{
+    if(captureTime == 0)    return;
+    SCOPED_LOCK(mtx_);
+    const double transitUS = static_cast<double>(arrivalTime - captureTime);
+    if(count_ == 0){
+        latencyUS_ = minLatencyUS_ = maxLatencyUS_ = transitUS;
+    }
+    else{
+        jitterUS_ += (std::fabs(transitUS - lastTransitUS_) - jitterUS_) / 16;
+        latencyUS_ += (transitUS - latencyUS_) / 16;
+        minLatencyUS_ = std::min(minLatencyUS_, transitUS);
+        maxLatencyUS_ = std::max(maxLatencyUS_, transitUS);
+    }
+    lastTransitUS_ = transitUS;
+    count_++;
+}
+
+TransitMeter::Stats TransitMeter::getStats() const
+{
+    SCOPED_LOCK(mtx_);
+    Stats ret;
+    ret.count = count_;
+    ret.latencyUS = latencyUS_;
+    ret.minLatencyUS = minLatencyUS_;
+    ret.maxLatencyUS = maxLatencyUS_;
+    ret.jitterUS = jitterUS_;
+    return ret;
+}
+
+///
+
+constexpr double LossConcealer::FADE_TIME;
+
+LossConcealer::LossConcealer()
+{
+    reset();
+}
+
+void LossConcealer::reset()
+{
+    SCOPED_LOCK(mtx_);
+    hasSeq_ = false;
+    nextSeq_ = 0;
+    lastWave_.reset();
+    concealCount_ = 0;
+    lastFrame_.clear();
+    isSpliced_ = false;
+    received_ = lost_ = reordered_ = concealed_ = restarted_ = 0;
+}
+
+PCMWavePtr LossConcealer::conceal()
+{
+    concealed_++;
+    concealCount_++;
+    // 前のブロックの頭とは続いていない
+    isSpliced_ = true;
+    if(!lastWave_ || concealCount_ > MAX_CONCEAL_COUNT)
+        return PCMWavePool::getInstance().allocateZero(lastWave_ ? lastWave_->channels() : PCMWave::CHANNEL_COUNT);
+
+    // 回を追うごとに、ブロックの中でなめらかに小さくしていく
+    PCMWavePtr ret = lastWave_;
+    auto& wave = ret.mutate();
+    const double from = 1 - static_cast<double>(concealCount_ - 1) / MAX_CONCEAL_COUNT;
+    const double to = 1 - static_cast<double>(concealCount_) / MAX_CONCEAL_COUNT;
+    const size_t n = wave.size();
+    const int channels = wave.channels();
+    double *d = wave.raw();
+    for(size_t i = 0;i < n;i++){
+        const double gain = from + (to - from) * (i + 1) / n;
+        for(int ch = 0;ch < channels;ch++)  d[i * channels + ch] *= gain;
+    }
+    wave.setCaptureTime(0);
+    return ret;
+}
+
+void LossConcealer::emit(PCMWavePtr wave, std::vector<PCMWavePtr>& out)
+{
+    if(wave->size() == 0)   return;
+    splice(wave);
+    out.push_back(std::move(wave));
+}
+
+void LossConcealer::splice(PCMWavePtr& wave)
+{
+    const int channels = wave->channels();
+    const size_t n = wave->size();
+
+    // 最後に出したフレームの値から、頭を短く混ぜて繋ぐ
+    if(isSpliced_ && lastFrame_.size() == static_cast<size_t>(channels)){
+        auto& dst = wave.mutate();
+        double *d = dst.raw();
+        const size_t fade = std::min<size_t>(n, static_cast<size_t>(FADE_TIME * PCMWave::sampleRate()));
+        for(size_t i = 0;i < fade;i++){
+            const double w = static_cast<double>(i + 1) / (fade + 1);
+            for(int ch = 0;ch < channels;ch++)
+                d[i * channels + ch] = lastFrame_[ch] * (1 - w) + d[i * channels + ch] * w;
+        }
+    }
+    isSpliced_ = false;
+
+    const double *last = wave->raw() + (n - 1) * channels;
+    lastFrame_.assign(last, last + channels);
+}
+
+void LossConcealer::push(std::uint32_t seq, const PCMWavePtr& wave, int room, std::vector<PCMWavePtr>& out)
+{
+    SCOPED_LOCK(mtx_);
+    received_++;
+    if(hasSeq_){
+        const std::int32_t gap = static_cast<std::int32_t>(seq - nextSeq_);
+        if(gap < 0 && -gap <= MAX_GAP){
+            reordered_++;
+            return;
+        }
+        if(0 < gap && gap <= MAX_GAP){
+            lost_ += gap;
+            const int count = std::min<int>(gap, std::max(0, room));
+            for(int i = 0;i < count;i++)    emit(conceal(), out);
+            if(count < gap) isSpliced_ = true;
+        }
+        else if(gap != 0){
+            restarted_++;
+            isSpliced_ = true;
+        }
+    }
+
+    // 埋めていた後は、届いたものへ混ぜて戻す
+    if(concealCount_ > 0)   isSpliced_ = true;
+    hasSeq_ = true;
+    nextSeq_ = seq + 1;
+    concealCount_ = 0;
+    lastWave_ = wave;
+    emit(wave, out);
+}
+
+PCMWavePtr LossConcealer::next(const PCMWavePtr& wave)
+{
+    SCOPED_LOCK(mtx_);
+    if(!wave){
+        PCMWavePtr ret = conceal();
+        splice(ret);
+        return ret;
+    }
+
+    received_++;
+    if(concealCount_ > 0)   isSpliced_ = true;
+    concealCount_ = 0;
+    lastWave_ = wave;
+    PCMWavePtr ret = wave;
+    if(ret->size() != 0)    splice(ret);
+    return ret;
+}
+
+void LossConcealer::markSplice()
+{
+    SCOPED_LOCK(mtx_);
+    isSpliced_ = true;
+}
+
+LossConcealer::Stats LossConcealer::getStats() const
+{
+    SCOPED_LOCK(mtx_);
+    Stats ret;
+    ret.received = received_;
+    ret.lost = lost_;
+    ret.reordered = reordered_;
+    ret.concealed = concealed_;
+    ret.restarted = restarted_;
+    return ret;
+}
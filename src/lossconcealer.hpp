@@ -0,0 +1,100 @@
+#pragma once
+#ifndef ___LOSSCONCEALER_HPP___
+#define ___LOSSCONCEALER_HPP___
+
+// 連番と録った時刻の付いたブロックの流れを受けるための部品
+
+#include "wavepool.hpp"
+#include <boost/thread.hpp>
+#include <cstdint>
+#include <vector>
+
+// 録った時刻と届いた時刻の差から、遅れとその揺らぎを測る  // thread safe
+//
+// 遅れは送り手と受け手の時計の差をそのまま含むので、時計を合わせていないホストの間では目安にしかならない
+// 揺らぎ(RFC 3550のjitter)は差の差なので、時計の差には左右されない
+class TransitMeter
+{
+public:
+    struct Stats
+    {
+        std::uint64_t count;
+        // latencyUSは均したもの
+        double latencyUS, minLatencyUS, maxLatencyUS, jitterUS;
+    };
+
+private:
+    mutable boost::mutex mtx_;
+    std::uint64_t count_;
+    double lastTransitUS_, latencyUS_, minLatencyUS_, maxLatencyUS_, jitterUS_;
+
+public:
+    TransitMeter();
+
+    void reset();
+    // 時刻はPCMWave::currentTime()の単位。captureTimeが0(分からない)なら数えない
+    void record(std::int64_t captureTime, std::int64_t arrivalTime = PCMWave::currentTime());
+
+    Stats getStats() const;
+};
+
+// 順に届くはずのブロックの連番を見て、抜けと入れ替わりを見つけながら流れを繋ぐ  // thread safe
+//
+// 抜けは、遅延を伸ばさない範囲で直前に届いたブロックを繰り返して埋める
+// 繰り返すたびに小さくして、MAX_CONCEAL_COUNT回で無音まで絞る
+// 埋めきれなかった分は詰めて、続いていない継ぎ目はどれも頭を短く混ぜて繋ぐ
+// 番号が戻ったもの(遅れて来たものや重なったもの)は、もうその時間を過ぎているので捨てる
+// 一周期ごとに取り出す側(JitterBuffer)は、連番を自分で数えてnext()で同じ埋め方と繋ぎ方を使う
+class LossConcealer
+{
+public:
+    enum {
+        MAX_CONCEAL_COUNT = 4,
+        // これより大きく飛んだり戻ったりしたら、送り手が数え直したとみなして埋めずに繋ぐ
+        MAX_GAP = 64,
+    };
+
+    struct Stats
+    {
+        std::uint64_t received, lost, reordered, concealed, restarted;
+    };
+
+private:
+    // 継ぎ目を混ぜる長さ(秒)
+    static constexpr double FADE_TIME = 0.005;
+
+private:
+    mutable boost::mutex mtx_;
+    bool hasSeq_;
+    std::uint32_t nextSeq_;
+    // 最後に届いたブロック。抜けを埋めるときに繰り返す
+    PCMWavePtr lastWave_;
+    int concealCount_;
+    // 最後に出したフレームと、次に出すものがそこから続いていないか
+    std::vector<double> lastFrame_;
+    bool isSpliced_;
+
+    std::uint64_t received_, lost_, reordered_, concealed_, restarted_;
+
+private:
+    PCMWavePtr conceal();
+    // 続いていなければ頭を混ぜ、最後に出したフレームを覚える
+    void splice(PCMWavePtr& wave);
+    void emit(PCMWavePtr wave, std::vector<PCMWavePtr>& out);
+
+public:
+    LossConcealer();
+
+    void reset();
+    // 届いたブロックを渡し、流すものをoutに積む
+    // roomは、遅延を伸ばさずに今差し込めるブロックの数
+    void push(std::uint32_t seq, const PCMWavePtr& wave, int room, std::vector<PCMWavePtr>& out);
+    // 連番を数えずに、次に流すものを一つ返す。waveがなければ埋めたものを返す
+    // 呼ぶ側がブロックを飛ばしたときは、その前にmarkSplice()を呼ぶ
+    PCMWavePtr next(const PCMWavePtr& wave);
+    void markSplice();
+
+    Stats getStats() const;
+};
+
+#endif
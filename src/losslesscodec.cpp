@@ -0,0 +1,361 @@
+#include "losslesscodec.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace {
+
+enum {
+    SAMPLE_BITS = 18,       // 差のチャンネルは17bitになるので余裕を見て
+    SAMPLE_LIMIT = 1 << (SAMPLE_BITS - 1),
+    TYPE_BITS = 3,
+    RICE_BITS = 5,
+    MAX_RICE_PARAM = 30,
+    PARTITION_SIZE = 256,
+    MAX_FIXED_ORDER = 4,
+};
+
+enum SubframeType {
+    SUBFRAME_CONSTANT = 0,
+    SUBFRAME_VERBATIM = 1,
+    SUBFRAME_FIXED = 2,     // + order
+};
+
+enum StereoMode {
+    STEREO_INDEPENDENT = 0,
+    STEREO_LEFT_SIDE = 1,
+    STEREO_RIGHT_SIDE = 2,
+    STEREO_MID_SIDE = 3,
+};
+
+const double SCALE = 0x7FFF;
+
+inline std::uint64_t mask(int n) { return n >= 64 ? ~0ull : (1ull << n) - 1; }
+
+inline std::uint32_t zigzag(std::int32_t v) { return (static_cast<std::uint32_t>(v) << 1) ^ static_cast<std::uint32_t>(v >> 31); }
+inline std::int32_t unzigzag(std::uint32_t u) { return static_cast<std::int32_t>(u >> 1) ^ -static_cast<std::int32_t>(u & 1); }
+
+// WaveInFileで読んだ-0x8000も戻せるように、int16の範囲で丸める
+inline std::int32_t quantize(double v)
+{
+    v = std::max(-0x8000 / SCALE, std::min(1.0, v));
+    return static_cast<std::int32_t>(std::floor(v * SCALE + 0.5));
+}
+
+class BitWriter
+{
+private:
+    std::vector<char>& out_;
+    std::uint64_t acc_;
+    int bits_;
+
+public:
+    BitWriter(std::vector<char>& out)
+        : out_(out), acc_(0), bits_(0)
+    {}
+
+    // n <= 32
+    void write(std::uint32_t value, int n)
+    {
+        acc_ = (acc_ << n) | (value & mask(n));
+        bits_ += n;
+        while(bits_ >= 8){
+            bits_ -= 8;
+            out_.push_back(static_cast<char>(acc_ >> bits_));
+        }
+    }
+
+    void writeUnary(std::uint32_t q)
+    {
+        for(;q >= 31;q -= 31)   write(0, 31);
+        write(1, q + 1);
+    }
+
+    void flush()
+    {
+        if(bits_ > 0)   write(0, 8 - bits_);
+    }
+};
+
+class BitReader
+{
+private:
+    const unsigned char *p_, *end_;
+    std::uint64_t acc_;
+    int bits_;
+    bool isValid_;
+
+private:
+    void fill()
+    {
+        while(bits_ <= 56 && p_ != end_){
+            acc_ = (acc_ << 8) | *p_++;
+            bits_ += 8;
+        }
+    }
+
+public:
+    BitReader(const char *src, size_t size)
+        : p_(reinterpret_cast<const unsigned char *>(src)), end_(p_ + size),
+          acc_(0), bits_(0), isValid_(true)
+    {}
+
+    bool isValid() const { return isValid_; }
+
+    std::uint32_t read(int n)
+    {
+        if(bits_ < n)   fill();
+        if(bits_ < n){
+            isValid_ = false;
+            return 0;
+        }
+        bits_ -= n;
+        return static_cast<std::uint32_t>((acc_ >> bits_) & mask(n));
+    }
+
+    std::int32_t readSigned(int n)
+    {
+        const std::uint32_t v = read(n);
+        return static_cast<std::int32_t>(v << (32 - n)) >> (32 - n);
+    }
+
+    std::uint32_t readUnary()
+    {
+        std::uint32_t q = 0;
+        for(;;){
+            if(bits_ == 0)  fill();
+            if(bits_ == 0 || q > (1u << 24)){
+                isValid_ = false;
+                return 0;
+            }
+            const std::uint64_t window = acc_ & mask(bits_);
+            if(window == 0){
+                q += bits_;
+                bits_ = 0;
+                continue;
+            }
+            const int msb = 63 - __builtin_clzll(window);
+            q += bits_ - 1 - msb;
+            bits_ = msb;
+            return q;
+        }
+    }
+};
+
+// 固定の予測子の残差
+inline std::int32_t fixedResidual(const std::int32_t *x, int i, int order)
+{
+    switch(order)
+    {
+    case 0: return x[i];
+    case 1: return x[i] - x[i - 1];
+    case 2: return x[i] - 2 * x[i - 1] + x[i - 2];
+    case 3: return x[i] - 3 * x[i - 1] + 3 * x[i - 2] - x[i - 3];
+    default:return x[i] - 4 * x[i - 1] + 6 * x[i - 2] - 4 * x[i - 3] + x[i - 4];
+    }
+}
+
+inline std::int32_t fixedPredict(const std::int32_t *x, int i, int order)
+{
+    switch(order)
+    {
+    case 0: return 0;
+    case 1: return x[i - 1];
+    case 2: return 2 * x[i - 1] - x[i - 2];
+    case 3: return 3 * x[i - 1] - 3 * x[i - 2] + x[i - 3];
+    default:return 4 * x[i - 1] - 6 * x[i - 2] + 4 * x[i - 3] - x[i - 4];
+    }
+}
+
+// 各次数の残差の絶対値の和を一度に求める
+int chooseFixedOrder(const std::int32_t *x, int n)
+{
+    std::uint64_t sums[MAX_FIXED_ORDER + 1] = {0};
+    for(int i = MAX_FIXED_ORDER;i < n;i++){
+        const std::int64_t e0 = x[i];
+        const std::int64_t e1 = e0 - x[i - 1];
+        const std::int64_t e2 = e1 - (x[i - 1] - x[i - 2]);
+        const std::int64_t e3 = e2 - (x[i - 1] - 2 * x[i - 2] + x[i - 3]);
+        const std::int64_t e4 = e3 - (x[i - 1] - 3 * x[i - 2] + 3 * x[i - 3] - x[i - 4]);
+        sums[0] += std::abs(e0);
+        sums[1] += std::abs(e1);
+        sums[2] += std::abs(e2);
+        sums[3] += std::abs(e3);
+        sums[4] += std::abs(e4);
+    }
+    return std::min_element(sums, sums + MAX_FIXED_ORDER + 1) - sums;
+}
+
+int chooseRiceParam(const std::uint32_t *u, int n)
+{
+    std::uint64_t sum = 0;
+    for(int i = 0;i < n;i++)    sum += u[i];
+    int estimate = 0;
+    while(estimate < MAX_RICE_PARAM && (static_cast<std::uint64_t>(n) << (estimate + 1)) < sum)  estimate++;
+
+    // 前後も実際に数えて比べる
+    int best = estimate;
+    std::uint64_t bestCost = ~0ull;
+    for(int k = std::max(0, estimate - 1);k <= std::min<int>(MAX_RICE_PARAM, estimate + 1);k++){
+        std::uint64_t cost = static_cast<std::uint64_t>(n) * (k + 1);
+        for(int i = 0;i < n;i++)    cost += u[i] >> k;
+        if(cost < bestCost){
+            bestCost = cost;
+            best = k;
+        }
+    }
+    return best;
+}
+
+void encodeSubframe(BitWriter& w, const std::int32_t *x, int n)
+{
+    if(std::all_of(x, x + n, [x](std::int32_t v) { return v == x[0]; })){
+        w.write(SUBFRAME_CONSTANT, TYPE_BITS);
+        w.write(n > 0 ? x[0] : 0, SAMPLE_BITS);
+        return;
+    }
+    if(n <= MAX_FIXED_ORDER){
+        w.write(SUBFRAME_VERBATIM, TYPE_BITS);
+        for(int i = 0;i < n;i++)    w.write(x[i], SAMPLE_BITS);
+        return;
+    }
+
+    const int order = chooseFixedOrder(x, n);
+    w.write(SUBFRAME_FIXED + order, TYPE_BITS);
+    for(int i = 0;i < order;i++)    w.write(x[i], SAMPLE_BITS);
+
+    std::uint32_t u[PARTITION_SIZE];
+    for(int begin = order;begin < n;begin += PARTITION_SIZE){
+        const int len = std::min<int>(PARTITION_SIZE, n - begin);
+        for(int i = 0;i < len;i++)  u[i] = zigzag(fixedResidual(x, begin + i, order));
+        const int k = chooseRiceParam(u, len);
+        w.write(k, RICE_BITS);
+        for(int i = 0;i < len;i++){
+            w.writeUnary(u[i] >> k);
+            if(k > 0)   w.write(u[i], k);
+        }
+    }
+}
+
+bool decodeSubframe(BitReader& r, std::int32_t *x, int n)
+{
+    const int type = r.read(TYPE_BITS);
+    if(type == SUBFRAME_CONSTANT){
+        std::fill(x, x + n, r.readSigned(SAMPLE_BITS));
+        return r.isValid();
+    }
+    if(type == SUBFRAME_VERBATIM){
+        for(int i = 0;i < n;i++)    x[i] = r.readSigned(SAMPLE_BITS);
+        return r.isValid();
+    }
+
+    const int order = type - SUBFRAME_FIXED;
+    if(order < 0 || MAX_FIXED_ORDER < order || n < order)   return false;
+    for(int i = 0;i < order;i++)    x[i] = r.readSigned(SAMPLE_BITS);
+    for(int begin = order;begin < n;begin += PARTITION_SIZE){
+        const int len = std::min<int>(PARTITION_SIZE, n - begin);
+        const int k = r.read(RICE_BITS);
+        for(int i = begin;i < begin + len;i++){
+            std::uint32_t u = r.readUnary() << k;
+            if(k > 0)   u |= r.read(k);
+            // 壊れた符号で値が膨らみ続けないように、書ける範囲を外れたら諦める
+            const std::int64_t v = static_cast<std::int64_t>(fixedPredict(x, i, order)) + unzigzag(u);
+            if(v < -SAMPLE_LIMIT || SAMPLE_LIMIT <= v)  return false;
+            x[i] = static_cast<std::int32_t>(v);
+        }
+        if(!r.isValid())    return false;
+    }
+    return r.isValid();
+}
+
+// 一次の差分の絶対値の和で、ステレオの変換の安さを見積もる
+int chooseStereoMode(const std::int32_t *left, const std::int32_t *right, int n)
+{
+    std::uint64_t l = 0, r = 0, m = 0, s = 0;
+    for(int i = 1;i < n;i++){
+        const std::int64_t dl = left[i] - left[i - 1], dr = right[i] - right[i - 1];
+        l += std::abs(dl);
+        r += std::abs(dr);
+        m += std::abs((dl + dr) / 2);
+        s += std::abs(dl - dr);
+    }
+    const std::uint64_t costs[] = {l + r, l + s, r + s, m + s};
+    return std::min_element(costs, costs + 4) - costs;
+}
+
+// 作業領域はスレッドごとに使い回す
+thread_local std::vector<std::int32_t> channelBuffer;
+
+}   // namespace
+
+void LosslessCodec::encode(const PCMWave& src, std::vector<char>& dst)
+{
+    const int n = src.size(), channels = src.channels();
+    auto& buf = channelBuffer;
+    buf.resize(static_cast<size_t>(n) * channels);
+
+    // チャンネルごとに並べ替えながら量子化する
+    const double *raw = src.raw();
+    for(int ch = 0;ch < channels;ch++){
+        std::int32_t *x = buf.data() + static_cast<size_t>(ch) * n;
+        for(int i = 0;i < n;i++)    x[i] = quantize(raw[i * channels + ch]);
+    }
+
+    BitWriter w(dst);
+    int mode = STEREO_INDEPENDENT;
+    if(channels == 2){
+        std::int32_t *left = buf.data(), *right = buf.data() + n;
+        mode = chooseStereoMode(left, right, n);
+        for(int i = 0;i < n;i++){
+            const std::int32_t l = left[i], r = right[i];
+            switch(mode)
+            {
+            case STEREO_LEFT_SIDE:  right[i] = l - r;   break;
+            case STEREO_RIGHT_SIDE: left[i] = l - r;    break;
+            case STEREO_MID_SIDE:   left[i] = (l + r) >> 1; right[i] = l - r;   break;
+            }
+        }
+    }
+    w.write(mode, 2);
+    for(int ch = 0;ch < channels;ch++)
+        encodeSubframe(w, buf.data() + static_cast<size_t>(ch) * n, n);
+    w.flush();
+}
+
+bool LosslessCodec::decode(const char *src, size_t size, PCMWave& dst)
+{
+    const int n = dst.size(), channels = dst.channels();
+    auto& buf = channelBuffer;
+    buf.resize(static_cast<size_t>(n) * channels);
+
+    BitReader r(src, size);
+    const int mode = r.read(2);
+    if(mode != STEREO_INDEPENDENT && channels != 2) return false;
+    for(int ch = 0;ch < channels;ch++)
+        if(!decodeSubframe(r, buf.data() + static_cast<size_t>(ch) * n, n))  return false;
+
+    if(channels == 2){
+        std::int32_t *left = buf.data(), *right = buf.data() + n;
+        for(int i = 0;i < n;i++){
+            const std::int32_t a = left[i], b = right[i];
+            switch(mode)
+            {
+            case STEREO_LEFT_SIDE:  right[i] = a - b;   break;
+            case STEREO_RIGHT_SIDE: left[i] = a + b;    break;
+            case STEREO_MID_SIDE:{
+                const std::int32_t mid = a * 2 + (b & 1);
+                left[i] = (mid + b) >> 1;
+                right[i] = (mid - b) >> 1;
+                break;
+            }
+            }
+        }
+    }
+
+    double *raw = dst.raw();
+    for(int ch = 0;ch < channels;ch++){
+        const std::int32_t *x = buf.data() + static_cast<size_t>(ch) * n;
+        for(int i = 0;i < n;i++)    raw[i * channels + ch] = x[i] / SCALE;
+    }
+    return true;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#ifndef ___LOSSLESSCODEC_HPP___
+#define ___LOSSLESSCODEC_HPP___
+
+// FLACに倣ったブロック単位の可逆圧縮
+//
+// 16bitに量子化した上で
+//   ステレオなら左右/左と差/右と差/和と差のうち安く済むものに変換し
+//   チャンネルごとに固定の予測子(0次から4次)で一番小さい残差を選び
+//   残差を256サンプルごとに最適なパラメータのRice符号で書く
+// WaveOutFileと同じ量子化なので、16bitの音源に対しては可逆
+
+#include "pcmwave.hpp"
+#include <vector>
+
+class LosslessCodec
+{
+public:
+    // dstの後ろに書き足す
+    static void encode(const PCMWave& src, std::vector<char>& dst);
+    // dstはチャンネル数とフレーム数を合わせておくこと
+    // 壊れていたらfalse
+    static bool decode(const char *src, size_t size, PCMWave& dst);
+};
+
+#endif
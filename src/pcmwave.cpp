@@ -0,0 +1,13 @@
+#include "pcmwave.hpp"
+#include "error.hpp"
+
+int PCMWave::sampleRate_ = PCMWave::DEFAULT_SAMPLE_RATE;
+int PCMWave::bufferSize_ = PCMWave::DEFAULT_BUFFER_SIZE;
+
+void PCMWave::setFormat(int sampleRate, int bufferSize)
+{
+    ZARU_THROW_UNLESS(8000 <= sampleRate && sampleRate <= 192000);
+    ZARU_THROW_UNLESS(16 <= bufferSize && bufferSize <= sampleRate);
+    sampleRate_ = sampleRate;
+    bufferSize_ = bufferSize;
+}
@@ -2,19 +2,23 @@
 #ifndef ___PCMWAVE_HPP___
 #define ___PCMWAVE_HPP___
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
-#include <array>
+#include <stdexcept>
+#include <vector>
 
 class PCMWave
 {
 public:
     static const int
-        SAMPLE_RATE = 44100,
-        BUFFER_SIZE = SAMPLE_RATE * 0.1,
+        DEFAULT_SAMPLE_RATE = 44100,
+        DEFAULT_BUFFER_SIZE = DEFAULT_SAMPLE_RATE / 10,   // 100ms
         CHANNEL_COUNT = 2,
+        MAX_CHANNEL_COUNT = 32,
         BIT_COUNT = 16,
-        BYTE_PER_SEC = SAMPLE_RATE * CHANNEL_COUNT * BIT_COUNT / 8,
-        BLOCK_SIZE = BIT_COUNT / 8 * CHANNEL_COUNT;
+        BLOCK_SIZE = BIT_COUNT / 8 * CHANNEL_COUNT;   // ステレオのとき
 
     struct Sample
     {
@@ -83,27 +87,86 @@ public:
     };
 
 private:
-    using Buffer = std::array<Sample, BUFFER_SIZE>;
-    Buffer buffer_;
+    // 全チャンネルのサンプルをフレーム順に並べたもの
+    // (ch0, ch1, ..., chN-1), (ch0, ch1, ...), ...
+    // Unitの間を流れる形はこれ一つだけにしている。チャンネルごとのfloat列(planar)は
+    // Mixや符号化、共有メモリの枠まで二通りの形を持つことになるので入れない
+    // 要素ごとの処理はkernel.hppの定数長ループがこの並びのままベクトル化する
+    std::vector<double> buffer_;
+    int channels_;
+    // 録った時刻。分からなければ0
+    std::int64_t captureTime_;
+
+    static int sampleRate_, bufferSize_;
 
 public:
-    PCMWave(){}
-    PCMWave(int) { buffer_.fill(Sample(0, 0)); }
+    // サンプリングレートとバッファのフレーム数はセッション全体で共通
+    // Unitを作る前に一度だけ設定すること
+    static void setFormat(int sampleRate, int bufferSize);
+    static int sampleRate() { return sampleRate_; }
+    static int bufferSize() { return bufferSize_; }
+    static int blockSize(int channels = CHANNEL_COUNT) { return BIT_COUNT / 8 * channels; }
+    static int bytePerSec(int channels = CHANNEL_COUNT) { return sampleRate_ * blockSize(channels); }
+    // captureTimeに使う時刻。system_clockのエポックからのマイクロ秒
+    // 別のホストの時刻と比べるときは、時計が合っている(NTPなど)ことを前提にする
+    static std::int64_t currentTime()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    // 無音で初期化される
+    // チャンネル数はブロックごとに持つ。ミキサーのバスはCHANNEL_COUNT(ステレオ)
+    explicit PCMWave(int channels = CHANNEL_COUNT)
+        : buffer_(static_cast<size_t>(bufferSize_) * channels), channels_(channels), captureTime_(0)
+    {}
     ~PCMWave(){}
 
-    Buffer& get() { return buffer_; }
-    const Buffer& get() const { return buffer_; }
+    int channels() const { return channels_; }
+    // フレーム数
+    size_t size() const { return buffer_.size() / channels_; }
+    void resize(size_t size) { buffer_.resize(size * channels_); }
+    // 中身は不定になる
+    void reshape(size_t size, int channels)
+    {
+        channels_ = channels;
+        buffer_.resize(size * channels);
+    }
+
+    // 全チャンネルを交互に並べたdoubleの列として見る
+    double *raw() { return buffer_.data(); }
+    const double *raw() const { return buffer_.data(); }
+    double& at(size_t index, int ch) { return buffer_.at(index * channels_ + ch); }
+    double at(size_t index, int ch) const { return buffer_.at(index * channels_ + ch); }
 
-    Sample& at(size_t index) { return buffer_.at(index); }
-    const Sample& at(size_t index) const { return buffer_.at(index); }
+    void fill(double value) { std::fill(buffer_.begin(), buffer_.end(), value); }
 
-    void fill(const Sample& value) { buffer_.fill(value); }
+    // 中身を作り直しても引き継がれないので、新しいブロックに書いたときは元のものを移すこと
+    std::int64_t captureTime() const { return captureTime_; }
+    void setCaptureTime(std::int64_t time) { captureTime_ = time; }
 
-    Buffer::iterator begin() { return buffer_.begin(); }
-    Buffer::const_iterator begin() const { return buffer_.cbegin(); }
-    Buffer::iterator end() { return buffer_.end(); }
-    Buffer::const_iterator end() const { return buffer_.cend(); }
+    // 以下はステレオのブロックをSampleの列として見るためのもの
+    bool isStereo() const { return channels_ == CHANNEL_COUNT; }
+    Sample& at(size_t index) { return begin()[stereoIndex(index)]; }
+    const Sample& at(size_t index) const { return begin()[stereoIndex(index)]; }
+    void fill(const Sample& value) { std::fill(begin(), end(), value); }
+
+    Sample *begin() { return reinterpret_cast<Sample *>(buffer_.data()); }
+    const Sample *begin() const { return reinterpret_cast<const Sample *>(buffer_.data()); }
+    Sample *end() { return begin() + stereoSize(); }
+    const Sample *end() const { return begin() + stereoSize(); }
+
+private:
+    size_t stereoSize() const { return isStereo() ? size() : 0; }
+    size_t stereoIndex(size_t index) const
+    {
+        if(index >= stereoSize())   throw std::out_of_range("PCMWave::at");
+        return index;
+    }
 };
+static_assert(sizeof(PCMWave::Sample) == sizeof(double) * PCMWave::CHANNEL_COUNT,
+    "PCMWave::Sample must be packed to be seen as raw()");
 
 
 #endif
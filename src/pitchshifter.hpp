@@ -23,20 +23,20 @@ private:
 public:
     PitchShifter(const Config& config)
         : rate_(1 / config.pitch), pitch_(config.pitch),
-          templateSize_(config.templateMS * PCMWave::SAMPLE_RATE),
-          pmin_(config.pminMS * PCMWave::SAMPLE_RATE),
-          pmax_(config.pmaxMS * PCMWave::SAMPLE_RATE)
+          templateSize_(config.templateMS * PCMWave::sampleRate()),
+          pmin_(config.pminMS * PCMWave::sampleRate()),
+          pmax_(config.pmaxMS * PCMWave::sampleRate())
     {}
 
     PCMWave proc(const PCMWave& nextWave)
     {
         auto& wave = prevWave_;
         std::vector<PCMWave::Sample> ffedWave(
-            PCMWave::BUFFER_SIZE * pitch_ + 1,  // size / rate + 1
+            PCMWave::bufferSize() * pitch_ + 1,  // size / rate + 1
             PCMWave::Sample(0, 0));
         {
             int offset0 = 0, offset1 = 0;
-            while(offset0 + pmax_ * 2 < PCMWave::BUFFER_SIZE){
+            while(offset0 + pmax_ * 2 < PCMWave::bufferSize()){
                 std::vector<PCMWave::Sample> x(wave.begin() + offset0,
                                                wave.begin() + offset0 + templateSize_);
                 double maxR = 0;
@@ -58,7 +58,7 @@ public:
 
                 int q = p / (rate_ - 1.0) + 0.5;
                 for(int i = p;i < q;i++){
-                    if(offset0 + p + i >= PCMWave::BUFFER_SIZE) break;
+                    if(offset0 + p + i >= PCMWave::bufferSize()) break;
                     ffedWave.at(offset1 + i) = wave.at(offset0 + p + i);
                 }
                 /*
@@ -66,8 +66,8 @@ public:
                     int si = offset0 + p + i, di = offset1 + i;
                     if(di >= ffedWave.size())   break;
                     ffedWave.at(di) =
-                        si < PCMWave::BUFFER_SIZE ? wave.at(si)
-                                                  //: nextWave.at(si - PCMWave::BUFFER_SIZE);
+                        si < PCMWave::bufferSize() ? wave.at(si)
+                                                  //: nextWave.at(si - PCMWave::bufferSize());
                                                   : PCMWave::Sample(0, 0);
                 }
                 */
@@ -80,9 +80,9 @@ public:
                 ffedWave.at(i) = wave.at(i - offset1 + offset0);
         }
 
-        PCMWave res(0);
+        PCMWave res;
         const int J = 24;
-        for(int i = 0;i < PCMWave::BUFFER_SIZE;i++){
+        for(int i = 0;i < PCMWave::bufferSize();i++){
             double t = pitch_ * i;
             int offset = t, j = offset - J / 2;
             for(int j = std::max(0, offset - J / 2);j <= std::min<int>(ffedWave.size() - 1, offset + J / 2);j++){
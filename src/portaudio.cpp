@@ -3,23 +3,37 @@
 #include "error.hpp"
 #include <algorithm>
 
-std::array<float, PCMWave::BUFFER_SIZE * 2> wave2float(const PCMWave& src)
+void wave2float(const PCMWave& src, size_t begin, size_t frames, float *dst)
 {
-    std::array<float, PCMWave::BUFFER_SIZE * 2> ret;
-    auto it = ret.begin();
-    for(auto& s : src){
-        *(it++) = s.left;
-        *(it++) = s.right;
+    const int channels = src.channels();
+    const double *s = src.raw() + begin * channels;
+    if(channels == PCMWave::CHANNEL_COUNT){
+        std::copy(s, s + frames * channels, dst);
+        return;
+    }
+    if(channels == 1){
+        for(size_t i = 0;i < frames;i++)    dst[i * 2] = dst[i * 2 + 1] = s[i];
+        return;
+    }
+    const double leftGain = 1.0 / ((channels + 1) / 2), rightGain = 1.0 / (channels / 2);
+    for(size_t i = 0;i < frames;i++){
+        double left = 0, right = 0;
+        for(int ch = 0;ch < channels;ch += 2)   left += s[i * channels + ch];
+        for(int ch = 1;ch < channels;ch += 2)   right += s[i * channels + ch];
+        dst[i * 2] = left * leftGain;
+        dst[i * 2 + 1] = right * rightGain;
     }
-    return std::move(ret);
 }
 
-PCMWave float2wave(const std::array<float, PCMWave::BUFFER_SIZE>& src)
+void float2wave(const float *src, PCMWave& dst)
 {
-    PCMWave ret;
-    std::transform(src.begin(), src.end(), ret.begin(),
+    std::transform(src, src + dst.size(), dst.begin(),
         [](float s) { return PCMWave::Sample(s, s); });
-    return std::move(ret);
+}
+
+void interleavedFloat2wave(const float *src, PCMWave& dst)
+{
+    std::copy(src, src + dst.size() * dst.channels(), dst.raw());
 }
 
 ///
@@ -34,8 +48,9 @@ PAAudioDevice::PAAudioDevice(PaDeviceIndex index)
 
 ///
 
-PAAudioStream::PAAudioStream(PaStream *stream)
-    : stream_(stream)
+PAAudioStream::PAAudioStream(PaStream *stream, int inputChannels)
+    : stream_(stream), inputChannels_(inputChannels),
+      buffer_(PCMWave::bufferSize() * std::max<int>(inputChannels, PCMWave::CHANNEL_COUNT))
 {}
 
 PAAudioStream::~PAAudioStream()
@@ -53,19 +68,31 @@ void PAAudioStream::stop()
     ZARU_THROW_UNLESS(Pa_StopStream(stream_) == paNoError);
 }
 
-PCMWave PAAudioStream::read()
+PCMWavePtr PAAudioStream::read()
 {
-    std::array<float, PCMWave::BUFFER_SIZE> buffer;
-    auto res = Pa_ReadStream(stream_, buffer.data(), PCMWave::BUFFER_SIZE);
+    auto res = Pa_ReadStream(stream_, buffer_.data(), PCMWave::bufferSize());
     ZARU_THROW_UNLESS(res == paNoError || res == paInputOverflowed);
-    PCMWave ret;
-    return std::move(float2wave(buffer));
+    if(inputChannels_ <= 1){
+        PCMWavePtr ret = PCMWavePool::getInstance().allocate();
+        float2wave(buffer_.data(), ret.mutate());
+        return ret;
+    }
+    PCMWavePtr ret = PCMWavePool::getInstance().allocate(inputChannels_);
+    interleavedFloat2wave(buffer_.data(), ret.mutate());
+    return ret;
 }
 
 void PAAudioStream::write(const PCMWave& wave)
 {
-    auto ret = Pa_WriteStream(stream_, wave2float(wave).data(), PCMWave::BUFFER_SIZE);
-    ZARU_THROW_UNLESS(ret == paNoError || ret == paOutputUnderflowed);
+    // 出力はステレオで開いているので、他のチャンネル数は混ぜて合わせる
+    // 長いブロックはbuffer_に収まる分ずつ書く
+    const size_t chunk = PCMWave::bufferSize();
+    for(size_t begin = 0;begin < wave.size();begin += chunk){
+        const size_t frames = std::min(chunk, wave.size() - begin);
+        wave2float(wave, begin, frames, buffer_.data());
+        auto ret = Pa_WriteStream(stream_, buffer_.data(), frames);
+        ZARU_THROW_UNLESS(ret == paNoError || ret == paOutputUnderflowed);
+    }
 }
 
 ///
@@ -99,13 +126,14 @@ std::vector<AudioDevicePtr> PAAudioSystem::getValidDevices()
     return ret;
 }
 
-std::unique_ptr<AudioStream> PAAudioSystem::createInputStream(const AudioDevicePtr& device)
+std::unique_ptr<AudioStream> PAAudioSystem::createInputStream(const AudioDevicePtr& device, int channels)
 {
     auto dev = dynamic_cast<PAAudioDevice *>(device.get());
+    ZARU_THROW_UNLESS(1 <= channels && channels <= std::min<int>(dev->inputChannel(), PCMWave::MAX_CHANNEL_COUNT));
 
     PaStreamParameters inputParam;
     inputParam.device = dev->getIndex();
-    inputParam.channelCount = 1;
+    inputParam.channelCount = channels;
     inputParam.sampleFormat = paFloat32;
     inputParam.suggestedLatency = dev->getInfo().defaultLowInputLatency;
     inputParam.hostApiSpecificStreamInfo = NULL;
@@ -115,14 +143,14 @@ std::unique_ptr<AudioStream> PAAudioSystem::createInputStream(const AudioDeviceP
         &stream,
         &inputParam,
         NULL,
-        PCMWave::SAMPLE_RATE,
-        PCMWave::BUFFER_SIZE * 2,
+        PCMWave::sampleRate(),
+        PCMWave::bufferSize() * 2,
         paClipOff,
         NULL,
         NULL
     ) == paNoError);
 
-    auto ret = make_unique<PAAudioStream>(stream);
+    auto ret = make_unique<PAAudioStream>(stream, channels);
     return std::move(ret);
 }
 
@@ -142,8 +170,8 @@ std::unique_ptr<AudioStream> PAAudioSystem::createOutputStream(const AudioDevice
         &stream,
         NULL,
         &outputParam,
-        PCMWave::SAMPLE_RATE,
-        //PCMWave::BUFFER_SIZE * 1,
+        PCMWave::sampleRate(),
+        //PCMWave::bufferSize() * 1,
         paFramesPerBufferUnspecified,
         paClipOff,
         NULL,
@@ -5,9 +5,16 @@
 #include "audio.hpp"
 #include <portaudio.h>
 #include <string>
+#include <vector>
 
-std::array<float, PCMWave::BUFFER_SIZE * 2> wave2float(const PCMWave& src);
-PCMWave float2wave(const std::array<float, PCMWave::BUFFER_SIZE>& src);
+// srcのbeginからframesフレームを、ステレオのインターリーブにしてdstに書く
+// モノラルは両方へ、3チャンネル以上は偶数番を左、奇数番を右へ均して混ぜる
+// dstはframes * 2の長さが必要
+void wave2float(const PCMWave& src, size_t begin, size_t frames, float *dst);
+// srcはモノラルで、dst.size()の長さが必要
+void float2wave(const float *src, PCMWave& dst);
+// srcはdst.channels()チャンネルのインターリーブで、dst.size() * dst.channels()の長さが必要
+void interleavedFloat2wave(const float *src, PCMWave& dst);
 
 class PAAudioDevice : public AudioDevice
 {
@@ -31,14 +38,16 @@ class PAAudioStream : public AudioStream
 {
 private:
     PaStream *stream_;
+    const int inputChannels_;
+    std::vector<float> buffer_;
 
 public:
-    PAAudioStream(PaStream *stream);
+    PAAudioStream(PaStream *stream, int inputChannels = 0);
     ~PAAudioStream();
 
     void start();
     void stop();
-    PCMWave read();
+    PCMWavePtr read();
     void write(const PCMWave& wave);
 };
 
@@ -55,7 +64,7 @@ public:
     AudioDevicePtr getDefaultOutputDevice();
     std::vector<AudioDevicePtr> getValidDevices();
     std::unique_ptr<AudioStream> createInputStream(
-        const AudioDevicePtr& device);
+        const AudioDevicePtr& device, int channels = 1);
     std::unique_ptr<AudioStream> createOutputStream(
         const AudioDevicePtr& device);
 };
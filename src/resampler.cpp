@@ -0,0 +1,119 @@
+#include "resampler.hpp"
+#include <algorithm>
+#include <cmath>
+
+const std::vector<double>& VariableResampler::table()
+{
+    // (PHASES + 1)行 x TAPS列
+    // 行pは、出力の位置が入力のフレームからp / PHASESだけ後ろにあるときの係数
+    static const std::vector<double> ret = []() {
+        const double PI = 3.14159265358979323846;
+        std::vector<double> t((PHASES + 1) * TAPS);
+        for(int p = 0;p <= PHASES;p++){
+            const double frac = static_cast<double>(p) / PHASES;
+            double sum = 0;
+            for(int k = 0;k < TAPS;k++){
+                const double x = k - (HALF_TAPS - 1) - frac;
+                const double sinc = x == 0 ? 1 : std::sin(PI * x) / (PI * x);
+                // Blackman窓
+                const double w = 0.42 + 0.5 * std::cos(PI * x / HALF_TAPS) + 0.08 * std::cos(2 * PI * x / HALF_TAPS);
+                t[p * TAPS + k] = sinc * w;
+                sum += t[p * TAPS + k];
+            }
+            // 直流の利得を1に揃える
+            for(int k = 0;k < TAPS;k++) t[p * TAPS + k] /= sum;
+        }
+        return t;
+    }();
+    return ret;
+}
+
+VariableResampler::VariableResampler()
+    : channels_(0), inputBegin_(0), pos_(0), outputBegin_(0), coef_(TAPS), endTime_(0)
+{}
+
+void VariableResampler::compact(std::vector<double>& buf, size_t& begin)
+{
+    // 残りより多く読み終えたときだけ詰めれば、動かす量は入れた量を超えない
+    if(begin == 0 || begin < buf.size() - begin)    return;
+    buf.erase(buf.begin(), buf.begin() + begin);
+    begin = 0;
+}
+
+void VariableResampler::reset()
+{
+    channels_ = 0;
+    input_.clear();
+    output_.clear();
+    inputBegin_ = outputBegin_ = 0;
+    pos_ = 0;
+    endTime_ = 0;
+}
+
+void VariableResampler::push(const PCMWave& wave, double ratio)
+{
+    if(wave.channels() != channels_){
+        reset();
+        channels_ = wave.channels();
+    }
+    if(input_.empty()){
+        // 最初の出力の前に窓の半分が要るので、無音で埋めておく
+        // 先読みの分だけ出力も無音で埋めて、最初のブロックから丸ごと取り出せるようにする
+        input_.assign((HALF_TAPS - 1) * channels_, 0);
+        output_.assign(HALF_TAPS * channels_, 0);
+        pos_ = HALF_TAPS - 1;
+    }
+    compact(input_, inputBegin_);
+    compact(output_, outputBegin_);
+    input_.insert(input_.end(), wave.raw(), wave.raw() + wave.size() * channels_);
+
+    endTime_ = wave.captureTime() == 0 ? 0
+        : wave.captureTime() + static_cast<std::int64_t>(wave.size()) * 1000000 / PCMWave::sampleRate();
+
+    const std::vector<double>& t = table();
+    const size_t frames = inputFrames();
+    for(;;){
+        const size_t index = static_cast<size_t>(pos_);
+        if(index + HALF_TAPS >= frames) break;
+
+        const double phase = (pos_ - index) * PHASES;
+        const int p = std::min<int>(static_cast<int>(phase), PHASES - 1);
+        const double a = phase - p;
+        const double *row0 = &t[p * TAPS], *row1 = row0 + TAPS;
+        for(int k = 0;k < TAPS;k++) coef_[k] = row0[k] + (row1[k] - row0[k]) * a;
+
+        const double *src = input_.data() + inputBegin_ + (index - (HALF_TAPS - 1)) * channels_;
+        for(int ch = 0;ch < channels_;ch++){
+            double acc = 0;
+            for(int k = 0;k < TAPS;k++) acc += coef_[k] * src[k * channels_ + ch];
+            output_.push_back(acc);
+        }
+        pos_ += ratio;
+    }
+
+    // もう窓に掛からない入力を捨てる
+    const size_t used = std::min<size_t>(frames, static_cast<size_t>(pos_) - (HALF_TAPS - 1));
+    inputBegin_ += used * channels_;
+    pos_ -= used;
+}
+
+bool VariableResampler::pop(PCMWavePtr& wave)
+{
+    const size_t count = PCMWave::bufferSize() * static_cast<size_t>(channels_);
+    if(channels_ == 0 || output_.size() - outputBegin_ < count) return false;
+    // 取り出すブロックの頭は、入力の終わりから溜まっている分だけ前
+    const std::int64_t time = endTime_ == 0 ? 0
+        : endTime_ - std::llround(getDelayFrames() * 1e6 / PCMWave::sampleRate());
+    wave = PCMWavePool::getInstance().allocate(channels_);
+    PCMWave& dst = wave.mutate();
+    std::copy(output_.begin() + outputBegin_, output_.begin() + outputBegin_ + count, dst.raw());
+    dst.setCaptureTime(time);
+    outputBegin_ += count;
+    return true;
+}
+
+double VariableResampler::getDelayFrames() const
+{
+    if(channels_ == 0)  return 0;
+    return (inputFrames() - pos_) + static_cast<double>(output_.size() - outputBegin_) / channels_;
+}
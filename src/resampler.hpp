@@ -0,0 +1,58 @@
+#pragma once
+#ifndef ___RESAMPLER_HPP___
+#define ___RESAMPLER_HPP___
+
+// 比を少しずつ変えながら掛け続けられるリサンプラ
+//
+// 窓付きsincを位相ごとに表にしておき、位相の間は線形に補間する
+// 比は1のごく近く（時計のずれを打ち消す程度）で使うことしか考えていないので、
+// 帯域を絞るための係数の伸縮はしない
+// 遅れは窓の半分の長さだけで、ブロック単位では遅らせない
+
+#include "wavepool.hpp"
+#include <cstdint>
+#include <vector>
+
+class VariableResampler
+{
+public:
+    enum {
+        HALF_TAPS = 16,
+        TAPS = HALF_TAPS * 2,
+        PHASES = 256,
+    };
+
+private:
+    int channels_;
+    // 入力のうち、まだ使うかもしれない分。インターリーブのまま
+    // 使い終わった先頭は消さずにinputBegin_(サンプル単位)を進め、push()でまとめて詰める
+    std::vector<double> input_;
+    size_t inputBegin_;
+    // 使える入力の先頭からの、次に作る出力の位置（フレーム単位）
+    double pos_;
+    // 作ったがまだブロックになっていない出力。先頭はoutputBegin_
+    std::vector<double> output_;
+    size_t outputBegin_;
+    std::vector<double> coef_;
+    // 最後に入れたブロックの終わりの時刻。分からなければ0
+    std::int64_t endTime_;
+
+private:
+    static const std::vector<double>& table();
+    static void compact(std::vector<double>& buf, size_t& begin);
+    size_t inputFrames() const { return (input_.size() - inputBegin_) / channels_; }
+
+public:
+    VariableResampler();
+
+    void reset();
+    // 入力のratioフレームごとに一フレームを作る。1より大きければ縮む
+    void push(const PCMWave& wave, double ratio);
+    // 一ブロック分溜まっていれば取り出す
+    // captureTimeは入力の時刻から、溜まっている分だけ戻したもの
+    bool pop(PCMWavePtr& wave);
+    // 入ってから出るまでに溜まっているフレーム数
+    double getDelayFrames() const;
+};
+
+#endif
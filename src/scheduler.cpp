@@ -0,0 +1,191 @@
+#include "scheduler.hpp"
+#include "helper.hpp"
+#include "error.hpp"
+#include "stopwatch.hpp"
+#include <chrono>
+#include <functional>
+#include <map>
+#include <set>
+
+GraphScheduler::GraphScheduler(const UnitPtr& clock, Clock clockType, int threadCount)
+    : clock_(clock), clockType_(clockType),
+      threadCount_(threadCount > 0 ? threadCount : std::max(1u, boost::thread::hardware_concurrency())),
+      generation_(0), hasFinished_(true),
+      cycleCount_(0), lastCycleUS_(0), maxCycleUS_(0)
+{
+    rebuild();
+}
+
+GraphScheduler::~GraphScheduler()
+{
+    if(proc_)   stop();
+}
+
+GraphScheduler::SchedulePtr GraphScheduler::compile()
+{
+    // 上下両方向に辿って、時計から繋がっているSocketを全て集める
+    std::set<SocketPtr> found;
+    std::vector<SocketPtr> stack = {clock_->socket_};
+    while(!stack.empty()){
+        auto socket = stack.back();
+        stack.pop_back();
+        if(!found.insert(socket).second)    continue;
+        for(auto& prev : socket->getPrevSockets())  stack.push_back(prev);
+        for(auto& next : socket->getNextSockets())  stack.push_back(next);
+    }
+
+    // 帰りがけ順に並べると上流が先になる
+    auto schedule = std::make_shared<Schedule>();
+    std::set<SocketPtr> visited;
+    std::function<void(const SocketPtr&)> visit = [&](const SocketPtr& socket) {
+        if(!visited.insert(socket).second)  return;
+        for(auto& prev : socket->getPrevSockets())  visit(prev);
+        if(socket->edgeCount_ != 0) schedule->order.push_back(socket);
+    };
+    for(auto& socket : found)   visit(socket);
+
+    // 組み込まれたSocket同士の依存関係
+    std::map<SocketPtr, int> index;
+    for(size_t i = 0;i < schedule->order.size();i++)
+        index[schedule->order.at(i)] = i;
+    const int size = schedule->order.size();
+    schedule->next.resize(size);
+    schedule->prevCount.assign(size, 0);
+    schedule->clockIndex = -1;
+    for(int i = 0;i < size;i++){
+        auto& socket = schedule->order.at(i);
+        for(auto& prev : socket->getPrevSockets()){
+            auto it = index.find(prev);
+            if(it == index.end())   continue;
+            schedule->next.at(it->second).push_back(i);
+            schedule->prevCount.at(i)++;
+        }
+        if(socket == clock_->socket_)   schedule->clockIndex = i;
+    }
+    for(int i = 0;i < size;i++)
+        if(schedule->prevCount.at(i) == 0)  schedule->roots.push_back(i);
+
+    return schedule;
+}
+
+void GraphScheduler::rebuild()
+{
+    auto schedule = compile();
+    SCOPED_LOCK(mtx_);
+    // 止まっている間は、送り手が下流まで処理するままにしておく
+    if(!hasFinished_){
+        // 外れたSocketは、送り手が下流まで処理する動きに戻す
+        const std::set<SocketPtr> kept(schedule->order.begin(), schedule->order.end());
+        for(auto& socket : schedule_->order)
+            if(!kept.count(socket)) socket->setScheduled(false);
+        for(auto& socket : schedule->order) socket->setScheduled(true);
+    }
+    schedule_ = schedule;
+    generation_++;
+}
+
+size_t GraphScheduler::getScheduleSize()
+{
+    SCOPED_LOCK(mtx_);
+    return schedule_->order.size();
+}
+
+void GraphScheduler::processNode(int worker, int index)
+{
+    auto& schedule = *running_;
+    schedule.order.at(index)->process(clockType_ == Clock::DEVICE && index == schedule.clockIndex);
+    for(int next : schedule.next.at(index)){
+        if(remaining_[next].fetch_sub(1) == 1)  pool_->push(worker, next);
+    }
+}
+
+void GraphScheduler::runSerial(const Schedule& schedule)
+{
+    const int size = schedule.order.size();
+    for(int i = 0;i < size;i++)
+        schedule.order.at(i)->process(clockType_ == Clock::DEVICE && i == schedule.clockIndex);
+}
+
+void GraphScheduler::runParallel(const Schedule& schedule)
+{
+    const int size = schedule.order.size();
+    for(int i = 0;i < size;i++) remaining_[i] = schedule.prevCount.at(i);
+    pool_->run(schedule.roots);
+}
+
+void GraphScheduler::run()
+{
+    using steady_clock = std::chrono::steady_clock;
+    const auto period = std::chrono::microseconds(
+        1000000LL * PCMWave::bufferSize() / PCMWave::sampleRate());
+    auto deadline = steady_clock::now();
+
+    if(threadCount_ > 1){
+        pool_ = make_unique<WorkStealingPool>(threadCount_,
+            [this](int worker, int index) { processNode(worker, index); });
+    }
+
+    int generation = -1;
+    StopWatch<std::chrono::microseconds> watch;
+    while(!hasFinished_){
+        if(generation != generation_){
+            SCOPED_LOCK(mtx_);
+            running_ = schedule_;
+            generation = generation_;
+            remaining_.reset(new std::atomic<int>[running_->order.size()]);
+        }
+
+        watch.restart();
+        if(pool_)   runParallel(*running_);
+        else        runSerial(*running_);
+        long long elapsed = watch.elapsed();
+
+        lastCycleUS_ = elapsed;
+        if(elapsed > maxCycleUS_)   maxCycleUS_ = elapsed;
+        cycleCount_++;
+
+        if(clockType_ == Clock::TIMER){
+            // 大きく遅れたら追いつこうとせずに諦める
+            deadline += period;
+            if(deadline + period < steady_clock::now())  deadline = steady_clock::now();
+            auto wait = std::chrono::duration_cast<std::chrono::microseconds>(deadline - steady_clock::now());
+            if(wait.count() > 0)
+                boost::this_thread::sleep(boost::posix_time::microseconds(wait.count()));
+        }
+    }
+
+    pool_.reset();
+}
+
+void GraphScheduler::start()
+{
+    if(proc_)   return;
+    {
+        SCOPED_LOCK(mtx_);
+        hasFinished_ = false;
+        for(auto& socket : schedule_->order)    socket->setScheduled(true);
+    }
+    proc_ = make_unique<boost::thread>([this]() {
+        try{
+            run();
+        }
+        catch(std::exception& ex){
+            ZARU_CHECK(ex.what());
+        }
+        catch(...){
+            ZARU_CHECK("fatal error");
+        }
+    });
+}
+
+void GraphScheduler::stop()
+{
+    if(!proc_)  return;
+    hasFinished_ = true;
+    proc_->join();
+    proc_.reset();
+
+    // 元の、送り手が下流まで処理する動きに戻す
+    SCOPED_LOCK(mtx_);
+    for(auto& socket : schedule_->order)    socket->setScheduled(false);
+}
@@ -0,0 +1,81 @@
+#pragma once
+#ifndef ___SCHEDULER_HPP___
+#define ___SCHEDULER_HPP___
+
+#include "socket.hpp"
+#include "workpool.hpp"
+#include <boost/thread.hpp>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// connect()で作られたUnitのグラフをトポロジカル順に並べておき、
+// 1ブロック分ずつ上流から順に処理する
+// 組み込まれたSocketは受け取っても積むだけになるので、
+// 送り手（ネットワークやマイクのスレッド）は下流の処理を肩代わりしなくなる
+//
+// threadCountが2以上なら、独立した枝をWorkStealingPoolで並列に処理する
+// 合流するSocketは、前の組み込まれたSocketが全て終わってから処理される
+class GraphScheduler
+{
+public:
+    enum class Clock {
+        DEVICE,     // 時計役のUnit（SpeakerInUnitなど）の書き込みがブロックすることで進む
+        TIMER,      // 1ブロック分の時間ごとに進む
+    };
+
+private:
+    struct Schedule
+    {
+        std::vector<SocketPtr> order;           // トポロジカル順、前のないSocketは除く
+        std::vector<std::vector<int>> next;     // orderの添字
+        std::vector<int> prevCount;             // 組み込まれた前のSocketの数
+        std::vector<int> roots;                 // prevCount == 0
+        int clockIndex;
+    };
+    using SchedulePtr = std::shared_ptr<const Schedule>;
+
+private:
+    const UnitPtr clock_;
+    const Clock clockType_;
+    const int threadCount_;
+
+    boost::mutex mtx_;
+    SchedulePtr schedule_;
+    std::atomic<int> generation_;       // schedule_を作り直すたびに増える
+    std::unique_ptr<boost::thread> proc_;
+    std::atomic<bool> hasFinished_;
+
+    // 並列実行用、runの中でだけ触る
+    SchedulePtr running_;
+    std::unique_ptr<std::atomic<int>[]> remaining_;
+    std::unique_ptr<WorkStealingPool> pool_;
+
+    std::atomic<long long> cycleCount_, lastCycleUS_, maxCycleUS_;
+
+private:
+    SchedulePtr compile();
+    void processNode(int worker, int index);
+    void runSerial(const Schedule& schedule);
+    void runParallel(const Schedule& schedule);
+    void run();
+
+public:
+    // clockから辿れるUnitを全て組み込む
+    // threadCount <= 0 ならコア数
+    GraphScheduler(const UnitPtr& clock, Clock clockType = Clock::DEVICE, int threadCount = 1);
+    ~GraphScheduler();
+
+    // グラフを作り直したら呼ぶ
+    void rebuild();
+
+    void start();
+    void stop();
+
+    long long getCycleCount() const { return cycleCount_; }
+    long long getLastCycleTime() const { return lastCycleUS_; }   // [us]
+    long long getMaxCycleTime() const { return maxCycleUS_; }     // [us]
+    size_t getScheduleSize();
+};
+
+#endif
@@ -0,0 +1,382 @@
+#include "shm_network.hpp"
+#include "helper.hpp"
+#include "error.hpp"
+#include <boost/interprocess/exceptions.hpp>
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+size_t roundUp(size_t n, size_t unit)
+{
+    return (n + unit - 1) / unit * unit;
+}
+
+std::int64_t steadyMillis()
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#if defined(__linux__)
+static_assert(sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t), "futex needs a plain 32bit word");
+
+// プロセスを跨ぐので、PRIVATEでない方を使う
+void futexWait(std::atomic<std::uint32_t>& word, std::uint32_t expected, std::chrono::milliseconds timeout)
+{
+    timespec ts;
+    ts.tv_sec = timeout.count() / 1000;
+    ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+    ::syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+void futexWake(std::atomic<std::uint32_t>& word)
+{
+    ::syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+#endif
+
+}
+
+std::string shmRingName(unsigned short port)
+{
+    return "cables_shm_" + toString(port);
+}
+
+ShmRing::ShmRing(const std::string& name, bool isOwner, boost::interprocess::shared_memory_object&& shm)
+    : name_(name), isOwner_(isOwner), shm_(std::move(shm)),
+      region_(shm_, boost::interprocess::read_write),
+      header_(static_cast<Header *>(region_.get_address())),
+      slotCount_(0), slotChannels_(0), slotStride_(0), rejected_(0)
+{}
+
+ShmRing::~ShmRing()
+{
+    if(!isOwner_)   return;
+    // 送り手に捨てたことを知らせてから名前を消す
+    // 送り手は自分の写しを持っているので、開き直すまでは書いても害はない
+    header_->closed.store(1, std::memory_order_release);
+    boost::interprocess::shared_memory_object::remove(name_.c_str());
+}
+
+std::unique_ptr<ShmRing> ShmRing::create(const std::string& name, int slotChannels, int slotCount)
+{
+    using namespace boost::interprocess;
+    const size_t headerSize = roundUp(sizeof(Header), CACHE_LINE);
+    const size_t stride = roundUp(sizeof(Slot) + sizeof(double) * PCMWave::bufferSize() * slotChannels, CACHE_LINE);
+
+    shared_memory_object::remove(name.c_str());
+    shared_memory_object shm(create_only, name.c_str(), read_write);
+    shm.truncate(headerSize + stride * slotCount);
+    std::unique_ptr<ShmRing> ret(new ShmRing(name, true, std::move(shm)));
+
+    Header *header = new(ret->region_.get_address()) Header;
+    header->version = VERSION;
+    header->sampleRate = PCMWave::sampleRate();
+    header->bufferSize = PCMWave::bufferSize();
+    header->slotCount = slotCount;
+    header->slotChannels = slotChannels;
+    header->slotStride = stride;
+    header->closed.store(0, std::memory_order_relaxed);
+    header->writer.store(0, std::memory_order_relaxed);
+    header->writerBeat.store(0, std::memory_order_relaxed);
+    header->head.store(0, std::memory_order_relaxed);
+    header->tail.store(0, std::memory_order_relaxed);
+    header->waiting.store(0, std::memory_order_relaxed);
+    header->magic.store(MAGIC, std::memory_order_release);
+    ret->slotCount_ = slotCount;
+    ret->slotChannels_ = slotChannels;
+    ret->slotStride_ = stride;
+    return ret;
+}
+
+std::unique_ptr<ShmRing> ShmRing::open(const std::string& name)
+{
+    using namespace boost::interprocess;
+    std::unique_ptr<ShmRing> ret;
+    try{
+        shared_memory_object shm(open_only, name.c_str(), read_write);
+        ret.reset(new ShmRing(name, false, std::move(shm)));
+    }
+    catch(interprocess_exception&){
+        return nullptr;
+    }
+
+    const size_t size = ret->region_.get_size();
+    const Header *header = ret->header_;
+    if(size < sizeof(Header) || header->magic.load(std::memory_order_acquire) != MAGIC)   return nullptr;
+    if(header->version != VERSION)  return nullptr;
+    if(header->sampleRate != static_cast<std::uint32_t>(PCMWave::sampleRate()) ||
+       header->bufferSize != static_cast<std::uint32_t>(PCMWave::bufferSize())){
+        std::cout << "SHM_ERROR: session format mismatch (local " <<
+            PCMWave::sampleRate() << "Hz/" << PCMWave::bufferSize() << ", remote " <<
+            header->sampleRate << "Hz/" << header->bufferSize << ")" << std::endl;
+        return nullptr;
+    }
+    ret->slotCount_ = header->slotCount;
+    ret->slotChannels_ = header->slotChannels;
+    ret->slotStride_ = header->slotStride;
+    if(ret->slotCount_ == 0 || ret->slotChannels_ == 0 ||
+       ret->slotStride_ < sizeof(Slot) + sizeof(double) * PCMWave::bufferSize() * ret->slotChannels_ ||
+       size < roundUp(sizeof(Header), CACHE_LINE) + static_cast<size_t>(ret->slotStride_) * ret->slotCount_)
+        return nullptr;
+    if(ret->isClosed()) return nullptr;
+    return ret;
+}
+
+ShmRing::Slot *ShmRing::slot(std::uint32_t index) const
+{
+    char *base = static_cast<char *>(region_.get_address()) + roundUp(sizeof(Header), CACHE_LINE);
+    return reinterpret_cast<Slot *>(base + static_cast<size_t>(index % slotCount_) * slotStride_);
+}
+
+void ShmRing::wake()
+{
+#if defined(__linux__)
+    futexWake(header_->tail);
+#endif
+}
+
+bool ShmRing::claim(std::uint32_t session)
+{
+    // 印を先に書いておけば、取った直後に他の送り手から古いと見られることはない
+    // 取れなくても、今の送り手の印を新しくするだけで害はない
+    const std::int64_t now = steadyMillis();
+    const std::int64_t beat = header_->writerBeat.load(std::memory_order_acquire);
+    std::uint32_t expected = header_->writer.load(std::memory_order_acquire);
+    if(expected != 0 && now - beat < WRITER_TIMEOUT_MILLISECONDS)   return false;
+    header_->writerBeat.store(now, std::memory_order_release);
+    return header_->writer.compare_exchange_strong(expected, session, std::memory_order_acq_rel);
+}
+
+void ShmRing::release(std::uint32_t session)
+{
+    std::uint32_t expected = session;
+    header_->writer.compare_exchange_strong(expected, 0, std::memory_order_acq_rel);
+}
+
+bool ShmRing::push(const PCMWave& wave, std::uint32_t session, std::uint32_t seq)
+{
+    if(wave.channels() > static_cast<int>(slotChannels_) || wave.size() != static_cast<size_t>(PCMWave::bufferSize()))
+        return false;
+    // 溢れて書けなくても、生きていることは知らせる
+    header_->writerBeat.store(steadyMillis(), std::memory_order_relaxed);
+    const std::uint32_t tail = header_->tail.load(std::memory_order_relaxed);
+    if(tail - header_->head.load(std::memory_order_acquire) >= slotCount_)  return false;
+
+    Slot *s = slot(tail);
+    s->session = session;
+    s->seq = seq;
+    s->channels = wave.channels();
+    s->frames = wave.size();
+    s->captureTime = wave.captureTime();
+    std::memcpy(s + 1, wave.raw(), sizeof(double) * wave.size() * wave.channels());
+
+    // 待っている受け手を見落とさないよう、tailとwaitingはseq_cstで読み書きする
+    header_->tail.store(tail + 1, std::memory_order_seq_cst);
+    if(header_->waiting.load(std::memory_order_seq_cst))    wake();
+    return true;
+}
+
+bool ShmRing::pop(PCMWavePtr& wave, std::uint32_t& session, std::uint32_t& seq)
+{
+    for(;;){
+        const std::uint32_t head = header_->head.load(std::memory_order_relaxed);
+        if(head == header_->tail.load(std::memory_order_acquire))   return false;
+
+        // 送り手は枠を書き換えられるので、一度だけ読んだ値で確かめて使う
+        const Slot *s = slot(head);
+        const std::uint32_t channels = s->channels, frames = s->frames;
+        session = s->session;
+        seq = s->seq;
+        if(channels == 0 || channels > slotChannels_ ||
+           frames != static_cast<std::uint32_t>(PCMWave::bufferSize()) || session == 0){
+            rejected_++;
+            header_->head.store(head + 1, std::memory_order_release);
+            continue;
+        }
+
+        wave = PCMWavePool::getInstance().allocate(channels);
+        PCMWave& dst = wave.mutate();
+        std::memcpy(dst.raw(), s + 1, sizeof(double) * frames * channels);
+        dst.setCaptureTime(s->captureTime);
+        header_->head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+}
+
+void ShmRing::wait(std::chrono::milliseconds timeout)
+{
+    header_->waiting.store(1, std::memory_order_seq_cst);
+    const std::uint32_t tail = header_->tail.load(std::memory_order_seq_cst);
+    if(tail == header_->head.load(std::memory_order_relaxed)){
+#if defined(__linux__)
+        futexWait(header_->tail, tail, timeout);
+#else
+        // 起こす手段がないので、1msずつ見に行く
+        boost::this_thread::sleep(boost::posix_time::milliseconds(std::min<long long>(1, timeout.count())));
+#endif
+    }
+    header_->waiting.store(0, std::memory_order_relaxed);
+}
+
+int ShmRing::size() const
+{
+    return header_->tail.load(std::memory_order_acquire) - header_->head.load(std::memory_order_acquire);
+}
+
+///
+
+ShmSendInUnit::ShmSendInUnit(unsigned short port)
+    : name_(shmRingName(port)), session_(0), seq_(0)
+{}
+
+ShmSendInUnit::~ShmSendInUnit()
+{
+    SCOPED_LOCK(mtx_);
+    closeRing();
+}
+
+bool ShmSendInUnit::ensureRing()
+{
+    // 受け手が環を作り直していたら、開き直す
+    if(ring_ && ring_->isClosed())  closeRing();
+    // 黙っている間に他の送り手に引き継がれていたら、手放して空くのを待つ
+    if(ring_ && !ring_->isClaimedBy(session_)){
+        std::cout << "SHM_ERROR: " << name_ << " was taken over by another sender" << std::endl;
+        closeRing();
+        nextRetry_ = std::chrono::steady_clock::now() + std::chrono::milliseconds(RETRY_MILLISECONDS);
+    }
+    if(ring_)   return true;
+
+    const auto now = std::chrono::steady_clock::now();
+    if(now < nextRetry_)    return false;
+    nextRetry_ = now + std::chrono::milliseconds(RETRY_MILLISECONDS);
+    ring_ = ShmRing::open(name_);
+    if(ring_ && !ring_->claim(session_)){
+        std::cout << "SHM_ERROR: " << name_ << " already has a sender" << std::endl;
+        ring_.reset();
+    }
+    return static_cast<bool>(ring_);
+}
+
+void ShmSendInUnit::closeRing()
+{
+    if(ring_)   ring_->release(session_);
+    ring_.reset();
+}
+
+void ShmSendInUnit::startImpl()
+{
+    SCOPED_LOCK(mtx_);
+    // 繋ぐたびに番号を変えて、受け手に連番の数え直しを知らせる
+    session_ = static_cast<std::uint32_t>(std::chrono::steady_clock::now().time_since_epoch().count()) | 1;
+    seq_ = 0;
+    nextRetry_ = std::chrono::steady_clock::now();
+}
+
+void ShmSendInUnit::stopImpl()
+{
+    SCOPED_LOCK(mtx_);
+    closeRing();
+}
+
+void ShmSendInUnit::inputImpl(PCMWavePtr wave)
+{
+    SCOPED_LOCK(mtx_);
+    if(!ensureRing())   return;
+    // 溢れて捨てたものも番号は使うので、受け手には抜けに見える
+    if(!ring_->push(*wave, session_, seq_++))   recordDrop();
+}
+
+void ShmSendInUnit::writeStatsImpl(std::ostream& os)
+{
+    SCOPED_LOCK(mtx_);
+    os << "    ring:" << name_;
+    if(ring_)   os << " queue:" << ring_->size() << "/" << ring_->capacity() << std::endl;
+    else        os << " (not opened)" << std::endl;
+}
+
+///
+
+ShmRecvOutUnit::ShmRecvOutUnit(unsigned short port)
+    : name_(shmRingName(port)), hasFinished_(false), session_(0), rejected_(0)
+{}
+
+ShmRecvOutUnit::~ShmRecvOutUnit()
+{}
+
+void ShmRecvOutUnit::proc()
+{
+    try{
+        while(!hasFinished_){
+            PCMWavePtr wave;
+            std::uint32_t session, seq;
+            const bool hasWave = ring_->pop(wave, session, seq);
+            rejected_ = ring_->getRejectedCount();
+            if(!hasWave){
+                ring_->wait(std::chrono::milliseconds(WAIT_MILLISECONDS));
+                continue;
+            }
+
+            // 送り手が繋ぎ直したら、連番を数え直す
+            if(session != session_){
+                concealer_.reset();
+                transit_.reset();
+                session_ = session;
+            }
+            transit_.record(wave->captureTime());
+            // 下流が空いている分だけは、抜けを埋めても遅れない
+            concealer_.push(seq, wave, 1 - getOutputQueueDepth(), concealed_);
+            for(auto& w : concealed_)   send(std::move(w));
+            concealed_.clear();
+        }
+    }
+    catch(std::exception& ex){
+        ZARU_CHECK(ex.what());
+    }
+}
+
+void ShmRecvOutUnit::startImpl()
+{
+    ring_ = ShmRing::create(name_);
+    session_ = 0;
+    rejected_ = 0;
+    concealer_.reset();
+    transit_.reset();
+    hasFinished_ = false;
+    proc_ = make_unique<boost::thread>([this]() { proc(); });
+}
+
+void ShmRecvOutUnit::stopImpl()
+{
+    hasFinished_ = true;
+    proc_->join();
+    ring_.reset();
+}
+
+void ShmRecvOutUnit::writeStatsImpl(std::ostream& os)
+{
+    const auto loss = concealer_.getStats();
+    const auto transit = transit_.getStats();
+    os << "    ring:" << name_ << " rejected:" << rejected_ << std::endl;
+    os << "    recv:" << loss.received <<
+        " lost:" << loss.lost <<
+        " reordered:" << loss.reordered <<
+        " concealed:" << loss.concealed <<
+        " restarted:" << loss.restarted << std::endl;
+    os << "    latency:" << transit.latencyUS << "us" <<
+        " min:" << transit.minLatencyUS << "us" <<
+        " max:" << transit.maxLatencyUS << "us" <<
+        " jitter:" << transit.jitterUS << "us" << std::endl;
+}
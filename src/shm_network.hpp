@@ -0,0 +1,186 @@
+#pragma once
+#ifndef ___SHM_NETWORK_HPP___
+#define ___SHM_NETWORK_HPP___
+
+// 同じホストのmicとmixerを共有メモリで繋ぐ
+//
+// 受け手が名前付きの共有メモリにブロックの環を作り、送り手がそれを開いて書き込む
+// 環の枠はPCMWaveと同じインターリーブのdoubleなので、符号化もソケットも通さずに
+// 送り手のブロックから枠へ、枠から受け手のブロックへそれぞれ一度コピーするだけで届く
+// 空の環を待つのはLinuxではfutex、それ以外では短い間隔で見に行く
+// 一つの環には一つの送り手だけが書ける。送り手は書くたびに生きている印を残し、
+// 印が途絶えた送り手(落ちたものなど)の環は、次の送り手が引き継げる
+// 受け手は枠の中身を信用せず、形の合わない枠は捨てる
+
+#include "socket.hpp"
+#include "wavepool.hpp"
+#include "lossconcealer.hpp"
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/thread.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// 共有メモリの上のSPSCの環
+// 先頭にHeader、その後ろにslotCount個の枠が並ぶ
+class ShmRing
+{
+public:
+    enum {
+        MAGIC = 0x4D484243,     // "CBHM"
+        // 2: 送り手の生きている印を足した
+        VERSION = 2,
+        CACHE_LINE = 64,
+        DEFAULT_SLOT_COUNT = 16,
+        // 送り手の印がこれだけ古ければ、落ちたものとして引き継ぐ
+        WRITER_TIMEOUT_MILLISECONDS = 3000,
+    };
+
+private:
+    struct Header
+    {
+        // 作る側が最後に書く。揃うまでは開けない
+        std::atomic<std::uint32_t> magic;
+        std::uint32_t version;
+        std::uint32_t sampleRate, bufferSize;
+        std::uint32_t slotCount, slotChannels, slotStride;
+        // 受け手が環を捨てたら1。送り手は開き直す
+        std::atomic<std::uint32_t> closed;
+        // 書いている送り手の印。0なら空いている
+        std::atomic<std::uint32_t> writer;
+        // 送り手が最後に書いた時刻。steady_clockのミリ秒
+        std::atomic<std::int64_t> writerBeat;
+        alignas(CACHE_LINE) std::atomic<std::uint32_t> head;   // 受け手が書く
+        alignas(CACHE_LINE) std::atomic<std::uint32_t> tail;   // 送り手が書く。futexの待ち先
+        std::atomic<std::uint32_t> waiting;                     // 受け手が待っていれば1
+    };
+
+    // 枠の先頭。サンプルはこの後ろに続く
+    struct Slot
+    {
+        // 送り手が繋ぐたびに変わる。連番はその中で数える
+        std::uint32_t session, seq;
+        std::uint32_t channels, frames;
+        std::int64_t captureTime;
+    };
+
+private:
+    const std::string name_;
+    const bool isOwner_;
+    boost::interprocess::shared_memory_object shm_;
+    boost::interprocess::mapped_region region_;
+    Header *header_;
+    // 環の形。開いたときに確かめた値を持っておき、共有メモリの方は二度と読まない
+    std::uint32_t slotCount_, slotChannels_, slotStride_;
+    // 受け手のスレッドだけで数える
+    std::uint64_t rejected_;
+
+private:
+    ShmRing(const std::string& name, bool isOwner, boost::interprocess::shared_memory_object&& shm);
+    Slot *slot(std::uint32_t index) const;
+    void wake();
+
+public:
+    // 受け手が作る。同じ名前の古いものは消して作り直す
+    static std::unique_ptr<ShmRing> create(const std::string& name, int slotChannels = PCMWave::CHANNEL_COUNT,
+                                           int slotCount = DEFAULT_SLOT_COUNT);
+    // 送り手が開く。まだないか、今のセッションと形が合わなければnullptr
+    static std::unique_ptr<ShmRing> open(const std::string& name);
+    // 作った側が捨てると、名前も消える
+    ~ShmRing();
+
+    // 送り手の側
+    // 空いているか、前の送り手の印が途絶えていれば取る
+    bool claim(std::uint32_t session);
+    void release(std::uint32_t session);
+    // 印が途絶えている間に、他の送り手に引き継がれていればfalse
+    bool isClaimedBy(std::uint32_t session) const { return header_->writer.load(std::memory_order_acquire) == session; }
+    bool isClosed() const { return header_->closed.load(std::memory_order_acquire) != 0; }
+    // 一杯か、枠に入らない形ならfalse
+    bool push(const PCMWave& wave, std::uint32_t session, std::uint32_t seq);
+
+    // 受け手の側
+    // 空ならfalse。形の合わない枠は数えて読み飛ばす
+    bool pop(PCMWavePtr& wave, std::uint32_t& session, std::uint32_t& seq);
+    // 何か書かれるか、timeoutが過ぎるまで待つ
+    void wait(std::chrono::milliseconds timeout);
+    int size() const;
+    int capacity() const { return slotCount_; }
+    std::uint64_t getRejectedCount() const { return rejected_; }
+};
+
+// 同じホストの受け手へ共有メモリで送る
+// portは環の名前にだけ使う
+class ShmSendInUnit : public Unit
+{
+private:
+    enum {
+        // 環がなければ、この間隔で開き直してみる
+        RETRY_MILLISECONDS = 1000,
+    };
+
+private:
+    const std::string name_;
+    boost::mutex mtx_;
+    std::unique_ptr<ShmRing> ring_;
+    std::uint32_t session_, seq_;
+    std::chrono::steady_clock::time_point nextRetry_;
+
+private:
+    bool ensureRing();
+    void closeRing();
+
+public:
+    ShmSendInUnit(unsigned short port);
+    ~ShmSendInUnit();
+
+    void startImpl();
+    void stopImpl();
+    void inputImpl(PCMWavePtr wave);
+    void writeStatsImpl(std::ostream& os);
+};
+
+// 共有メモリで受ける
+// 自分のスレッドで環を待ち、届いたものを連番の抜けを埋めてから流す
+class ShmRecvOutUnit : public Unit
+{
+private:
+    enum {
+        WAIT_MILLISECONDS = 100,
+    };
+
+private:
+    const std::string name_;
+    std::unique_ptr<ShmRing> ring_;
+    std::unique_ptr<boost::thread> proc_;
+    std::atomic<bool> hasFinished_;
+    std::uint32_t session_;
+    // 形が合わずに捨てた枠の数
+    std::atomic<std::uint64_t> rejected_;
+    LossConcealer concealer_;
+    TransitMeter transit_;
+    std::vector<PCMWavePtr> concealed_;
+
+private:
+    void proc();
+
+public:
+    ShmRecvOutUnit(unsigned short port);
+    ~ShmRecvOutUnit();
+
+    void startImpl();
+    void stopImpl();
+    void writeStatsImpl(std::ostream& os);
+
+    LossConcealer::Stats getLossStats() const { return concealer_.getStats(); }
+    TransitMeter::Stats getTransitStats() const { return transit_.getStats(); }
+};
+
+// portから環の名前を作る
+std::string shmRingName(unsigned short port);
+
+#endif
@@ -1,6 +1,11 @@
 #include "socket.hpp"
 #include "helper.hpp"
 #include "error.hpp"
+#include "kernel.hpp"
+#include "stopwatch.hpp"
+#include <boost/core/demangle.hpp>
+#include <algorithm>
+#include <typeinfo>
 #include <utility>
 
 void connect(const std::vector<UnitPtr>& prevUnits, const std::vector<UnitPtr>& nextUnits)
@@ -12,112 +17,334 @@ void connect(const std::vector<UnitPtr>& prevUnits, const std::vector<UnitPtr>&
 
 bool isAvailableSocket(const SocketPtr& socket)
 {
-    if(!socket->canSendToNext())    return false;   // 通行止め
-    if(socket->recvPool_.empty())   return true;    // 終着点
-    for(auto& item : socket->recvPool_){
-        if(isAvailableSocket(item.first))   return true;
-    }
-    return false;
+    return socket->isAvailable();
 }
 
 ///
 
+boost::mutex Socket::availabilityMtx_;
+
 Socket::Socket(Unit& parent)
-    : canRecvFromPrev_(false), canSendToNext_(false), parent_(parent)
-{}
+    : canRecvFromPrev_(false), canSendToNext_(false),
+      isAvailable_(false), liveInputs_(0), waitingInputs_(0), queuedCount_(0),
+      edges_(MAX_PREV_COUNT), edgeCount_(0), isEmitting_(false), isScheduled_(false),
+      parent_(parent)
+{
+    mixWaves_.reserve(MAX_PREV_COUNT);
+    mixSrcs_.reserve(MAX_PREV_COUNT);
+    mixGains_.reserve(MAX_PREV_COUNT);
+}
+
+constexpr double Socket::MIX_LIMIT;
 
 void Socket::open()
 {
-    {
-        SCOPED_LOCK(sendMtx_);
-        canSendToNext_ = true;
-    }
-    {
-        SCOPED_LOCK(recvMtx_);
-        canRecvFromPrev_ = true;
-    }
+    setCanSendToNext(true);
+    clearPool();
+    canRecvFromPrev_ = true;
 }
 
 void Socket::close()
+{
+    setCanSendToNext(false);
+    canRecvFromPrev_ = false;
+    clearPool();
+}
+
+void Socket::setCanSendToNext(bool canSend)
 {
     {
         SCOPED_LOCK(sendMtx_);
-        canSendToNext_ = false;
+        canSendToNext_ = canSend;
     }
+    std::vector<SocketPtr> touched;
     {
-        SCOPED_LOCK(recvMtx_);
-        canRecvFromPrev_ = false;
-        for(auto& pool : recvPool_)
-            pool.second.clear();
+        SCOPED_LOCK(availabilityMtx_);
+        updateAvailability(touched);
     }
+    // 前が死んで待たなくてよくなったSocketがあるかもしれない
+    for(auto& socket : touched) socket->tryEmit();
 }
 
-void Socket::addNextSocket(const SocketPtr& next)
+void Socket::addNextSocket(const SocketPtr& next, int edgeId)
 {
+    // availabilityMtx_も取られているので、updateAvailability()はsendMtx_なしで読める
     SCOPED_LOCK(sendMtx_);
-    nextSockets_.push_back(next);
+    nextSockets_.push_back(std::make_pair(next, edgeId));
 }
 
 void Socket::addPrevSocket(const SocketPtr& prev)
 {
-    SCOPED_LOCK(recvMtx_);
-    recvPool_.insert(std::make_pair(prev, std::deque<PCMWave>()));
+    std::vector<SocketPtr> touched;
+    {
+        SCOPED_LOCK(availabilityMtx_);
+
+        // 追加するのはここだけなので、書き手は同時に一つ
+        const int id = edgeCount_.load(std::memory_order_relaxed);
+        ZARU_THROW_UNLESS(id < MAX_PREV_COUNT);
+        const bool isLive = prev->isAvailable();
+        edges_[id] = make_unique<Edge>(prev, isLive);
+        if(isLive){
+            liveInputs_++;
+            waitingInputs_++;
+        }
+        edgeCount_.store(id + 1, std::memory_order_release);
+        prev->addNextSocket(shared_from_this(), id);
+
+        updateAvailability(touched);
+    }
+    for(auto& socket : touched) socket->tryEmit();
+}
+
+void Socket::updateEdgeState(Edge& edge, int countDiff, int liveValue)
+{
+    // liveValueが負なら生死は変えない
+    int prev = edge.state.load(), next;
+    do{
+        next = prev + (countDiff << 1);
+        if(liveValue >= 0)  next = (next & ~1) | liveValue;
+    }while(!edge.state.compare_exchange_weak(prev, next));
+
+    const int diff = (Edge::isWaiting(next) ? 1 : 0) - (Edge::isWaiting(prev) ? 1 : 0);
+    if(diff != 0)   waitingInputs_ += diff;
+}
+
+void Socket::updateAvailability(std::vector<SocketPtr>& touched)
+{
+    const bool isAvailable = canSendToNext_ &&
+        (edgeCount_.load(std::memory_order_acquire) == 0 || liveInputs_ > 0);
+    touched.push_back(shared_from_this());
+    if(isAvailable == isAvailable_) return;
+    isAvailable_ = isAvailable;
+
+    for(auto& next : nextSockets_)
+        next.first->setEdgeLive(next.second, isAvailable, touched);
+}
+
+void Socket::setEdgeLive(int edgeId, bool isLive, std::vector<SocketPtr>& touched)
+{
+    auto& edge = *edges_[edgeId];
+    if(Edge::isLive(edge.state) == isLive)  return;
+    updateEdgeState(edge, 0, isLive ? 1 : 0);
+    liveInputs_ += isLive ? 1 : -1;
+    updateAvailability(touched);
 }
 
-void Socket::write(const PCMWave& src)
+void Socket::write(PCMWavePtr src)
 {
     SCOPED_LOCK(sendMtx_);
-    if(!canSendToNext_) return;
+    if(!canSendToNext_ || nextSockets_.empty()) return;
 
-    for(auto& socket : nextSockets_)
-        socket->onRecv(shared_from_this(), src);
+    // 分岐先にはハンドルをコピーして渡すだけ
+    // 最後の一つにはmoveして、下流でcopy-on-writeが不要になるようにする
+    for(size_t i = 0;i + 1 < nextSockets_.size();i++)
+        nextSockets_.at(i).first->onRecv(nextSockets_.at(i).second, src);
+    nextSockets_.back().first->onRecv(nextSockets_.back().second, std::move(src));
 }
 
-void Socket::onRecv(const SocketPtr& sender, const PCMWave& src)
+void Socket::onRecv(int edgeId, PCMWavePtr src)
 {
-    // 受け取れる状態をこの関数内で保証
-    SCOPED_LOCK(recvMtx_);
-    if(!canRecvFromPrev_)   return;
-    
-    recvPool_.at(sender).push_back(src);
-
-    // 全てのUnitからRecvしたか
-    // 先にQueueの判定をして、Queueに溜まっていれば生死に関わらずそれの処理を行う
-    if(std::all_of(recvPool_.begin(), recvPool_.end(),
-        [](const std::pair<SocketPtr, std::deque<PCMWave>>& item) {
-            auto& socket = item.first;
-            auto& que = item.second;
-            return !que.empty() || !isAvailableSocket(socket);
-        }))
-    {
-        emitPool();
+    if(!canRecvFromPrev_){
+        parent_.stats_.drops.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    // 溢れた分は捨てる
+    auto& edge = *edges_[edgeId];
+    if(!edge.pool.push(std::move(src))){
+        parent_.stats_.drops.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    updateEdgeState(edge, 1, -1);
+    queuedCount_++;
+    if(!isScheduled_)   tryEmit();
+}
+
+bool Socket::isReadyToEmit() const
+{
+    // 生きている全てのUnitからRecvしたか
+    // Queueに溜まっていれば生死に関わらずそれの処理を行う
+    return waitingInputs_ == 0 && queuedCount_ > 0;
+}
+
+void Socket::lockPool()
+{
+    // 読み手になる
+    bool expected = false;
+    while(!isEmitting_.compare_exchange_weak(expected, true)){
+        expected = false;
+        boost::this_thread::yield();
+    }
+}
+
+void Socket::unlockPool()
+{
+    isEmitting_ = false;
+}
+
+void Socket::clearPool()
+{
+    // 読み手になってから溜まっているものを捨てる
+    lockPool();
+    const int edgeCount = edgeCount_.load(std::memory_order_acquire);
+    PCMWavePtr tmp;
+    for(int i = 0;i < edgeCount;i++){
+        auto& edge = *edges_[i];
+        while(Edge::count(edge.state) > 0 && edge.pool.pop(tmp)){
+            updateEdgeState(edge, -1, -1);
+            queuedCount_--;
+        }
+    }
+    unlockPool();
+}
+
+void Socket::tryEmit()
+{
+    // 読み手は同時に一つだけ
+    // 他のスレッドが読み手なら、そちらが抜ける前に再確認するので任せてよい
+    if(isScheduled_)    return;
+    for(;;){
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool expected = false;
+        if(!isEmitting_.compare_exchange_strong(expected, true))    return;
+        while(canRecvFromPrev_ && isReadyToEmit())  emitPool();
+        isEmitting_ = false;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(!canRecvFromPrev_ || !isReadyToEmit())   return;
     }
 }
 
 void Socket::emitPool()
 {
-    PCMWave wave;
-    wave.fill(PCMWave::Sample(0, 0));
-    for(auto& pool : recvPool_){
-        auto& que = pool.second;
-        if(que.empty()) continue;
-        std::transform(
-            que.front().begin(), que.front().end(),
-            wave.begin(), wave.begin(),
-            [](const PCMWave::Sample& t, const PCMWave::Sample& f) {
-                return t + f;
-            }
-        );
-        que.pop_front();
+    PCMWavePtr wave = popOneFromEach();
+    if(!wave)   return;
+
+    parent_.input(std::move(wave));
+}
+
+PCMWavePtr Socket::popOneFromEach()
+{
+    // pushの後にstateが増えるので、stateで数えた分は必ずpoolにある
+    PCMWavePtr src;
+    const int edgeCount = edgeCount_.load(std::memory_order_acquire);
+    for(int i = 0;i < edgeCount;i++){
+        auto& edge = *edges_[i];
+        if(Edge::count(edge.state) == 0 || !edge.pool.pop(src)) continue;
+        updateEdgeState(edge, -1, -1);
+        queuedCount_--;
+        // 形の違うブロックは足せないので捨てる
+        if(!mixWaves_.empty() &&
+           (src->channels() != mixWaves_.front()->channels() || src->size() != mixWaves_.front()->size())){
+            parent_.stats_.drops.fetch_add(1, std::memory_order_relaxed);
+            continue;
+        }
+        mixGains_.push_back(edge.gain.load(std::memory_order_relaxed));
+        mixWaves_.push_back(std::move(src));
+    }
+    if(mixWaves_.empty())   return PCMWavePtr();
+
+    // 一つだけでそのままでよく、MIX_LIMITにも収まっていれば、足し合わせずに渡す
+    // 収まっていなければ、一つでもMixに通して切り詰める
+    PCMWavePtr wave = std::move(mixWaves_.front());
+    if(mixWaves_.size() == 1 && mixGains_.front() == 1.0 &&
+       kernel::simd::isWithin(wave->raw(), MIX_LIMIT, static_cast<int>(wave->size()) * wave->channels())){
+        mixWaves_.clear();
+        mixGains_.clear();
+        return wave;
     }
 
-    parent_.input(wave);
+    // 先頭のブロックを他と共有していなければ、そこに書く
+    const double *first = wave->raw();
+    const std::int64_t captureTime = wave->captureTime();
+    PCMWavePtr dst = wave.unique() ? std::move(wave) : PCMWavePool::getInstance().allocate(wave->channels());
+    auto& dstWave = dst.mutate();
+    dstWave.setCaptureTime(captureTime);
+    mixSrcs_.push_back(first);
+    for(size_t i = 1;i < mixWaves_.size();i++) mixSrcs_.push_back(mixWaves_[i]->raw());
+    dispatchBufferSize<kernel::Mix>(dstWave.size(), dstWave.channels(), dstWave.raw(),
+        mixSrcs_.data(), mixGains_.data(), static_cast<int>(mixSrcs_.size()), MIX_LIMIT);
+
+    mixWaves_.clear();
+    mixSrcs_.clear();
+    mixGains_.clear();
+    return dst;
+}
+
+void Socket::writeQueueDepths(std::ostream& os) const
+{
+    const int edgeCount = edgeCount_.load(std::memory_order_acquire);
+    for(int i = 0;i < edgeCount;i++){
+        auto& edge = *edges_[i];
+        os << "    <- " << edge.prev->parent_.getName() <<
+            " queue:" << edge.pool.size() << "/" << edge.pool.capacity() <<
+            (Edge::isLive(edge.state) ? "" : " (dead)") << std::endl;
+    }
+}
+
+int Socket::getQueuedToNext()
+{
+    SCOPED_LOCK(sendMtx_);
+    int ret = 0;
+    for(auto& next : nextSockets_)
+        ret = std::max(ret, Edge::count(next.first->edges_[next.second]->state));
+    return ret;
+}
+
+bool Socket::setInputGain(const SocketPtr& prev, double gain)
+{
+    bool found = false;
+    const int edgeCount = edgeCount_.load(std::memory_order_acquire);
+    for(int i = 0;i < edgeCount;i++){
+        if(edges_[i]->prev != prev) continue;
+        edges_[i]->gain = gain;
+        found = true;
+    }
+    return found;
+}
+
+void Socket::process(bool isClock)
+{
+    // 揃うのを待たずに、来ている分だけで処理する
+    // 時計役のUnitには何も来ていなくても無音を渡して、時間を進める
+    if(!canRecvFromPrev_)   return;
+    lockPool();
+    PCMWavePtr wave = popOneFromEach();
+    unlockPool();
+    if(!wave && isClock)    wave = PCMWavePool::getInstance().allocateZero();
+    if(wave)    parent_.input(std::move(wave));
+}
+
+std::vector<SocketPtr> Socket::getPrevSockets() const
+{
+    std::vector<SocketPtr> ret;
+    const int edgeCount = edgeCount_.load(std::memory_order_acquire);
+    for(int i = 0;i < edgeCount;i++)
+        ret.push_back(edges_[i]->prev);
+    return ret;
+}
+
+std::vector<SocketPtr> Socket::getNextSockets()
+{
+    std::vector<SocketPtr> ret;
+    SCOPED_LOCK(sendMtx_);
+    for(auto& next : nextSockets_)
+        ret.push_back(next.first);
+    return ret;
 }
 
 ///
 
+boost::mutex Unit::registryMtx_;
+std::vector<std::weak_ptr<Unit>> Unit::registry_;
+
+namespace {
+    // 入れ子になったinput()の時間。呼び出し元の処理時間からは差し引く
+    thread_local long long nestedInputNS = 0;
+}
+
 Unit::Unit()
-    : isAlive_(false), isMute_(false ? 1 : 0), emptyWave_(0)
+    : isAlive_(false), isRegistered_(false), isMute_(false ? 1 : 0),
+      emptyWave_(PCMWavePool::getInstance().allocateZero())
 {
     socket_ = std::make_shared<Socket>(*this);
 }
@@ -129,10 +356,14 @@ Unit::~Unit()
 
 void Unit::connectTo(const UnitPtr& next)
 {
-    this->socket_->addNextSocket(next->socket_);
     next->socket_->addPrevSocket(this->socket_);
 }
 
+bool Unit::setInputGain(const UnitPtr& prev, double gain)
+{
+    return socket_->setInputGain(prev->socket_, gain);
+}
+
 void Unit::setMute(bool isMute)
 {
     isMute_ = isMute ? 1 : 0;
@@ -148,6 +379,51 @@ bool Unit::isMute() const
     return isMute_;
 }
 
+void Unit::setName(const std::string& name)
+{
+    boost::unique_lock<boost::shared_mutex> lock(mtx_);
+    name_ = name;
+}
+
+std::string Unit::getName()
+{
+    boost::shared_lock<boost::shared_mutex> lock(mtx_);
+    return name_;
+}
+
+void Unit::writeStats(std::ostream& os)
+{
+    os << getName() << (isAlive() ? "" : " (stopped)") << std::endl << "    ";
+    stats_.write(os);
+    os << std::endl;
+    writeStatsImpl(os);
+    socket_->writeQueueDepths(os);
+}
+
+std::vector<std::shared_ptr<Unit>> Unit::getAllUnits()
+{
+    std::vector<std::shared_ptr<Unit>> ret;
+    SCOPED_LOCK(registryMtx_);
+    for(auto& weak : registry_){
+        auto unit = weak.lock();
+        if(unit)    ret.push_back(std::move(unit));
+    }
+    return ret;
+}
+
+void Unit::writeAllStats(std::ostream& os)
+{
+    // 書いている間に最後の参照が外れても、壊れるのはunitsを捨てるとき
+    auto units = getAllUnits();
+    for(auto& unit : units) unit->writeStats(os);
+}
+
+void Unit::resetAllStats()
+{
+    auto units = getAllUnits();
+    for(auto& unit : units) unit->resetStats();
+}
+
 void Unit::start()
 {
     // guarantee this unit is alive in the following impl function call
@@ -158,6 +434,15 @@ void Unit::start()
     }
 
     boost::upgrade_to_unique_lock<boost::shared_mutex> writeLock(readLock);
+    if(name_.empty())   name_ = boost::core::demangle(typeid(*this).name());
+    if(!isRegistered_){
+        // 捨てられたUnitの分はここで掃除する
+        SCOPED_LOCK(registryMtx_);
+        registry_.erase(std::remove_if(registry_.begin(), registry_.end(),
+            [](const std::weak_ptr<Unit>& unit) { return unit.expired(); }), registry_.end());
+        registry_.push_back(shared_from_this());
+        isRegistered_ = true;
+    }
     isAlive_ = true;
     socket_->open();
     startImpl();
@@ -178,16 +463,30 @@ void Unit::stop()
     stopImpl();
 }
 
-void Unit::input(const PCMWave& wave)
+void Unit::input(PCMWavePtr wave)
 {
+    stats_.blocksIn.fetch_add(1, std::memory_order_relaxed);
     boost::shared_lock<boost::shared_mutex> lock(mtx_);
-    if(isAlive_)    inputImpl(wave);
+    if(!isAlive_){
+        stats_.drops.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    // 下流のinput()がこのスレッドで呼ばれた分は、そちらに計上する
+    const long long outerNS = nestedInputNS;
+    nestedInputNS = 0;
+    StopWatch<std::chrono::nanoseconds> watch;
+    inputImpl(std::move(wave));
+    const long long elapsed = watch.elapsed();
+    stats_.procTime.record(elapsed - nestedInputNS);
+    nestedInputNS = outerNS + elapsed;
 }
 
-void Unit::send(const PCMWave& wave)
+void Unit::send(PCMWavePtr wave)
 {
+    stats_.blocksOut.fetch_add(1, std::memory_order_relaxed);
     if(isMute_) socket_->write(emptyWave_);
-    else        socket_->write(wave);
+    else        socket_->write(std::move(wave));
 }
 
 void Unit::setSocketStatus(bool status)
@@ -206,8 +505,10 @@ void ThreadOutUnit::startImpl()
             try{
                 construct();
                 while(!hasFinished_){
-                    PCMWave wave(std::move(update()));
-                    if(!hasFinished_)   send(wave);
+                    watch_.restart();
+                    PCMWavePtr wave = update();
+                    recordProcTime(watch_.elapsed());
+                    if(!hasFinished_)   send(std::move(wave));
                 }
             }
             catch(std::exception& ex){
@@ -221,6 +522,12 @@ void ThreadOutUnit::startImpl()
     );
 }
 
+void ThreadOutUnit::endWait()
+{
+    recordWaitTime(watch_.elapsed());
+    watch_.restart();
+}
+
 void ThreadOutUnit::stopImpl()
 {
     hasFinished_ = true;
@@ -3,15 +3,22 @@
 #define ___SOCKET_HPP___
 
 #include "pcmwave.hpp"
+#include "wavepool.hpp"
+#include "spscring.hpp"
+#include "unitstat.hpp"
+#include "stopwatch.hpp"
 #include <boost/thread.hpp>
 #include <cstdint>
 #include <atomic>
-#include <map>
 #include <memory>
-#include <queue>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
 
 class Unit;
 class Socket;
+class GraphScheduler;
 
 using UnitPtr = std::shared_ptr<Unit>;
 using SocketPtr = std::shared_ptr<Socket>;
@@ -20,23 +27,96 @@ using SocketPtr = std::shared_ptr<Socket>;
 // つなぐ　〜時を超えて笑顔を〜
 void connect(const std::vector<UnitPtr>& from, const std::vector<UnitPtr>& to);
 // 与えられたsocketからのデータの入手可能性を調べる
-// 再帰的に前のSocketを調べて、canSendToNext() == trueの一本線が引ければtrue
+// 前のSocketを辿って、canSendToNext() == trueの一本線が引ければtrue
+// 結果は開閉のたびに下流へ伝搬させて保持しているので、辿るのはO(1)
 bool isAvailableSocket(const SocketPtr& socket);
 
 class Socket : public std::enable_shared_from_this<Socket>  // thread safe
 {
     friend void connect(const std::vector<UnitPtr>&, const std::vector<UnitPtr>&);
-    friend bool isAvailableSocket(const SocketPtr&);
+    friend class GraphScheduler;
+
+public:
+    enum {
+        MAX_PREV_COUNT = 256,
+        EDGE_CAPACITY = 64,
+    };
+    // 入力の先へ渡すブロックはこの範囲に収める。入力が一つでも同じ
+    static constexpr double MIX_LIMIT = 1.0;
 
 private:
-    boost::mutex recvMtx_, sendMtx_;
-    bool canRecvFromPrev_, canSendToNext_;
-    std::vector<SocketPtr> nextSockets_;
-    std::map<SocketPtr, std::deque<PCMWave>> recvPool_;
+    // 前のSocketからの辺
+    // 書くのは前のSocketのwrite()、読むのはemitPool()だけ
+    struct Edge
+    {
+        SocketPtr prev;
+        SPSCRing<PCMWavePtr> pool;
+        // (溜まっている数 << 1) | 前のSocketが生きているか
+        std::atomic<int> state;
+        // 足し合わせるときに掛ける
+        std::atomic<double> gain;
+
+        Edge(const SocketPtr& prev_, bool isLive)
+            : prev(prev_), pool(EDGE_CAPACITY), state(isLive ? 1 : 0), gain(1.0)
+        {}
+
+        static bool isLive(int state) { return state & 1; }
+        static int count(int state) { return state >> 1; }
+        // 生きているのにまだ来ていない
+        static bool isWaiting(int state) { return isLive(state) && count(state) == 0; }
+    };
+
+private:
+    // 入手可能性の伝搬は同時に一つだけ
+    static boost::mutex availabilityMtx_;
+
+    boost::mutex sendMtx_;
+    std::atomic<bool> canRecvFromPrev_, canSendToNext_;
+    // isAvailableSocket()の結果と、それを決める生きている辺の数
+    std::atomic<bool> isAvailable_;
+    std::atomic<int> liveInputs_;
+    // 生きているのに空の辺の数と、溜まっている総数
+    // 前者が0で後者が正ならemitPool()できる
+    std::atomic<int> waitingInputs_, queuedCount_;
+    std::vector<std::pair<SocketPtr, int>> nextSockets_;    // (socket, edge id)
+    // 辺は実行中にも追加されるので、配列は最初に確保して以後動かさない
+    std::vector<std::unique_ptr<Edge>> edges_;
+    std::atomic<int> edgeCount_;
+    // emitPool()を実行しているスレッドがあればtrue
+    // これを立てたスレッドだけがEdge::poolから読む
+    std::atomic<bool> isEmitting_;
+    // GraphSchedulerに組み込まれていればtrue
+    // このときonRecv()は積むだけで、処理はprocess()で行う
+    std::atomic<bool> isScheduled_;
+    // popOneFromEach()の作業領域。読み手しか触らない
+    std::vector<PCMWavePtr> mixWaves_;
+    std::vector<const double *> mixSrcs_;
+    std::vector<double> mixGains_;
     Unit &parent_;
 
 private:
+    void addNextSocket(const SocketPtr& next, int edgeId);
+    void updateEdgeState(Edge& edge, int countDiff, int liveValue);
+    // 以下二つはavailabilityMtx_を取ってから呼ぶ
+    // 入手可能性が変わったSocketをtouchedに積む
+    void updateAvailability(std::vector<SocketPtr>& touched);
+    void setEdgeLive(int edgeId, bool isLive, std::vector<SocketPtr>& touched);
+    void setCanSendToNext(bool canSend);
+
+    void lockPool();
+    void unlockPool();
+    void clearPool();
+    bool isReadyToEmit() const;
+    void tryEmit();
     void emitPool();
+    PCMWavePtr popOneFromEach();
+
+    // GraphScheduler用
+    void setScheduled(bool isScheduled) { isScheduled_ = isScheduled; }
+    void process(bool isClock);
+    std::vector<SocketPtr> getPrevSockets() const;
+    std::vector<SocketPtr> getNextSockets();
+    Unit& getParent() { return parent_; }
 
 public:
     Socket(Unit& parent);
@@ -44,52 +124,88 @@ public:
 
     void open();
     void close();
-    void addNextSocket(const SocketPtr& next);
+    // prevからこのSocketへの辺を張る
     void addPrevSocket(const SocketPtr& prev);
 
+    bool isAvailable() const { return isAvailable_; }
     bool canSendToNext() const { return canSendToNext_; }
     bool canRecvFromPrev() const { return canRecvFromPrev_; }
-
-    void write(const PCMWave& src);
-    void onRecv(const SocketPtr& sender, const PCMWave& src);
+    // prevから来るブロックに掛ける倍率。辺がなければfalse
+    bool setInputGain(const SocketPtr& prev, double gain);
+    // 辺ごとに溜まっている数を一行ずつ
+    void writeQueueDepths(std::ostream& os) const;
+    // 次のSocketへの辺に溜まっている数の最大
+    int getQueuedToNext();
+
+    void write(PCMWavePtr src);
+    void onRecv(int edgeId, PCMWavePtr src);
 };
 
 class Unit : public std::enable_shared_from_this<Unit>
 {
     friend void connect(const std::vector<UnitPtr>&, const std::vector<UnitPtr>&);
+    friend class GraphScheduler;
+    friend class Socket;
     
 private:
-    bool isAlive_;
+    // 統計を出すために、一度でも動かしたUnitを覚えておく
+    // 壊している途中のUnitに触らないよう、弱く持って統計を書く間だけ強く持つ
+    static boost::mutex registryMtx_;
+    static std::vector<std::weak_ptr<Unit>> registry_;
+
+    bool isAlive_, isRegistered_;
     boost::shared_mutex mtx_;
     SocketPtr socket_;
     std::atomic<int> isMute_;
+    std::string name_;
+    UnitStats stats_;
 
-    const PCMWave emptyWave_;
+    const PCMWavePtr emptyWave_;
 
 protected:
-    void send(const PCMWave& wave);
+    void send(PCMWavePtr wave);
     void setSocketStatus(bool isOpen);
+    void recordProcTime(long long ns) { stats_.procTime.record(ns); }
+    void recordWaitTime(long long ns) { stats_.waitTime.record(ns); }
+    void recordDrop() { stats_.drops.fetch_add(1, std::memory_order_relaxed); }
+    // 送った先でまだ処理されずに溜まっている数
+    int getOutputQueueDepth() { return socket_->getQueuedToNext(); }
 
 public:
     Unit();
     virtual ~Unit();
 
     void connectTo(const UnitPtr& next);
+    // prevからの入力を足し合わせるときの倍率
+    bool setInputGain(const UnitPtr& prev, double gain);
     void setMute(bool isMute);
 
     bool isAlive() const;
     bool isMute() const;
+    // 空ならstart()のときに型名が入る。統計の表示に使う
+    void setName(const std::string& name);
+    std::string getName();
+    const UnitStats& getStats() const { return stats_; }
+    void resetStats() { stats_.reset(); }
+    // 統計と入力の辺の溜まり具合
+    void writeStats(std::ostream& os);
+    static void writeAllStats(std::ostream& os);
+    static void resetAllStats();
+    // 登録されていて、まだ生きているUnit
+    static std::vector<std::shared_ptr<Unit>> getAllUnits();
     bool canSocketSendToNext() const { return socket_->canSendToNext(); }
     bool canSendContent() const { return isAlive() && !isMute() && canSocketSendToNext(); }
 
     void start();
     void stop();
-    void input(const PCMWave& wave);
+    void input(PCMWavePtr wave);
 
 //protected:    //TODO
     virtual void startImpl(){}
     virtual void stopImpl(){}
-    virtual void inputImpl(const PCMWave& wave){}
+    virtual void inputImpl(PCMWavePtr wave){}
+    // writeStats()にUnit固有の統計を書き足す
+    virtual void writeStatsImpl(std::ostream& os){}
 
 };
 
@@ -98,6 +214,14 @@ class ThreadOutUnit : public Unit
 private:
     std::unique_ptr<boost::thread> proc_;
     bool hasFinished_;
+    // update()の始まり、endWait()の後はそこからを測る
+    StopWatch<std::chrono::nanoseconds> watch_;
+
+protected:
+    // update()の中で、デバイスやネットワークを待ち終えたところで呼ぶ
+    // それまでの時間は待ちとして別に数え、処理時間には残りだけを数える
+    // 呼ばなければupdate()の全体が処理時間になる
+    void endWait();
 
 public:
     ThreadOutUnit()
@@ -108,7 +232,7 @@ public:
     void startImpl();
     void stopImpl();
     virtual void construct(){}
-    virtual PCMWave update() = 0;
+    virtual PCMWavePtr update() = 0;
     virtual void destruct() noexcept {}
 };
 
@@ -0,0 +1,89 @@
+#pragma once
+#ifndef ___SPSCRING_HPP___
+#define ___SPSCRING_HPP___
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// 固定長のリングバッファ
+// push()するスレッドとpop()するスレッドがそれぞれ一つなら、ロックなしで使える
+template<class T>
+class SPSCRing
+{
+private:
+    enum {
+        CACHE_LINE = 64,
+    };
+
+private:
+    // headとtailを別のキャッシュラインに置くため、間を一行分ずつ空ける
+    // alignasで揃えると、C++11のnewは揃えて確保しないので詰め物で離す
+    std::vector<T> slots_;
+    const size_t mask_;
+    char pad0_[CACHE_LINE];
+    std::atomic<size_t> head_;  // consumerが書く
+    char pad1_[CACHE_LINE];
+    std::atomic<size_t> tail_;  // producerが書く
+    char pad2_[CACHE_LINE];
+
+private:
+    static size_t roundUp(size_t n)
+    {
+        size_t ret = 1;
+        while(ret < n)  ret <<= 1;
+        return ret;
+    }
+
+    // non-copyable
+    SPSCRing(const SPSCRing&);
+    SPSCRing& operator=(const SPSCRing&);
+
+public:
+    // capacityは2の冪に切り上げられる
+    SPSCRing(size_t capacity)
+        : slots_(roundUp(capacity)), mask_(roundUp(capacity) - 1), head_(0), tail_(0)
+    {}
+
+    size_t capacity() const { return mask_ + 1; }
+    size_t size() const { return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire); }
+    bool empty() const { return size() == 0; }
+
+    // producer側
+    // 一杯ならfalseを返し、srcはそのまま
+    bool push(T&& src)
+    {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if(tail - head_.load(std::memory_order_acquire) > mask_)    return false;
+        slots_[tail & mask_] = std::move(src);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer側
+    // 空ならnullptr
+    T *front()
+    {
+        const size_t head = head_.load(std::memory_order_relaxed);
+        if(head == tail_.load(std::memory_order_acquire))   return nullptr;
+        return &slots_[head & mask_];
+    }
+
+    bool pop(T& dst)
+    {
+        T *item = front();
+        if(!item)   return false;
+        dst = std::move(*item);
+        *item = T();
+        head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        return true;
+    }
+
+    void clear()
+    {
+        T tmp;
+        while(pop(tmp));
+    }
+};
+
+#endif
@@ -1,6 +1,7 @@
 #include "units.hpp"
 #include "glutview.hpp"
 #include "calc.hpp"
+#include "kernel.hpp"
 #include "error.hpp"
 #include <cmath>
 #include <algorithm>
@@ -21,16 +22,39 @@ int VolumeFilter::getVolume()
     return volume_;
 }
 
-void VolumeFilter::inputImpl(const PCMWave& wave)
+void VolumeFilter::inputImpl(PCMWavePtr wave)
 {
     int vol = volume_;
-    PCMWave ret;
-    std::transform(
-        wave.begin(), wave.end(),
-        ret.begin(),
-        [vol](const PCMWave::Sample& s) { return s * divd(vol, 100); }
-    );
-    send(ret);
+    if(vol == 100){
+        send(std::move(wave));
+        return;
+    }
+
+    auto& dst = wave.mutate();
+    dispatchBufferSize<kernel::Scale>(dst.size(), dst.channels(), dst.raw(), divd(vol, 100));
+    send(std::move(wave));
+}
+
+///
+
+void ChannelSelectFilter::inputImpl(PCMWavePtr wave)
+{
+    // 選んだチャンネルがないブロックは、無音に見えないよう捨てたものとして数える
+    if(channel_ >= wave->channels()){
+        recordDrop();
+        return;
+    }
+
+    PCMWavePtr dst = PCMWavePool::getInstance().allocate();
+    const int n = wave->size(), channels = wave->channels();
+    // プールのブロックはbufferSizeフレームなので、違う長さのものは合わせる
+    if(dst->size() != wave->size()) dst.mutate().reshape(n, PCMWave::CHANNEL_COUNT);
+    const double *__restrict src = wave->raw();
+    double *__restrict d = dst.mutate().raw();
+    for(int i = 0;i < n;i++)
+        d[i * 2] = d[i * 2 + 1] = src[i * channels + channel_];
+    dst.mutate().setCaptureTime(wave->captureTime());
+    send(std::move(dst));
 }
 
 ///
@@ -57,9 +81,14 @@ void MicOutUnit::destruct() noexcept
     }
 }
 
-PCMWave MicOutUnit::update()
+PCMWavePtr MicOutUnit::update()
 {
-    return std::move(stream_->read());
+    // 読めた時点を録った時刻とする。ネットワークの受け手が遅れを測るのに使う
+    // 読み込みは録れるまで待つので、変換も含めて待ちとして数える
+    PCMWavePtr wave = stream_->read();
+    endWait();
+    if(wave)    wave.mutate().setCaptureTime(PCMWave::currentTime());
+    return wave;
 }
 
 ///
@@ -68,23 +97,17 @@ PrintInUnit::PrintInUnit(GroupBase& groupInfo)
     : groupInfo_(groupInfo)
 {}
 
-void PrintInUnit::inputImpl(const PCMWave& wave)
+void PrintInUnit::inputImpl(PCMWavePtr wave)
 {
-    groupInfo_.updateWaveLevel(*wave.begin());
+    const int right = wave->channels() > 1 ? 1 : 0;
+    groupInfo_.updateWaveLevel(PCMWave::Sample(wave->at(0, 0), wave->at(0, right)));
 }
 
 ///
 
-void NoiseGateFilter::inputImpl(const PCMWave& src)
+void NoiseGateFilter::inputImpl(PCMWavePtr wave)
 {
-    const double t = threshold_;
-    PCMWave next;
-    std::transform(
-        src.begin(), src.end(), next.begin(),
-        [t](const PCMWave::Sample& s) {
-            return PCMWave::Sample(isInEq(-t, s.left,  t) ? 0 : s.left,
-                                   isInEq(-t, s.right, t) ? 0 : s.right);
-        }
-    );
-    send(next);
+    auto& dst = wave.mutate();
+    dispatchBufferSize<kernel::Gate>(dst.size(), dst.channels(), dst.raw(), threshold_);
+    send(std::move(wave));
 }
@@ -23,9 +23,9 @@ public:
         : file_(filename)
     {}
 
-    void inputImpl(const PCMWave& wave)
+    void inputImpl(PCMWavePtr wave)
     {
-        file_.write(wave);
+        file_.write(*wave);
     }
 };
 
@@ -34,9 +34,9 @@ class ThroughFilter : public Unit
 public:
     ThroughFilter(){}
 
-    void inputImpl(const PCMWave& wave)
+    void inputImpl(PCMWavePtr wave)
     {
-        send(wave);
+        send(std::move(wave));
     }
 };
 
@@ -54,7 +54,24 @@ public:
     void addVolume(int diff);
     int getVolume();
 
-    void inputImpl(const PCMWave& wave);
+    void inputImpl(PCMWavePtr wave);
+};
+
+// 多チャンネルのブロックから1チャンネルを取り出して、ステレオのバスに流す
+// 左右には同じ値が入る
+class ChannelSelectFilter : public Unit
+{
+private:
+    const int channel_;
+
+public:
+    ChannelSelectFilter(int channel)
+        : channel_(channel)
+    {}
+
+    int getChannel() const { return channel_; }
+
+    void inputImpl(PCMWavePtr wave);
 };
 
 class MicOutUnit : public ThreadOutUnit
@@ -67,7 +84,7 @@ public:
     ~MicOutUnit(){}
 
     void construct();
-    PCMWave update();
+    PCMWavePtr update();
     void destruct() noexcept;
 };
 
@@ -84,7 +101,7 @@ public:
 
     void startImpl() { stream_->start(); }
     void stopImpl() { stream_->stop(); }
-    void inputImpl(const PCMWave& wave) { stream_->write(wave); }
+    void inputImpl(PCMWavePtr wave) { stream_->write(*wave); }
 };
 
 class PrintInUnit : public Unit
@@ -95,7 +112,7 @@ private:
 public:
 	PrintInUnit(GroupBase& groupInfo);
 
-	void inputImpl(const PCMWave& wave);
+	void inputImpl(PCMWavePtr wave);
 };
 
 class NoiseGateFilter : public Unit
@@ -108,7 +125,7 @@ public:
         : threshold_(threshold)
     {}
 
-    void inputImpl(const PCMWave& src);
+    void inputImpl(PCMWavePtr wave);
 };
 
 #endif
@@ -0,0 +1,84 @@
+#include "unitstat.hpp"
+#include <algorithm>
+
+LatencyHistogram::LatencyHistogram()
+{
+    reset();
+}
+
+int LatencyHistogram::toBucket(std::int64_t ns)
+{
+    if(ns < SUB_BUCKET_COUNT)   return std::max<std::int64_t>(ns, 0);
+    const int msb = 63 - __builtin_clzll(static_cast<unsigned long long>(ns));
+    const int octave = msb - SUB_BUCKET_BITS + 1;
+    const int sub = (ns >> (msb - SUB_BUCKET_BITS)) & (SUB_BUCKET_COUNT - 1);
+    return std::min(octave * SUB_BUCKET_COUNT + sub, static_cast<int>(BUCKET_COUNT) - 1);
+}
+
+std::int64_t LatencyHistogram::fromBucket(int bucket)
+{
+    if(bucket < SUB_BUCKET_COUNT)   return bucket;
+    const int octave = bucket / SUB_BUCKET_COUNT, sub = bucket % SUB_BUCKET_COUNT;
+    return (static_cast<std::int64_t>(SUB_BUCKET_COUNT + sub + 1) << (octave - 1)) - 1;
+}
+
+void LatencyHistogram::record(std::int64_t ns)
+{
+    buckets_[toBucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    std::int64_t prev = max_.load(std::memory_order_relaxed);
+    while(prev < ns && !max_.compare_exchange_weak(prev, ns, std::memory_order_relaxed));
+}
+
+void LatencyHistogram::reset()
+{
+    for(auto& bucket : buckets_)    bucket.store(0, std::memory_order_relaxed);
+    count_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+std::int64_t LatencyHistogram::percentile(double ratio) const
+{
+    // 読んでいる間にも増えるので、合計はバケットから数え直す
+    std::uint64_t counts[BUCKET_COUNT], total = 0;
+    for(int i = 0;i < BUCKET_COUNT;i++){
+        counts[i] = buckets_[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    if(total == 0)  return 0;
+
+    const std::uint64_t rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(ratio * total + 0.5));
+    std::uint64_t sum = 0;
+    for(int i = 0;i < BUCKET_COUNT;i++){
+        sum += counts[i];
+        if(sum >= rank) return std::min(fromBucket(i), max());
+    }
+    return max();
+}
+
+///
+
+void UnitStats::reset()
+{
+    procTime.reset();
+    waitTime.reset();
+    blocksIn.store(0, std::memory_order_relaxed);
+    blocksOut.store(0, std::memory_order_relaxed);
+    drops.store(0, std::memory_order_relaxed);
+}
+
+void UnitStats::write(std::ostream& os) const
+{
+    os <<
+        "p50:" << procTime.percentile(0.50) / 1000.0 << "us" <<
+        " p99:" << procTime.percentile(0.99) / 1000.0 << "us" <<
+        " max:" << procTime.max() / 1000.0 << "us" <<
+        " in:" << blocksIn.load(std::memory_order_relaxed) <<
+        " out:" << blocksOut.load(std::memory_order_relaxed) <<
+        " drop:" << drops.load(std::memory_order_relaxed);
+    if(waitTime.count() != 0){
+        os <<
+            " wait p50:" << waitTime.percentile(0.50) / 1000.0 << "us" <<
+            " p99:" << waitTime.percentile(0.99) / 1000.0 << "us";
+    }
+}
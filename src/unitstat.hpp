@@ -0,0 +1,67 @@
+#pragma once
+#ifndef ___UNITSTAT_HPP___
+#define ___UNITSTAT_HPP___
+
+// Unitごとの処理時間やブロック数の統計
+// 書くのは処理中のスレッド、読むのはコマンドから
+// どちらもロックなしで、読む側は多少古い値が見えてもよい
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+
+// 処理時間[ns]のヒストグラム
+// 2の冪ごとの区間をさらにSUB_BUCKET_COUNT等分するので、誤差は1/SUB_BUCKET_COUNT以下
+class LatencyHistogram
+{
+public:
+    enum {
+        SUB_BUCKET_BITS = 2,
+        SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS,
+        OCTAVE_COUNT = 40,  // 2^40 ns ≒ 18分まで
+        BUCKET_COUNT = OCTAVE_COUNT * SUB_BUCKET_COUNT,
+    };
+
+private:
+    std::atomic<std::uint64_t> buckets_[BUCKET_COUNT];
+    std::atomic<std::uint64_t> count_;
+    std::atomic<std::int64_t> max_;
+
+private:
+    static int toBucket(std::int64_t ns);
+    static std::int64_t fromBucket(int bucket);     // 区間の上端
+
+    // non-copyable
+    LatencyHistogram(const LatencyHistogram&);
+    LatencyHistogram& operator=(const LatencyHistogram&);
+
+public:
+    LatencyHistogram();
+
+    void record(std::int64_t ns);
+    void reset();
+
+    std::uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    std::int64_t max() const { return max_.load(std::memory_order_relaxed); }
+    // ratioは0から1。記録がなければ0
+    std::int64_t percentile(double ratio) const;
+};
+
+struct UnitStats
+{
+    LatencyHistogram procTime;
+    // ThreadOutUnitがデバイスやネットワークを待った時間。procTimeには含めない
+    LatencyHistogram waitTime;
+    std::atomic<std::uint64_t> blocksIn, blocksOut, drops;
+
+    UnitStats()
+        : blocksIn(0), blocksOut(0), drops(0)
+    {}
+
+    void reset();
+    // p50/p99/max [us] と各カウンタを一行で
+    // 待ちを記録したUnitなら、その p50/p99 [us] も足す
+    void write(std::ostream& os) const;
+};
+
+#endif
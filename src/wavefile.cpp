@@ -1,28 +1,22 @@
 #include "wavefile.hpp"
 #include "pcmwave.hpp"
 #include <cassert>
-
-PCMWave::Sample makeSample(std::int16_t left, std::int16_t right)
-{
-    PCMWave::Sample ret(
-        left / static_cast<double>(0x7FFF),
-        right / static_cast<double>(0x7FFF));
-    return std::move(ret);
-}
+#include <vector>
 
 WaveInFile::WaveInFile(const std::string& filename)
-    : ifs_(filename, std::ios::in | std::ios::binary)
+    : ifs_(filename, std::ios::in | std::ios::binary), channels_(0)
 {
     assert(ifs_);
 
     PCMWaveFileHeader header;
     ifs_.read(reinterpret_cast<char *>(&header), sizeof(header));
     assert(header.format == 1);
-    assert(header.channel == PCMWave::CHANNEL_COUNT);
-    assert(header.sampleRate == PCMWave::SAMPLE_RATE);
-    assert(header.bytePerSec == PCMWave::BYTE_PER_SEC);
-    assert(header.blockSize == PCMWave::BLOCK_SIZE);
+    assert(1 <= header.channel && header.channel <= PCMWave::MAX_CHANNEL_COUNT);
+    assert(header.sampleRate == PCMWave::sampleRate());
+    assert(header.bytePerSec == PCMWave::bytePerSec(header.channel));
+    assert(header.blockSize == PCMWave::blockSize(header.channel));
     assert(header.bitPerSample == PCMWave::BIT_COUNT);
+    channels_ = header.channel;
 }
 
 bool WaveInFile::isEOF() const
@@ -32,15 +26,15 @@ bool WaveInFile::isEOF() const
 
 PCMWave WaveInFile::read()
 {
-    std::array<std::int16_t, PCMWave::BUFFER_SIZE * PCMWave::CHANNEL_COUNT> buffer;
-    ifs_.read(reinterpret_cast<char *>(buffer.data()), PCMWave::BUFFER_SIZE * PCMWave::CHANNEL_COUNT * 2);
+    std::vector<std::int16_t> buffer(PCMWave::bufferSize() * channels_);
+    ifs_.read(reinterpret_cast<char *>(buffer.data()), buffer.size() * 2);
 
-    int readSize = ifs_.gcount() / (PCMWave::CHANNEL_COUNT * 2);
-    PCMWave ret;
-    for(int i = 0;i < readSize;i++)
-        ret.at(i) = makeSample(buffer.at(i * 2), buffer.at(i * 2 + 1));
-    for(int i = readSize;i < PCMWave::BUFFER_SIZE;i++)
-        ret.at(i) = PCMWave::Sample(0.0, 0.0);
+    // 足りない分は無音のまま
+    int readCount = ifs_.gcount() / 2;
+    PCMWave ret(channels_);
+    double *dst = ret.raw();
+    for(int i = 0;i < readCount;i++)
+        dst[i] = buffer.at(i) / static_cast<double>(0x7FFF);
 
     return std::move(ret);
 }
@@ -48,7 +42,8 @@ PCMWave WaveInFile::read()
 ///
 
 WaveOutFile::WaveOutFile(const std::string& filename)
-    : ofs_(filename, std::ios::out | std::ios::binary | std::ios::trunc)
+    : ofs_(filename, std::ios::out | std::ios::binary | std::ios::trunc),
+      channels_(0)
 {
     assert(ofs_);
     ofs_.seekp(sizeof(PCMWaveFileHeader), std::ios::beg);
@@ -59,10 +54,11 @@ WaveOutFile::~WaveOutFile()
     int size = ofs_.tellp();
     PCMWaveFileHeader header(0);
     header.size = size - 8;
-    header.channel = PCMWave::CHANNEL_COUNT;
-    header.sampleRate = PCMWave::SAMPLE_RATE;
-    header.bytePerSec = PCMWave::BYTE_PER_SEC;
-    header.blockSize = PCMWave::BLOCK_SIZE;
+    const int channels = channels_ != 0 ? channels_ : PCMWave::CHANNEL_COUNT;
+    header.channel = channels;
+    header.sampleRate = PCMWave::sampleRate();
+    header.bytePerSec = PCMWave::bytePerSec(channels);
+    header.blockSize = PCMWave::blockSize(channels);
     header.bitPerSample = PCMWave::BIT_COUNT;
     header.dataSize = size - 44;
 
@@ -72,11 +68,14 @@ WaveOutFile::~WaveOutFile()
 
 void WaveOutFile::write(const PCMWave& wave)
 {
-    for(auto s : wave){
-        std::int16_t buf = 0;
-        buf = s.left * 0x7FFF;
-        ofs_.write(reinterpret_cast<char *>(&buf), 2);
-        buf = s.right * 0x7FFF;
+    // 途中でチャンネル数は変えられない
+    if(channels_ == 0)  channels_ = wave.channels();
+    if(wave.channels() != channels_)    return;
+
+    const int n = wave.size() * channels_;
+    const double *src = wave.raw();
+    for(int i = 0;i < n;i++){
+        std::int16_t buf = src[i] * 0x7FFF;
         ofs_.write(reinterpret_cast<char *>(&buf), 2);
     }
 }
@@ -39,11 +39,13 @@ class WaveInFile
 {
 private:
     std::ifstream ifs_;
+    int channels_;
 
 public:
     WaveInFile(const std::string& filename);
     ~WaveInFile(){}
 
+    int channels() const { return channels_; }
     bool isEOF() const;
     PCMWave read();
 };
@@ -52,6 +54,7 @@ class WaveOutFile
 {
 private:
     std::ofstream ofs_;
+    int channels_;  // 最初に書いたブロックのチャンネル数
 
 public:
     WaveOutFile(const std::string& filename);
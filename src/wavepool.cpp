@@ -0,0 +1,53 @@
+#include "wavepool.hpp"
+#include "helper.hpp"
+
+PCMWavePool& PCMWavePool::getInstance()
+{
+    // 終了時にまだ生きているブロックが返ってくるかもしれないので破棄しない
+    static PCMWavePool *instance = new PCMWavePool();
+    return *instance;
+}
+
+void PCMWavePool::recycle(PCMWaveBlock *block)
+{
+    {
+        SCOPED_LOCK(mtx_);
+        if(freeBlocks_.size() < MAX_FREE_COUNT){
+            freeBlocks_.push_back(block);
+            return;
+        }
+    }
+    delete block;
+}
+
+PCMWavePtr PCMWavePool::allocate(int channels)
+{
+    PCMWaveBlock *block = nullptr;
+    {
+        SCOPED_LOCK(mtx_);
+        if(!freeBlocks_.empty()){
+            block = freeBlocks_.back();
+            freeBlocks_.pop_back();
+        }
+    }
+    if(!block)  block = new PCMWaveBlock(*this);
+    auto& wave = block->wave_;
+    if(wave.size() != PCMWave::bufferSize() || wave.channels() != channels)
+        wave.reshape(PCMWave::bufferSize(), channels);
+    wave.setCaptureTime(0);
+    return PCMWavePtr(block);
+}
+
+PCMWavePtr PCMWavePool::allocateZero(int channels)
+{
+    PCMWavePtr ret = allocate(channels);
+    ret.block_->wave_.fill(0.0);
+    return ret;
+}
+
+PCMWavePtr PCMWavePool::allocateCopy(const PCMWave& src)
+{
+    PCMWavePtr ret = allocate(src.channels());
+    ret.block_->wave_ = src;
+    return ret;
+}
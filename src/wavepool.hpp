@@ -0,0 +1,141 @@
+#pragma once
+#ifndef ___WAVEPOOL_HPP___
+#define ___WAVEPOOL_HPP___
+
+#include "pcmwave.hpp"
+#include <boost/thread.hpp>
+#include <atomic>
+#include <vector>
+
+class PCMWavePool;
+
+// 参照カウント付きのPCMWave
+// カウントが0になるとプールに返却される
+class PCMWaveBlock
+{
+    friend class PCMWavePool;
+    friend class PCMWavePtr;
+
+private:
+    PCMWave wave_;
+    std::atomic<int> refCount_;
+    PCMWavePool& pool_;
+
+private:
+    PCMWaveBlock(PCMWavePool& pool)
+        : refCount_(0), pool_(pool)
+    {}
+    // non-copyable
+    PCMWaveBlock(const PCMWaveBlock&);
+    PCMWaveBlock& operator=(const PCMWaveBlock&);
+
+    void addRef() { refCount_.fetch_add(1, std::memory_order_relaxed); }
+    inline void release();
+};
+
+// PCMWaveBlockへのハンドル
+// コピーはポインタのコピーのみ。中身は共有されている間は不変で、
+// 書き換えるときはmutate()でcopy-on-writeする
+class PCMWavePtr
+{
+    friend class PCMWavePool;
+
+private:
+    PCMWaveBlock *block_;
+
+private:
+    explicit PCMWavePtr(PCMWaveBlock *block)
+        : block_(block)
+    {
+        if(block_)  block_->addRef();
+    }
+
+public:
+    PCMWavePtr()
+        : block_(nullptr)
+    {}
+    PCMWavePtr(const PCMWavePtr& rhs)
+        : block_(rhs.block_)
+    {
+        if(block_)  block_->addRef();
+    }
+    PCMWavePtr(PCMWavePtr&& rhs) noexcept
+        : block_(rhs.block_)
+    {
+        rhs.block_ = nullptr;
+    }
+    ~PCMWavePtr() { reset(); }
+
+    PCMWavePtr& operator=(PCMWavePtr rhs) noexcept
+    {
+        std::swap(block_, rhs.block_);
+        return *this;
+    }
+
+    void reset()
+    {
+        if(block_)  block_->release();
+        block_ = nullptr;
+    }
+
+    explicit operator bool() const { return block_ != nullptr; }
+    const PCMWave& operator*() const { return block_->wave_; }
+    const PCMWave *operator->() const { return &block_->wave_; }
+
+    // 他に参照しているハンドルがなければtrue
+    bool unique() const { return block_ && block_->refCount_.load(std::memory_order_acquire) == 1; }
+
+    // 書き込み用の参照を得る
+    // 共有されていればプールから新しいブロックを取ってコピーし、それを指すようにする
+    // 何も指していなければ、中身が不定のステレオのブロックを取る
+    inline PCMWave& mutate();
+};
+
+class PCMWavePool  // thread safe
+{
+    friend class PCMWaveBlock;
+
+private:
+    enum {
+        MAX_FREE_COUNT = 256,
+    };
+
+private:
+    boost::mutex mtx_;
+    std::vector<PCMWaveBlock *> freeBlocks_;
+
+private:
+    PCMWavePool(){}
+    ~PCMWavePool(){}
+    // non-copyable
+    PCMWavePool(const PCMWavePool&);
+    PCMWavePool& operator=(const PCMWavePool&);
+
+    void recycle(PCMWaveBlock *block);
+
+public:
+    static PCMWavePool& getInstance();
+
+    // 中身は不定
+    PCMWavePtr allocate(int channels = PCMWave::CHANNEL_COUNT);
+    // 無音で埋めたもの
+    PCMWavePtr allocateZero(int channels = PCMWave::CHANNEL_COUNT);
+    PCMWavePtr allocateCopy(const PCMWave& src);
+};
+
+///
+
+void PCMWaveBlock::release()
+{
+    if(refCount_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        pool_.recycle(this);
+}
+
+PCMWave& PCMWavePtr::mutate()
+{
+    if(!block_)         *this = PCMWavePool::getInstance().allocate();
+    else if(!unique())  *this = PCMWavePool::getInstance().allocateCopy(**this);
+    return block_->wave_;
+}
+
+#endif
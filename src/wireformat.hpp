@@ -0,0 +1,195 @@
+#pragma once
+#ifndef ___WIREFORMAT_HPP___
+#define ___WIREFORMAT_HPP___
+
+// Connectionで流すフレームの形式
+//
+// フレーム = ヘッダ(12バイト) + ボディ(lengthバイト)
+//   u32 magic      "CBLS"
+//   u8  version
+//   u8  type       FrameType
+//   u16 stream     一本の接続に複数の流れを載せるときの番号。載せないなら0
+//   u32 length     ボディの長さ
+// 数値は全てlittle endian
+//
+// ボディの形はtypeごとに決まっていて、FrameCodec<T>がそれを知っている
+
+#include <boost/predef/other/endian.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+
+namespace wire {
+
+enum {
+    MAGIC = 0x534C4243,     // "CBLS"
+    // 2: WAVEの前置きに連番と録った時刻を足した
+    // 3: HELLOに送り手の番号を足した
+    VERSION = 3,
+    HEADER_SIZE = 12,
+    // ヘッダとボディの前置きを合わせた最大の長さ
+    MAX_HEAD_SIZE = 32,
+    // WAVE_FRAGMENTのボディ
+    //   u32 seq        ブロックの連番
+    //   u16 index      何番目の断片か
+    //   u16 count      断片の数
+    //   WAVEと同じ20バイトの前置き
+    //   PCM(圧縮したならその符号)のindex * FRAGMENT_PAYLOAD_SIZEバイト目から
+    FRAGMENT_PREFIX_SIZE = 28,
+    // PCMの最大長。IPとUDPのヘッダを足してもイーサネットのMTUに収まる
+    FRAGMENT_PAYLOAD_SIZE = 1400,
+};
+
+enum FrameType {
+    FRAME_WAVE = 1,
+    FRAME_WAVE_FRAGMENT = 2,    // UDP用。1データグラムに1フレーム
+    // TCPで繋いだ直後に送り手から一度、受け手が同じ形で一度返す
+    //   u32 sampleRate
+    //   u32 bufferSize
+    //   u8  sampleFormat   送り手が使う形式
+    //   u8  status         HelloStatus。送り手からは常にHELLO_OK
+    //   u16 reserved       0
+    //   u32 sender         送り手ごとに決まる番号。受け手は0で返す
+    //                      同じホストの送り手どうしを見分け、繋ぎ直した送り手だけを置き換えるのに使う
+    FRAME_HELLO = 3,
+};
+
+enum SampleFormat {
+    SAMPLE_FLOAT64 = 0,
+    SAMPLE_LOSSLESS16 = 1,  // 16bitに量子化してLosslessCodecで圧縮したもの
+    SAMPLE_INT16 = 2,
+    SAMPLE_INT24 = 3,       // 3バイトに詰める
+    SAMPLE_FLOAT32 = 4,
+};
+
+enum HelloStatus {
+    HELLO_OK = 0,
+    HELLO_FORMAT_MISMATCH = 1,  // sampleRateかbufferSizeが違う
+    HELLO_UNSUPPORTED = 2,      // sampleFormatを知らない
+};
+
+// 1サンプルの長さ。可変長や不明な形式なら0
+inline size_t sampleBytes(int format)
+{
+    switch(format)
+    {
+    case SAMPLE_FLOAT64:    return 8;
+    case SAMPLE_INT16:      return 2;
+    case SAMPLE_INT24:      return 3;
+    case SAMPLE_FLOAT32:    return 4;
+    default:                return 0;
+    }
+}
+
+inline bool isValidSampleFormat(int format)
+{
+    return format == SAMPLE_LOSSLESS16 || sampleBytes(format) != 0;
+}
+
+#if BOOST_ENDIAN_LITTLE_BYTE
+const bool IS_LITTLE_ENDIAN_HOST = true;
+#else
+const bool IS_LITTLE_ENDIAN_HOST = false;
+#endif
+
+inline void storeLE16(char *dst, std::uint16_t value)
+{
+    dst[0] = static_cast<char>(value);
+    dst[1] = static_cast<char>(value >> 8);
+}
+
+inline void storeLE32(char *dst, std::uint32_t value)
+{
+    for(int i = 0;i < 4;i++)    dst[i] = static_cast<char>(value >> (i * 8));
+}
+
+inline void storeLE64(char *dst, std::uint64_t value)
+{
+    for(int i = 0;i < 8;i++)    dst[i] = static_cast<char>(value >> (i * 8));
+}
+
+inline std::uint16_t loadLE16(const char *src)
+{
+    const unsigned char *s = reinterpret_cast<const unsigned char *>(src);
+    return static_cast<std::uint16_t>(s[0] | (s[1] << 8));
+}
+
+inline std::uint32_t loadLE32(const char *src)
+{
+    const unsigned char *s = reinterpret_cast<const unsigned char *>(src);
+    std::uint32_t ret = 0;
+    for(int i = 0;i < 4;i++)    ret |= static_cast<std::uint32_t>(s[i]) << (i * 8);
+    return ret;
+}
+
+inline std::uint64_t loadLE64(const char *src)
+{
+    const unsigned char *s = reinterpret_cast<const unsigned char *>(src);
+    std::uint64_t ret = 0;
+    for(int i = 0;i < 8;i++)    ret |= static_cast<std::uint64_t>(s[i]) << (i * 8);
+    return ret;
+}
+
+// width バイトの値の列のバイト順をその場で入れ替える
+// little endianのホストでは何もしない
+inline void toLittleEndian(char *data, size_t count, size_t width)
+{
+    if(IS_LITTLE_ENDIAN_HOST)   return;
+    for(size_t i = 0;i < count;i++) std::reverse(data + i * width, data + i * width + width);
+}
+
+inline void toLittleEndian64(char *data, size_t count)
+{
+    toLittleEndian(data, count, 8);
+}
+
+struct FrameHeader
+{
+    std::uint8_t type;
+    std::uint16_t stream;
+    std::uint32_t length;
+
+    FrameHeader()
+        : type(0), stream(0), length(0)
+    {}
+    FrameHeader(std::uint8_t type_, std::uint32_t length_, std::uint16_t stream_ = 0)
+        : type(type_), stream(stream_), length(length_)
+    {}
+
+    void store(char *dst) const
+    {
+        storeLE32(dst, MAGIC);
+        dst[4] = static_cast<char>(VERSION);
+        dst[5] = static_cast<char>(type);
+        storeLE16(dst + 6, stream);
+        storeLE32(dst + 8, length);
+    }
+
+    // magicとversionが合わなければfalse
+    bool load(const char *src)
+    {
+        if(loadLE32(src) != MAGIC)  return false;
+        if(static_cast<std::uint8_t>(src[4]) != VERSION)    return false;
+        type = static_cast<std::uint8_t>(src[5]);
+        stream = loadLE16(src + 6);
+        length = loadLE32(src + 8);
+        return true;
+    }
+};
+
+}   // namespace wire
+
+// Tをフレームのボディに詰める方法
+// 特殊化して以下を用意する
+//   TYPE, PREFIX_SIZE
+//   maxLength()                          今のセッションで正しいボディ(前置きを含む)の長さの上限
+//   check(restLength, prefix)            前置きと残りのボディの長さが正しいか。何も確保しない
+//   encode(t, prefix, scratch, buffers)  前置きを書き、残りのボディをbuffersに積んでその長さを返す
+//   prepare(t, restLength, prefix, scratch, body)
+//                                        前置きを読んでtを用意し、残りのボディを読み込む先を返す
+//                                        tへ直接読めないときはscratchを使ってよい
+//   finish(t, scratch)                   読み込み後の後始末。不正ならfalse
+//   stream(t), setStream(t, stream)      ヘッダのstreamとの受け渡し
+template<class T> struct FrameCodec;
+
+#endif
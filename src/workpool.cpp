@@ -0,0 +1,138 @@
+#include "workpool.hpp"
+#include "helper.hpp"
+#include "error.hpp"
+
+WorkStealingPool::WorkStealingPool(int threadCount, const Body& body)
+    : threadCount_(threadCount > 0 ? threadCount : std::max(1u, boost::thread::hardware_concurrency())),
+      body_(body), epoch_(0), hasFinished_(false), pending_(0), activeWorkers_(0),
+      queued_(0), sleepers_(0)
+{
+    for(int i = 0;i < threadCount_;i++)
+        queues_.push_back(make_unique<WorkQueue>());
+    for(int i = 1;i < threadCount_;i++)
+        workers_.push_back(make_unique<boost::thread>([this, i]() { workerMain(i); }));
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    {
+        SCOPED_LOCK(mtx_);
+        hasFinished_ = true;
+    }
+    cond_.notify_all();
+    for(auto& worker : workers_)    worker->join();
+}
+
+void WorkStealingPool::push(int index, int task)
+{
+    pending_++;
+    {
+        auto& queue = *queues_.at(index);
+        SCOPED_LOCK(queue.mtx);
+        queue.tasks.push_back(task);
+    }
+    queued_++;
+    wake();
+}
+
+void WorkStealingPool::wake()
+{
+    // 眠る側は数を増やしてから条件を見るので、ここで0なら起こさなくても気づく
+    if(sleepers_ == 0)  return;
+    SCOPED_LOCK(idleMtx_);
+    idleCond_.notify_all();
+}
+
+template<class Pred>
+void WorkStealingPool::waitUntil(Pred pred)
+{
+    for(int i = 0;i < SPIN_COUNT;i++){
+        if(pred())  return;
+        boost::this_thread::yield();
+    }
+    boost::mutex::scoped_lock lock(idleMtx_);
+    sleepers_++;
+    while(!pred())  idleCond_.wait(lock);
+    sleepers_--;
+}
+
+bool WorkStealingPool::pop(int index, int& task)
+{
+    // 自分のキューは後ろから取る（直前に積んだ下流の仕事を続けて処理する）
+    auto& queue = *queues_.at(index);
+    SCOPED_LOCK(queue.mtx);
+    if(queue.tasks.empty()) return false;
+    task = queue.tasks.back();
+    queue.tasks.pop_back();
+    queued_--;
+    return true;
+}
+
+bool WorkStealingPool::steal(int index, int& task)
+{
+    // 他のキューは前から盗む
+    for(int i = 1;i < threadCount_;i++){
+        auto& queue = *queues_.at((index + i) % threadCount_);
+        SCOPED_LOCK(queue.mtx);
+        if(queue.tasks.empty()) continue;
+        task = queue.tasks.front();
+        queue.tasks.pop_front();
+        queued_--;
+        return true;
+    }
+    return false;
+}
+
+void WorkStealingPool::work(int index)
+{
+    int task;
+    while(pending_ > 0){
+        if(pop(index, task) || steal(index, task)){
+            try{
+                body_(index, task);
+            }
+            catch(std::exception& ex){
+                ZARU_CHECK(ex.what());
+            }
+            // 後続はbody_の中で積まれて数えられているので、ここで0にはならない
+            // 最後の一つなら、眠っているスレッドを起こして抜けさせる
+            if(--pending_ == 0) wake();
+        }
+        else{
+            // 誰かが処理している仕事(スピーカーへの書き込みなど)が終わって後続が積まれるのを待つ
+            waitUntil([this]() { return queued_ > 0 || pending_ == 0; });
+        }
+    }
+}
+
+void WorkStealingPool::workerMain(int index)
+{
+    int epoch = 0;
+    for(;;){
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            while(!hasFinished_ && epoch == epoch_) cond_.wait(lock);
+            if(hasFinished_)    return;
+            epoch = epoch_;
+        }
+        work(index);
+        if(--activeWorkers_ == 0)   wake();
+    }
+}
+
+void WorkStealingPool::run(const std::vector<int>& roots)
+{
+    for(size_t i = 0;i < roots.size();i++)
+        push(i % threadCount_, roots.at(i));
+
+    activeWorkers_ = threadCount_ - 1;
+    {
+        SCOPED_LOCK(mtx_);
+        epoch_++;
+    }
+    cond_.notify_all();
+
+    work(0);
+    // 全員が抜けるまで待たないと、次のrun()と混ざる
+    waitUntil([this]() { return activeWorkers_ == 0; });
+}
@@ -0,0 +1,71 @@
+#pragma once
+#ifndef ___WORKPOOL_HPP___
+#define ___WORKPOOL_HPP___
+
+#include <boost/thread.hpp>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// 仕事をスレッドごとの両端キューに積み、暇なスレッドは他から盗む
+// run()の呼び出し元も0番目のスレッドとして働き、積まれた仕事が全て終わるまで返らない
+// 盗むものがなければ少しだけ回って待ち、それでもなければ次に積まれるまで眠る
+class WorkStealingPool
+{
+public:
+    // (働いているスレッドの番号, 仕事の番号)
+    using Body = std::function<void(int, int)>;
+
+private:
+    enum {
+        // 眠る前に見に行く回数
+        SPIN_COUNT = 64,
+    };
+
+    struct WorkQueue
+    {
+        boost::mutex mtx;
+        std::deque<int> tasks;
+    };
+
+private:
+    const int threadCount_;
+    std::vector<std::unique_ptr<WorkQueue>> queues_;
+    std::vector<std::unique_ptr<boost::thread>> workers_;
+    Body body_;
+
+    boost::mutex mtx_;
+    boost::condition_variable cond_;
+    int epoch_;
+    bool hasFinished_;
+    std::atomic<int> pending_, activeWorkers_;
+
+    // 仕事を待って眠っているスレッド
+    boost::mutex idleMtx_;
+    boost::condition_variable idleCond_;
+    // まだ誰も取っていない仕事の数と、眠っているスレッドの数
+    std::atomic<int> queued_, sleepers_;
+
+private:
+    bool pop(int index, int& task);
+    bool steal(int index, int& task);
+    void wake();
+    template<class Pred> void waitUntil(Pred pred);
+    void work(int index);
+    void workerMain(int index);
+
+public:
+    // threadCount <= 0 ならコア数
+    WorkStealingPool(int threadCount, const Body& body);
+    ~WorkStealingPool();
+
+    int getThreadCount() const { return threadCount_; }
+
+    // Bodyの中から後続の仕事を積む
+    void push(int index, int task);
+    void run(const std::vector<int>& roots);
+};
+
+#endif